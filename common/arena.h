@@ -0,0 +1,333 @@
+#ifndef RTBENCH_COMMON_ARENA_H_
+#define RTBENCH_COMMON_ARENA_H_
+
+#include <stddef.h>
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+// Bump allocation for data that lives for one frame or less. Every thread
+// has its own scratch arena, so allocating never takes a lock; memory is
+// given back all at once when a scope ends or the frame is reset, and the
+// chunks behind it are kept for the next frame.
+namespace arena {
+
+// Cache line size: no two threads' data share a line.
+const size_t kAlignment = 64;
+const size_t kHugePageSize = 2 << 20;
+const size_t kChunkSize = kHugePageSize;
+
+struct Counters {
+  // Allocations served by arenas.
+  long long allocations = 0;
+  long long bytes = 0;
+  // Allocations that went to the system: arena chunks and framebuffers.
+  long long system_allocations = 0;
+  long long system_bytes = 0;
+};
+
+inline std::atomic<long long>* GetCounterStorage() {
+  static std::atomic<long long> counters[4];
+  return counters;
+}
+
+inline Counters GetCounters() {
+  std::atomic<long long>* storage = GetCounterStorage();
+  Counters counters;
+  counters.allocations = storage[0];
+  counters.bytes = storage[1];
+  counters.system_allocations = storage[2];
+  counters.system_bytes = storage[3];
+  return counters;
+}
+
+inline Counters operator-(const Counters& a, const Counters& b) {
+  Counters counters;
+  counters.allocations = a.allocations - b.allocations;
+  counters.bytes = a.bytes - b.bytes;
+  counters.system_allocations = a.system_allocations - b.system_allocations;
+  counters.system_bytes = a.system_bytes - b.system_bytes;
+  return counters;
+}
+
+inline void CountSystemAllocation(size_t size) {
+  GetCounterStorage()[2] += 1;
+  GetCounterStorage()[3] += static_cast<long long>(size);
+}
+
+inline size_t RoundUp(size_t size, size_t alignment) {
+  return (size + alignment - 1) / alignment * alignment;
+}
+
+inline size_t GetPagesSize(size_t size) {
+  return RoundUp(size, size >= kHugePageSize ? kHugePageSize : 4096);
+}
+
+// Page-aligned memory. Sizes from kHugePageSize up use huge pages where
+// the system has them: reserved ones first, transparent ones otherwise.
+inline void* AllocatePages(size_t size) {
+  size = GetPagesSize(size);
+  CountSystemAllocation(size);
+#ifdef _WIN32
+  // Large pages need the lock pages privilege, which is rarely granted.
+  const size_t large_page = GetLargePageMinimum();
+  if (large_page != 0 && size >= kHugePageSize && size % large_page == 0) {
+    void* data = VirtualAlloc(nullptr, size,
+                              MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES,
+                              PAGE_READWRITE);
+    if (data != nullptr) {
+      return data;
+    }
+  }
+  void* data = VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT,
+                            PAGE_READWRITE);
+  if (data == nullptr) {
+    throw std::bad_alloc();
+  }
+#else
+  void* data = MAP_FAILED;
+#ifdef MAP_HUGETLB
+  if (size >= kHugePageSize) {
+    data = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  }
+#endif
+  if (data == MAP_FAILED) {
+    data = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED) {
+      throw std::bad_alloc();
+    }
+#ifdef MADV_HUGEPAGE
+    if (size >= kHugePageSize) {
+      madvise(data, size, MADV_HUGEPAGE);
+    }
+#endif
+  }
+#endif
+  return data;
+}
+
+inline void FreePages(void* data, size_t size) {
+#ifdef _WIN32
+  (void)size;
+  VirtualFree(data, 0, MEM_RELEASE);
+#else
+  munmap(data, GetPagesSize(size));
+#endif
+}
+
+class Arena;
+
+// All live arenas, so that a frame boundary can reset them together.
+struct Registry {
+  std::mutex mutex;
+  std::vector<Arena*> arenas;
+};
+
+inline Registry& GetRegistry() {
+  static Registry registry;
+  return registry;
+}
+
+class Arena {
+ public:
+  // Position to rewind to, see Scope.
+  struct Mark {
+    size_t chunk;
+    size_t used;
+  };
+
+  Arena() : current_(0), used_(0) {
+    Registry& registry = GetRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    registry.arenas.push_back(this);
+  }
+
+  Arena(const Arena&) = delete;
+  Arena& operator=(const Arena&) = delete;
+
+  ~Arena() {
+    Release();
+    Registry& registry = GetRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    registry.arenas.erase(std::find(registry.arenas.begin(),
+                                    registry.arenas.end(), this));
+  }
+
+  void* Allocate(size_t size, size_t alignment = kAlignment) {
+    GetCounterStorage()[0] += 1;
+    GetCounterStorage()[1] += static_cast<long long>(size);
+
+    size_t offset = RoundUp(used_, alignment);
+    while (current_ < chunks_.size() &&
+           offset + size > chunks_[current_].size) {
+      ++current_;
+      offset = 0;
+    }
+    if (current_ == chunks_.size()) {
+      size_t chunk_size = std::max(RoundUp(size, kChunkSize),
+                                   chunks_.empty() ? kChunkSize :
+                                   2 * chunks_.back().size);
+      Chunk chunk;
+      chunk.data = static_cast<char*>(AllocatePages(chunk_size));
+      chunk.size = GetPagesSize(chunk_size);
+      chunks_.push_back(chunk);
+      offset = 0;
+    }
+    used_ = offset + size;
+    return chunks_[current_].data + offset;
+  }
+
+  Mark GetMark() const {
+    Mark mark;
+    mark.chunk = current_;
+    mark.used = used_;
+    return mark;
+  }
+
+  void Rewind(const Mark& mark) {
+    current_ = mark.chunk;
+    used_ = mark.used;
+  }
+
+  // Frees everything. A frame that needed several chunks leaves one chunk
+  // of their total size, so the next frame fits without system calls.
+  void Reset() {
+    if (chunks_.size() > 1) {
+      size_t total = 0;
+      for (const Chunk& chunk : chunks_) {
+        total += chunk.size;
+      }
+      Release();
+      Chunk chunk;
+      chunk.data = static_cast<char*>(AllocatePages(total));
+      chunk.size = GetPagesSize(total);
+      chunks_.push_back(chunk);
+    }
+    current_ = 0;
+    used_ = 0;
+  }
+
+  size_t capacity() const {
+    size_t total = 0;
+    for (const Chunk& chunk : chunks_) {
+      total += chunk.size;
+    }
+    return total;
+  }
+
+ private:
+  struct Chunk {
+    char* data;
+    size_t size;
+  };
+
+  void Release() {
+    for (const Chunk& chunk : chunks_) {
+      FreePages(chunk.data, chunk.size);
+    }
+    chunks_.clear();
+  }
+
+  std::vector<Chunk> chunks_;
+  size_t current_;
+  size_t used_;
+};
+
+// Scratch arena of the calling thread.
+inline Arena& Scratch() {
+  thread_local Arena arena;
+  return arena;
+}
+
+// Resets every arena. Only valid between frames, when no thread holds
+// arena memory.
+inline void ResetAll() {
+  Registry& registry = GetRegistry();
+  std::lock_guard<std::mutex> lock(registry.mutex);
+  for (Arena* arena : registry.arenas) {
+    arena->Reset();
+  }
+}
+
+// Gives back everything allocated from the arena during its lifetime.
+// Declare it before the containers it covers; containers from outside
+// must not grow while it is alive.
+class Scope {
+ public:
+  explicit Scope(Arena& arena = Scratch())
+      : arena_(arena), mark_(arena.GetMark()) {}
+
+  Scope(const Scope&) = delete;
+  Scope& operator=(const Scope&) = delete;
+
+  ~Scope() {
+    arena_.Rewind(mark_);
+  }
+
+ private:
+  Arena& arena_;
+  Arena::Mark mark_;
+};
+
+// Containers on an arena: memory comes from the arena of the thread that
+// creates the container and deallocation is a no-op.
+template <typename T>
+class Allocator {
+ public:
+  typedef T value_type;
+
+  Allocator() : arena_(&Scratch()) {}
+
+  explicit Allocator(Arena& arena) : arena_(&arena) {}
+
+  template <typename U>
+  Allocator(const Allocator<U>& other) : arena_(other.arena()) {}
+
+  T* allocate(size_t count) {
+    return static_cast<T*>(arena_->Allocate(
+      count * sizeof(T), std::max(kAlignment, alignof(T))));
+  }
+
+  void deallocate(T*, size_t) {}
+
+  Arena* arena() const {
+    return arena_;
+  }
+
+ private:
+  Arena* arena_;
+};
+
+template <typename T, typename U>
+bool operator==(const Allocator<T>& a, const Allocator<U>& b) {
+  return a.arena() == b.arena();
+}
+
+template <typename T, typename U>
+bool operator!=(const Allocator<T>& a, const Allocator<U>& b) {
+  return a.arena() != b.arena();
+}
+
+template <typename T>
+using Buffer = std::vector<T, Allocator<T>>;
+
+} // namespace arena
+
+#endif // RTBENCH_COMMON_ARENA_H_
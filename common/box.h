@@ -0,0 +1,117 @@
+#ifndef RTBENCH_COMMON_BOX_H_
+#define RTBENCH_COMMON_BOX_H_
+
+#include <math.h>
+
+#include "material.h"
+#include "vector.h"
+
+enum class Texture {
+  kSolid,
+  // Cells of 2 x 2 units in x and z alternating between the material color
+  // and the checker color.
+  kCheckerboard
+};
+
+// Axis-aligned box. A box flat along one axis is a two-sided rectangle
+// facing the positive axis, which is how planes enter the scene: they
+// stay bounded, so they have bounds like every other primitive.
+class Box {
+ public:
+  Box(const Vector& min, const Vector& max, const Material& material)
+    : material_(material), min_(min), max_(max),
+      texture_(Texture::kSolid), flat_axis_(FlatAxis(min, max)) {}
+
+  Box(const Vector& min, const Vector& max, const Material& material,
+      const Vector& checker_color)
+    : material_(material), checker_color_(checker_color), min_(min),
+      max_(max), texture_(Texture::kCheckerboard),
+      flat_axis_(FlatAxis(min, max)) {}
+
+  Material material() const {
+    return material_;
+  }
+
+  Vector checker_color() const {
+    return checker_color_;
+  }
+
+  Vector min() const {
+    return min_;
+  }
+
+  Vector max() const {
+    return max_;
+  }
+
+  Texture texture() const {
+    return texture_;
+  }
+
+  // Axis along which the box is flat, -1 for a solid box. Flat boxes are
+  // intersected as a plane and a point in rectangle test, one division
+  // instead of the six of a slab test.
+  int flat_axis() const {
+    return flat_axis_;
+  }
+
+  // Outward normal of the face nearest to a point on the surface.
+  Vector Normal(const Vector& point) const {
+    Vector norm;
+    if (flat_axis_ >= 0) {
+      norm.data()[flat_axis_] = 1.0f;
+      return norm;
+    }
+
+    int axis = 0;
+    float sign = 1.0f;
+    float nearest = INFINITY;
+    for (int k = 0; k < 3; ++k) {
+      float to_min = fabsf(point.data()[k] - min_.data()[k]);
+      float to_max = fabsf(point.data()[k] - max_.data()[k]);
+      if (to_min < nearest) {
+        nearest = to_min;
+        axis = k;
+        sign = -1.0f;
+      }
+      if (to_max < nearest) {
+        nearest = to_max;
+        axis = k;
+        sign = 1.0f;
+      }
+    }
+    norm.data()[axis] = sign;
+    return norm;
+  }
+
+  // Textures are evaluated here, once for the closest hit, and never
+  // during intersection.
+  Material MaterialAt(const Vector& point) const {
+    Material material = material_;
+    if (texture_ == Texture::kCheckerboard &&
+        ((static_cast<int>(0.5f * point.x() + 1000.0f) +
+          static_cast<int>(0.5f * point.z())) & 1)) {
+      material.SetDiffuseColor(checker_color_);
+    }
+    return material;
+  }
+
+ private:
+  static int FlatAxis(const Vector& min, const Vector& max) {
+    for (int k = 0; k < 3; ++k) {
+      if (min.data()[k] == max.data()[k]) {
+        return k;
+      }
+    }
+    return -1;
+  }
+
+  Material material_;
+  Vector checker_color_;
+  Vector min_;
+  Vector max_;
+  Texture texture_;
+  int flat_axis_;
+};
+
+#endif // RTBENCH_COMMON_BOX_H_
@@ -0,0 +1,308 @@
+#ifndef RTBENCH_COMMON_CAMERA_H_
+#define RTBENCH_COMMON_CAMERA_H_
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#define _USE_MATH_DEFINES
+#include <math.h>
+#include <immintrin.h>
+
+#include "vector.h"
+
+// Normalized primary ray directions in SoA layout. Rows are padded to
+// a multiple of four pixels so that every packet load is in bounds.
+struct PrimaryRays {
+  int w = 0;
+  int h = 0;
+  int stride = 0;
+  std::vector<float> x;
+  std::vector<float> y;
+  std::vector<float> z;
+};
+
+// Half-open pixel rectangle [x0, x1) x [y0, y1), empty when x0 >= x1 or
+// y0 >= y1.
+struct ScreenRect {
+  int x0;
+  int y0;
+  int x1;
+  int y1;
+};
+
+class Camera {
+ public:
+  static const int kTileSize = 16;
+
+  Camera() : Camera(Vector(0.0f, 0.0f, 0.0f), Vector(0.0f, 0.0f, -1.0f),
+                    Vector(0.0f, 1.0f, 0.0f),
+                    static_cast<float>(M_PI / 3.0)) {}
+
+  Camera(const Vector& position, const Vector& target, const Vector& up,
+         float fov) : fov_(fov), cache_rays_(true),
+                      crop_x0_(0), crop_y0_(0), crop_w_(0), crop_h_(0) {
+    LookAt(position, target, up);
+  }
+
+  Vector position() const {
+    return position_;
+  }
+
+  Vector target() const {
+    return target_;
+  }
+
+  Vector world_up() const {
+    return world_up_;
+  }
+
+  float fov() const {
+    return fov_;
+  }
+
+  bool cache_rays() const {
+    return cache_rays_;
+  }
+
+  // View basis and crop, for code that has to evaluate Direction on its
+  // own.
+  Vector forward() const {
+    return forward_;
+  }
+
+  Vector right() const {
+    return right_;
+  }
+
+  Vector up() const {
+    return up_;
+  }
+
+  float tan_half_fov() const {
+    return tan_half_fov_;
+  }
+
+  int crop_x0() const {
+    return crop_x0_;
+  }
+
+  int crop_y0() const {
+    return crop_y0_;
+  }
+
+  int crop_w() const {
+    return crop_w_;
+  }
+
+  int crop_h() const {
+    return crop_h_;
+  }
+
+  // False when the view has no basis: the target at the position, a view
+  // direction parallel to up, or values that are not finite. Such a camera
+  // renders NaN directions.
+  bool IsValid() const {
+    return std::isfinite(position_ * position_) &&
+      std::isfinite(right_ * right_) && std::isfinite(up_ * up_) &&
+      std::isfinite(forward_ * forward_) && right_ * right_ > 0.0f;
+  }
+
+  void LookAt(const Vector& position, const Vector& target,
+              const Vector& up) {
+    position_ = position;
+    target_ = target;
+    world_up_ = up;
+    forward_ = (target - position).Normalize();
+    right_ = Cross(forward_, up).Normalize();
+    up_ = Cross(right_, forward_);
+    // In double precision: tanf folded at compile time for a constant fov
+    // can differ by an ulp from the run-time one, and cameras rebuilt from
+    // the same parameters have to trace the same rays.
+    tan_half_fov_ = static_cast<float>(tan(fov_ / 2.0));
+    rays_.w = rays_.h = 0;
+  }
+
+  void SetCacheRays(bool cache_rays) {
+    cache_rays_ = cache_rays;
+  }
+
+  // Makes renderers produce only the window at (x0, y0) of a full_w x full_h
+  // image: pixel (i, j) of a w x h render maps to pixel (y0 + i, x0 + j).
+  void SetCrop(int x0, int y0, int full_w, int full_h) {
+    crop_x0_ = x0;
+    crop_y0_ = y0;
+    crop_w_ = full_w;
+    crop_h_ = full_h;
+    rays_.w = rays_.h = 0;
+  }
+
+  void ClearCrop() {
+    SetCrop(0, 0, 0, 0);
+  }
+
+  // Not normalized direction through the center of pixel (i, j).
+  Vector Direction(int i, int j, int w, int h) const {
+    if (crop_w_ > 0) {
+      i += crop_y0_;
+      j += crop_x0_;
+      w = crop_w_;
+      h = crop_h_;
+    }
+    return right_ * ((j + 0.5f) - w / 2.0f) +
+      up_ * (-(i + 0.5f) + h / 2.0f) +
+      forward_ * (h / (2.0f * tan_half_fov_));
+  }
+
+  // Pixels of a w x h render whose primary rays can hit the sphere, one
+  // pixel wider on every side than the exact silhouette so that rounding
+  // in the ray directions never leaves a hit outside. Empty for a sphere
+  // behind the camera, the whole image when it reaches the camera plane.
+  ScreenRect ProjectSphere(const Vector& center, float radius,
+                           int w, int h) const {
+    const Vector L = center - position_;
+    const float x = L * right_;
+    const float y = L * up_;
+    const float z = L * forward_;
+    if (z < -radius) {
+      return { 0, 0, 0, 0 };
+    }
+    if (z <= radius * 1.001f) {
+      return { 0, 0, w, h };
+    }
+
+    int full_w = w, full_h = h;
+    if (crop_w_ > 0) {
+      full_w = crop_w_;
+      full_h = crop_h_;
+    }
+    // Slopes of the planes through the camera tangent to the sphere, on
+    // the image plane at focal distance.
+    const float focal = full_h / (2.0f * tan_half_fov_);
+    const float r2 = radius * radius;
+    const float scale = focal / (z * z - r2);
+    const float dx = radius * sqrtf(x * x + z * z - r2);
+    const float dy = radius * sqrtf(y * y + z * z - r2);
+    const float center_x = full_w / 2.0f - 0.5f - crop_x0_;
+    const float center_y = full_h / 2.0f - 0.5f - crop_y0_;
+    ScreenRect rect;
+    rect.x0 = ToPixel(center_x + (x * z - dx) * scale, w) - 1;
+    rect.x1 = ToPixel(center_x + (x * z + dx) * scale, w) + 2;
+    rect.y0 = ToPixel(center_y - (y * z + dy) * scale, h) - 1;
+    rect.y1 = ToPixel(center_y - (y * z - dy) * scale, h) + 2;
+    rect.x0 = std::max(rect.x0, 0);
+    rect.y0 = std::max(rect.y0, 0);
+    rect.x1 = std::min(rect.x1, w);
+    rect.y1 = std::min(rect.y1, h);
+    return rect;
+  }
+
+  // Generates normalized directions for a w x h image tile by tile, the
+  // same directions as Direction followed by Normalize. The result is
+  // reused while neither the camera nor the image size change, unless
+  // caching is disabled.
+  // Not thread-safe, call it outside of parallel regions.
+  const PrimaryRays& GetPrimaryRays(int w, int h) const {
+    if (cache_rays_ && rays_.w == w && rays_.h == h) {
+      return rays_;
+    }
+
+    rays_.w = w;
+    rays_.h = h;
+    rays_.stride = (w + 3) & ~3;
+    rays_.x.resize(rays_.stride * h);
+    rays_.y.resize(rays_.stride * h);
+    rays_.z.resize(rays_.stride * h);
+
+    const int tiles_x = (rays_.stride + kTileSize - 1) / kTileSize;
+    const int tiles_y = (h + kTileSize - 1) / kTileSize;
+    #pragma omp parallel for
+    for (int t = 0; t < tiles_x * tiles_y; ++t) {
+      GenerateTile(t % tiles_x * kTileSize, t / tiles_x * kTileSize);
+    }
+
+    return rays_;
+  }
+
+ private:
+  static Vector Cross(const Vector& a, const Vector& b) {
+    return Vector(a.y() * b.z() - a.z() * b.y(),
+                  a.z() * b.x() - a.x() * b.z(),
+                  a.x() * b.y() - a.y() * b.x());
+  }
+
+  // Floor of a pixel coordinate, clamped so that far off-screen
+  // silhouettes do not overflow.
+  static int ToPixel(float coordinate, int size) {
+    return static_cast<int>(
+      floorf(std::max(-2.0f, std::min(size + 2.0f, coordinate))));
+  }
+
+  // Evaluates Direction for four pixels at a time with the same operations
+  // in the same order, and normalizes like Vector::Normalize, so that the
+  // packet renderers trace exactly the rays of the scalar ones.
+  void GenerateTile(int x0, int y0) const {
+    const int x1 = std::min(x0 + kTileSize, rays_.stride);
+    const int y1 = std::min(y0 + kTileSize, rays_.h);
+    int w = rays_.w, h = rays_.h, column = x0, row = y0;
+    if (crop_w_ > 0) {
+      column += crop_x0_;
+      row += crop_y0_;
+      w = crop_w_;
+      h = crop_h_;
+    }
+    const __m128i vlane = _mm_set_epi32(3, 2, 1, 0);
+    const __m128 vhalf_w = _mm_set_ps1(w / 2.0f);
+    const float focal = h / (2.0f * tan_half_fov_);
+    const Vector forward = forward_ * focal;
+    const __m128 vfx = _mm_set_ps1(forward.x());
+    const __m128 vfy = _mm_set_ps1(forward.y());
+    const __m128 vfz = _mm_set_ps1(forward.z());
+
+    for (int i = y0; i < y1; ++i, ++row) {
+      const Vector up = up_ * (-(row + 0.5f) + h / 2.0f);
+      const __m128 vux = _mm_set_ps1(up.x());
+      const __m128 vuy = _mm_set_ps1(up.y());
+      const __m128 vuz = _mm_set_ps1(up.z());
+
+      for (int j = x0, c = column; j < x1; j += 4, c += 4) {
+        const __m128 va = _mm_sub_ps(
+          _mm_add_ps(_mm_cvtepi32_ps(_mm_add_epi32(_mm_set1_epi32(c), vlane)),
+                     _mm_set_ps1(0.5f)),
+          vhalf_w);
+        __m128 vx = _mm_add_ps(
+          _mm_add_ps(_mm_mul_ps(_mm_set_ps1(right_.x()), va), vux), vfx);
+        __m128 vy = _mm_add_ps(
+          _mm_add_ps(_mm_mul_ps(_mm_set_ps1(right_.y()), va), vuy), vfy);
+        __m128 vz = _mm_add_ps(
+          _mm_add_ps(_mm_mul_ps(_mm_set_ps1(right_.z()), va), vuz), vfz);
+
+        __m128 vnorm = _mm_add_ps(_mm_mul_ps(vx, vx), _mm_mul_ps(vy, vy));
+        vnorm = _mm_add_ps(vnorm, _mm_mul_ps(vz, vz));
+        vnorm = _mm_div_ps(_mm_set_ps1(1.0f), _mm_sqrt_ps(vnorm));
+
+        size_t offset = static_cast<size_t>(i) * rays_.stride + j;
+        _mm_storeu_ps(rays_.x.data() + offset, _mm_mul_ps(vx, vnorm));
+        _mm_storeu_ps(rays_.y.data() + offset, _mm_mul_ps(vy, vnorm));
+        _mm_storeu_ps(rays_.z.data() + offset, _mm_mul_ps(vz, vnorm));
+      }
+    }
+  }
+
+  Vector position_;
+  Vector target_;
+  Vector world_up_;
+  Vector forward_;
+  Vector right_;
+  Vector up_;
+  float fov_;
+  float tan_half_fov_;
+  bool cache_rays_;
+  int crop_x0_;
+  int crop_y0_;
+  int crop_w_;
+  int crop_h_;
+  mutable PrimaryRays rays_;
+};
+
+#endif // RTBENCH_COMMON_CAMERA_H_
@@ -0,0 +1,123 @@
+#ifndef RTBENCH_COMMON_FAST_MATH_H_
+#define RTBENCH_COMMON_FAST_MATH_H_
+
+#include <math.h>
+#include <immintrin.h>
+
+namespace fast_math {
+
+// kExact keeps IEEE sqrt/div and libm powf. kFast and kFastest refine the
+// 12-bit hardware rcp/rsqrt estimates with one Newton step (raw estimates
+// make shadow rays miss their 1e-3 offset) and use exp2/log2 polynomials
+// accurate to ~1e-7 and ~1e-4 respectively.
+enum class Accuracy {
+  kExact,
+  kFast,
+  kFastest
+};
+
+inline __m128 Select(const __m128& mask, const __m128& a, const __m128& b) {
+  return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+template <Accuracy A>
+inline __m128 Rcp(const __m128& x) {
+  if (A == Accuracy::kExact) {
+    return _mm_div_ps(_mm_set_ps1(1.0f), x);
+  }
+  __m128 vy = _mm_rcp_ps(x);
+  return _mm_mul_ps(vy, _mm_sub_ps(_mm_set_ps1(2.0f), _mm_mul_ps(x, vy)));
+}
+
+template <Accuracy A>
+inline __m128 Rsqrt(const __m128& x) {
+  if (A == Accuracy::kExact) {
+    return _mm_div_ps(_mm_set_ps1(1.0f), _mm_sqrt_ps(x));
+  }
+  __m128 vy = _mm_rsqrt_ps(x);
+  __m128 vxyy = _mm_mul_ps(_mm_mul_ps(x, vy), vy);
+  return _mm_mul_ps(_mm_mul_ps(_mm_set_ps1(0.5f), vy),
+                    _mm_sub_ps(_mm_set_ps1(3.0f), vxyy));
+}
+
+// Valid for positive normal x only.
+template <Accuracy A>
+inline __m128 Log2(const __m128& x) {
+  __m128i vbits = _mm_castps_si128(x);
+  __m128 ve = _mm_cvtepi32_ps(
+    _mm_sub_epi32(_mm_srli_epi32(vbits, 23), _mm_set1_epi32(127)));
+  __m128 vm = _mm_castsi128_ps(_mm_or_si128(
+    _mm_and_si128(vbits, _mm_set1_epi32(0x007FFFFF)),
+    _mm_set1_epi32(0x3F800000)));
+
+  // Move the mantissa to [sqrt(2)/2, sqrt(2)) to keep t small.
+  __m128 vbig = _mm_cmpgt_ps(vm, _mm_set_ps1(1.41421356f));
+  vm = Select(vbig, _mm_mul_ps(vm, _mm_set_ps1(0.5f)), vm);
+  ve = _mm_add_ps(ve, _mm_and_ps(vbig, _mm_set_ps1(1.0f)));
+
+  // log2(m) = 2 / ln(2) * atanh(t), t = (m - 1) / (m + 1).
+  __m128 vt = _mm_mul_ps(_mm_sub_ps(vm, _mm_set_ps1(1.0f)),
+                         Rcp<A>(_mm_add_ps(vm, _mm_set_ps1(1.0f))));
+  __m128 vt2 = _mm_mul_ps(vt, vt);
+  __m128 vp;
+  if (A == Accuracy::kFastest) {
+    vp = _mm_add_ps(_mm_set_ps1(1.0f),
+                    _mm_mul_ps(vt2, _mm_set_ps1(1.0f / 3.0f)));
+  } else {
+    vp = _mm_add_ps(_mm_set_ps1(1.0f / 7.0f),
+                    _mm_mul_ps(vt2, _mm_set_ps1(1.0f / 9.0f)));
+    vp = _mm_add_ps(_mm_set_ps1(1.0f / 5.0f), _mm_mul_ps(vt2, vp));
+    vp = _mm_add_ps(_mm_set_ps1(1.0f / 3.0f), _mm_mul_ps(vt2, vp));
+    vp = _mm_add_ps(_mm_set_ps1(1.0f), _mm_mul_ps(vt2, vp));
+  }
+  vp = _mm_mul_ps(_mm_mul_ps(vt, vp), _mm_set_ps1(2.88539008f));
+  return _mm_add_ps(ve, vp);
+}
+
+template <Accuracy A>
+inline __m128 Exp2(const __m128& x) {
+  __m128 vx = _mm_min_ps(_mm_max_ps(x, _mm_set_ps1(-126.0f)),
+                         _mm_set_ps1(127.0f));
+  __m128i vi = _mm_cvtps_epi32(vx);
+  __m128 vf = _mm_sub_ps(vx, _mm_cvtepi32_ps(vi));
+
+  // 2^f for f in [-0.5, 0.5].
+  __m128 vp;
+  if (A == Accuracy::kFastest) {
+    vp = _mm_add_ps(_mm_set_ps1(2.42217838e-1f),
+                    _mm_mul_ps(vf, _mm_set_ps1(5.45928247e-2f)));
+    vp = _mm_add_ps(_mm_set_ps1(6.93368601e-1f), _mm_mul_ps(vf, vp));
+  } else {
+    vp = _mm_add_ps(_mm_set_ps1(1.339887440266574e-3f),
+                    _mm_mul_ps(vf, _mm_set_ps1(1.535336188319500e-4f)));
+    vp = _mm_add_ps(_mm_set_ps1(9.618437357674640e-3f), _mm_mul_ps(vf, vp));
+    vp = _mm_add_ps(_mm_set_ps1(5.550332471162809e-2f), _mm_mul_ps(vf, vp));
+    vp = _mm_add_ps(_mm_set_ps1(2.402264791363012e-1f), _mm_mul_ps(vf, vp));
+    vp = _mm_add_ps(_mm_set_ps1(6.931472028550421e-1f), _mm_mul_ps(vf, vp));
+  }
+  vp = _mm_add_ps(_mm_set_ps1(1.0f), _mm_mul_ps(vf, vp));
+
+  __m128i vscale = _mm_slli_epi32(_mm_add_epi32(vi, _mm_set1_epi32(127)), 23);
+  return _mm_mul_ps(vp, _mm_castsi128_ps(vscale));
+}
+
+// x^y for x >= 0, with 0^y = 0 for y != 0 and x^0 = 1.
+template <Accuracy A>
+inline __m128 Pow(const __m128& x, const __m128& y) {
+  if (A == Accuracy::kExact) {
+    alignas(16) float vals[4], exps[4];
+    _mm_store_ps(vals, x);
+    _mm_store_ps(exps, y);
+    for (int i = 0; i < 4; ++i) {
+      vals[i] = powf(vals[i], exps[i]);
+    }
+    return _mm_load_ps(vals);
+  }
+  __m128 vres = Exp2<A>(_mm_mul_ps(y, Log2<A>(x)));
+  vres = _mm_and_ps(_mm_cmpgt_ps(x, _mm_setzero_ps()), vres);
+  return Select(_mm_cmpeq_ps(y, _mm_setzero_ps()), _mm_set_ps1(1.0f), vres);
+}
+
+} // namespace fast_math
+
+#endif // RTBENCH_COMMON_FAST_MATH_H_
@@ -0,0 +1,32 @@
+#ifndef RTBENCH_COMMON_FRAMEBUFFER_H_
+#define RTBENCH_COMMON_FRAMEBUFFER_H_
+
+#include <stddef.h>
+
+#include <vector>
+
+#include "arena.h"
+#include "numa.h"
+#include "vector.h"
+
+// Node placed allocations that show up in the per-frame system allocation
+// count, see arena.h.
+template <typename T>
+class FramebufferAllocator : public numa::Allocator<T> {
+ public:
+  FramebufferAllocator() {}
+
+  template <typename U>
+  FramebufferAllocator(const FramebufferAllocator<U>&) {}
+
+  T* allocate(size_t count) {
+    arena::CountSystemAllocation(count * sizeof(T));
+    return numa::Allocator<T>::allocate(count);
+  }
+};
+
+// Image written by the renderers. Large ones are split into per-node bands
+// matching the rows each thread renders, see numa.h.
+typedef std::vector<Vector, FramebufferAllocator<Vector>> Framebuffer;
+
+#endif // RTBENCH_COMMON_FRAMEBUFFER_H_
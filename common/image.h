@@ -2,68 +2,265 @@
 #define RTBENCH_COMMON_IMAGE_H_
 
 #include <algorithm>
+#include <fstream>
 #include <vector>
 
 #include <assert.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <immintrin.h>
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "external/stb_image.h"
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "external/stb_image_write.h"
 
+#include "arena.h"
+#include "mapped_file.h"
+#include "pixel_format.h"
 #include "vector.h"
 
 namespace image {
 
-inline bool Load(const char* filename, int& w, int& h,
-                 std::vector<Vector>& image) {
-  assert(filename != nullptr);
+// Header of .raw images: float pixels as they are in memory, top row first.
+struct RawHeader {
+  char magic[4];
+  int32_t w;
+  int32_t h;
+  // 3 for packed RGB, 4 for the layout of Vector.
+  int32_t channels;
+};
 
-  int comp = -1;
-  uint8_t* data = stbi_load(filename, &w, &h, &comp, 0);
-  if (data == nullptr) {
+const char kRawMagic[4] = { 'R', 'T', 'B', 'F' };
+
+inline bool HasExtension(const char* filename, const char* extension) {
+  size_t length = strlen(filename);
+  size_t extension_length = strlen(extension);
+  if (length < extension_length) {
     return false;
-  } else if (comp != 3) {
-    stbi_image_free(data);
+  }
+  const char* tail = filename + length - extension_length;
+  for (size_t i = 0; i < extension_length; ++i) {
+    if (tolower(tail[i]) != extension[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// 8-bit RGB to Vectors, four pixels per step.
+inline void ConvertRow(const uint8_t* source, int count, Vector* target) {
+  const __m128i vmask = _mm_setr_epi8(0, -1, -1, -1, 1, -1, -1, -1,
+                                      2, -1, -1, -1, -1, -1, -1, -1);
+  // Divided rather than scaled by 1 / 255, so that the result is the same
+  // as the scalar conversion.
+  const __m128 v255 = _mm_set_ps1(255.0f);
+  int j = 0;
+  // Every step loads 16 bytes but converts 12 of them, so it must not
+  // start within the last 16 bytes of the row.
+  for (; j + 6 <= count; j += 4) {
+    __m128i vbytes = _mm_loadu_si128(
+      reinterpret_cast<const __m128i*>(source + 3 * j));
+    _mm_store_ps(target[j + 0].data(), _mm_div_ps(_mm_cvtepi32_ps(
+      _mm_shuffle_epi8(vbytes, vmask)), v255));
+    _mm_store_ps(target[j + 1].data(), _mm_div_ps(_mm_cvtepi32_ps(
+      _mm_shuffle_epi8(_mm_srli_si128(vbytes, 3), vmask)), v255));
+    _mm_store_ps(target[j + 2].data(), _mm_div_ps(_mm_cvtepi32_ps(
+      _mm_shuffle_epi8(_mm_srli_si128(vbytes, 6), vmask)), v255));
+    _mm_store_ps(target[j + 3].data(), _mm_div_ps(_mm_cvtepi32_ps(
+      _mm_shuffle_epi8(_mm_srli_si128(vbytes, 9), vmask)), v255));
+  }
+  for (; j < count; ++j) {
+    target[j] = Vector(source[3 * j + 0],
+                       source[3 * j + 1],
+                       source[3 * j + 2]) / 255.0f;
+  }
+}
+
+inline float LoadFloat(const uint8_t* source, bool swap_bytes) {
+  uint8_t bytes[4];
+  memcpy(bytes, source, sizeof(bytes));
+  if (swap_bytes) {
+    std::swap(bytes[0], bytes[3]);
+    std::swap(bytes[1], bytes[2]);
+  }
+  float value;
+  memcpy(&value, bytes, sizeof(value));
+  return value;
+}
+
+// True when h rows of w pixels of pixel_size bytes fit in a file of size
+// bytes after offset. Divides instead of multiplying, so sizes from a
+// corrupt header cannot overflow.
+inline bool FitsInFile(size_t size, size_t offset, int w, int h,
+                       size_t pixel_size) {
+  assert(w > 0 && h > 0 && pixel_size > 0);
+  return offset <= size &&
+    static_cast<size_t>(w) <= (size - offset) / pixel_size / h;
+}
+
+// The compressed stream is decoded by one thread, the conversion to float
+// runs in row bands straight into the target.
+template <typename Image>
+inline bool LoadDecoded(const char* filename, int& w, int& h, Image& image) {
+  int comp = 0;
+  // Gray and alpha images are converted to RGB by the decoder.
+  uint8_t* data = stbi_load(filename, &w, &h, &comp, 3);
+  if (data == nullptr) {
     return false;
   }
-  
-  image.resize(w * h);
-  for (int i = 0; i < w * h; ++i) {
-    image[i] = Vector(data[3 * i + 0],
-                      data[3 * i + 1],
-                      data[3 * i + 2]) / 255.0f;
+
+  image.resize(static_cast<size_t>(w) * h);
+  #pragma omp parallel for
+  for (int i = 0; i < h; ++i) {
+    ConvertRow(data + static_cast<size_t>(i) * w * 3, w,
+               image.data() + static_cast<size_t>(i) * w);
   }
-  
+
   stbi_image_free(data);
   return true;
 }
 
-inline std::vector<Vector> Normalize(const std::vector<Vector>& image) {
-  std::vector<Vector> normalized(image.size(), 0.0f);
+// Portable float map: "PF" for RGB or "Pf" for gray, the size and a scale
+// whose sign gives the byte order, then the rows from the bottom up.
+template <typename Image>
+inline bool LoadPfm(const io::MappedFile& file, int& w, int& h,
+                    Image& image) {
+  char header[128] = { 0 };
+  memcpy(header, file.data(), std::min(file.size(), sizeof(header) - 1));
+  if (header[0] != 'P' || (header[1] != 'F' && header[1] != 'f')) {
+    return false;
+  }
+  char* end = header + 2;
+  char* start = end;
+  w = static_cast<int>(strtol(start, &end, 10));
+  start = end;
+  h = static_cast<int>(strtol(start, &end, 10));
+  start = end;
+  float scale = strtof(start, &end);
+  if (end == start || w <= 0 || h <= 0 || scale == 0.0f) {
+    return false;
+  }
+
+  const int channels = header[1] == 'F' ? 3 : 1;
+  // One whitespace character ends the header.
+  const size_t offset = end - header + 1;
+  if (!FitsInFile(file.size(), offset, w, h, channels * sizeof(float))) {
+    return false;
+  }
+  const size_t row_size = static_cast<size_t>(w) * channels * sizeof(float);
+  const uint8_t* rows = file.data() + offset;
+  // Positive scales are big-endian.
+  const bool swap_bytes = scale > 0.0f;
+
+  image.resize(static_cast<size_t>(w) * h);
+  #pragma omp parallel for
+  for (int i = 0; i < h; ++i) {
+    const uint8_t* source = rows + (h - 1 - i) * row_size;
+    Vector* target = image.data() + static_cast<size_t>(i) * w;
+    if (channels == 3 && !swap_bytes) {
+      pixel_format::Unpack(source, w, pixel_format::Format::kRgb32f, target);
+    } else {
+      for (int j = 0; j < w; ++j) {
+        const uint8_t* pixel = source + j * channels * sizeof(float);
+        float r = LoadFloat(pixel, swap_bytes);
+        target[j] = channels == 1 ? Vector(r, r, r) :
+          Vector(r, LoadFloat(pixel + 4, swap_bytes),
+                 LoadFloat(pixel + 8, swap_bytes));
+      }
+    }
+  }
+  return true;
+}
+
+template <typename Image>
+inline bool LoadRaw(const io::MappedFile& file, int& w, int& h,
+                    Image& image) {
+  RawHeader header;
+  if (file.size() < sizeof(header)) {
+    return false;
+  }
+  memcpy(&header, file.data(), sizeof(header));
+  if (memcmp(header.magic, kRawMagic, sizeof(kRawMagic)) != 0 ||
+      header.w <= 0 || header.h <= 0 ||
+      (header.channels != 3 && header.channels != 4)) {
+    return false;
+  }
 
-  for (size_t i = 0; i < image.size(); ++i) {
-    Vector pixel = image[i];
-    float max = std::max(pixel.x(), std::max(pixel.y(), pixel.z()));
-    if (max > 1) pixel = pixel * (1.0f / max);
-    normalized[i] = Vector(std::max(0.0f, std::min(1.0f, pixel.x())),
-                           std::max(0.0f, std::min(1.0f, pixel.y())),
-                           std::max(0.0f, std::min(1.0f, pixel.z())));
+  const pixel_format::Format format = header.channels == 4 ?
+    pixel_format::Format::kRgba32f : pixel_format::Format::kRgb32f;
+  const size_t pixel_size = pixel_format::GetPixelSize(format);
+  if (!FitsInFile(file.size(), sizeof(header), header.w, header.h,
+                  pixel_size)) {
+    return false;
   }
+  const size_t row_size = header.w * pixel_size;
+  w = header.w;
+  h = header.h;
+  const uint8_t* rows = file.data() + sizeof(header);
 
-  return normalized;
+  image.resize(static_cast<size_t>(w) * h);
+  #pragma omp parallel for
+  for (int i = 0; i < h; ++i) {
+    pixel_format::Unpack(rows + i * row_size, w, format,
+                         image.data() + static_cast<size_t>(i) * w);
+  }
+  return true;
 }
 
-inline bool SavePng(const char* filename, int w, int h,
-                    const std::vector<Vector>& image) {
+// JPEG, PNG and the other stb_image formats are decoded; .pfm and .raw
+// float images are mapped and only converted.
+template <typename Image>
+inline bool Load(const char* filename, int& w, int& h, Image& image) {
   assert(filename != nullptr);
-  assert(image.size() == w * h);
 
-  std::vector<Vector> normalized = Normalize(image);
+  const bool pfm = HasExtension(filename, ".pfm");
+  if (!pfm && !HasExtension(filename, ".raw")) {
+    return LoadDecoded(filename, w, h, image);
+  }
+  io::MappedFile file;
+  if (!file.Open(filename)) {
+    return false;
+  }
+  return pfm ? LoadPfm(file, w, h, image) : LoadRaw(file, w, h, image);
+}
+
+// Nearest neighbour, for running the benchmark at other resolutions.
+inline std::vector<Vector> Resample(const std::vector<Vector>& source,
+                                    int source_w, int source_h,
+                                    int w, int h) {
+  std::vector<Vector> image(static_cast<size_t>(w) * h);
+  #pragma omp parallel for
+  for (int i = 0; i < h; ++i) {
+    for (int j = 0; j < w; ++j) {
+      size_t y = static_cast<size_t>(i) * source_h / h;
+      size_t x = static_cast<size_t>(j) * source_w / w;
+      image[static_cast<size_t>(i) * w + j] = source[y * source_w + x];
+    }
+  }
+  return image;
+}
+
+inline Vector NormalizePixel(Vector pixel) {
+  float max = std::max(pixel.x(), std::max(pixel.y(), pixel.z()));
+  if (max > 1) pixel = pixel * (1.0f / max);
+  return Vector(std::max(0.0f, std::min(1.0f, pixel.x())),
+                std::max(0.0f, std::min(1.0f, pixel.y())),
+                std::max(0.0f, std::min(1.0f, pixel.z())));
+}
 
-  std::vector<uint8_t> data(3 * w * h, 0);
+template <typename Image>
+inline bool SavePng(const char* filename, int w, int h, const Image& image) {
+  assert(filename != nullptr);
+  assert(image.size() == w * h);
+
+  arena::Scope scope;
+  arena::Buffer<uint8_t> data(3 * w * h, 0);
   for (int i = 0; i < w * h; ++i) {
-    Vector& pixel = normalized[i];
+    Vector pixel = NormalizePixel(image[i]);
     data[3 * i + 0] = static_cast<uint8_t>(255.0f * pixel.x());
     data[3 * i + 1] = static_cast<uint8_t>(255.0f * pixel.y());
     data[3 * i + 2] = static_cast<uint8_t>(255.0f * pixel.z());
@@ -74,32 +271,51 @@ inline bool SavePng(const char* filename, int w, int h,
   return status == 1 ? true : false;
 }
 
-inline bool Compare(const std::vector<Vector>& output, const char* reference) {
-  std::vector<Vector> image;
-  int w = 0, h = 0;
-  bool loaded = image::Load(reference, w, h, image);
-  if (!loaded) {
-    std::cout << "Reference output file was not found: " <<
-      reference << std::endl;
-    return false;
+// Float output without normalization, little-endian.
+template <typename Image>
+inline bool SavePfm(const char* filename, int w, int h, const Image& image) {
+  assert(filename != nullptr);
+  assert(image.size() == w * h);
+
+  std::ofstream file(filename, std::ios::binary);
+  file << "PF\n" << w << " " << h << "\n-1.0\n";
+  arena::Scope scope;
+  arena::Buffer<uint8_t> row(
+    w * pixel_format::GetPixelSize(pixel_format::Format::kRgb32f));
+  for (int i = h - 1; i >= 0 && file; --i) {
+    pixel_format::Pack(image.data() + static_cast<size_t>(i) * w, w,
+                       pixel_format::Format::kRgb32f, row.data());
+    file.write(reinterpret_cast<const char*>(row.data()), row.size());
   }
+  return static_cast<bool>(file);
+}
 
-  std::vector<Vector> normalized = Normalize(output);
+template <typename Image>
+inline bool SaveRaw(const char* filename, int w, int h, const Image& image) {
+  assert(filename != nullptr);
+  assert(image.size() == w * h);
 
-  if (normalized.size() != image.size()) {
-    return false;
-  }
+  RawHeader header;
+  memcpy(header.magic, kRawMagic, sizeof(kRawMagic));
+  header.w = w;
+  header.h = h;
+  header.channels = 4;
+  std::ofstream file(filename, std::ios::binary);
+  file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  file.write(reinterpret_cast<const char*>(image.data()),
+             image.size() * sizeof(Vector));
+  return static_cast<bool>(file);
+}
 
-  const float kEps = 2.0f / 255.0f;
-  for (size_t i = 0; i < normalized.size(); ++i) {
-    float diff = (normalized[i] - image[i]).norm();
-    if (diff > kEps) {
-      std::cout << "(" << i / w << ", " << i % w << ")...";
-      return false;
-    }
+// Picks the format from the extension, PNG by default.
+template <typename Image>
+inline bool Save(const char* filename, int w, int h, const Image& image) {
+  if (HasExtension(filename, ".pfm")) {
+    return SavePfm(filename, w, h, image);
+  } else if (HasExtension(filename, ".raw")) {
+    return SaveRaw(filename, w, h, image);
   }
-
-  return true;
+  return SavePng(filename, w, h, image);
 }
 
 } // image
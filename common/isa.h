@@ -0,0 +1,48 @@
+#ifndef RTBENCH_COMMON_ISA_H_
+#define RTBENCH_COMMON_ISA_H_
+
+#include <intrin.h>
+#include <immintrin.h>
+
+// Instruction set selection for renderers compiled more than once. The
+// generic build runs everywhere, the AVX2 one only where the CPU and the OS
+// support it.
+namespace isa {
+
+struct Settings {
+  // Off forces the generic code, to measure what AVX2 brings.
+  bool avx2 = true;
+};
+
+inline Settings& GetSettings() {
+  static Settings settings;
+  return settings;
+}
+
+inline bool HasAvx2Fma() {
+  static const bool supported = [] {
+    int cpu_info[4] = { 0 };
+    __cpuid(cpu_info, 0);
+    if (cpu_info[0] < 7) {
+      return false;
+    }
+    __cpuid(cpu_info, 1);
+    const bool fma = (cpu_info[2] & (1 << 12)) != 0;
+    const bool osxsave = (cpu_info[2] & (1 << 27)) != 0;
+    // The OS has to save the YMM registers on context switches.
+    if (!fma || !osxsave || (_xgetbv(0) & 6) != 6) {
+      return false;
+    }
+    __cpuidex(cpu_info, 7, 0);
+    return (cpu_info[1] & (1 << 5)) != 0;
+  }();
+  return supported;
+}
+
+inline bool UseAvx2() {
+  return GetSettings().avx2 && HasAvx2Fma();
+}
+
+} // namespace isa
+
+#endif // RTBENCH_COMMON_ISA_H_
@@ -0,0 +1,628 @@
+#ifndef RTBENCH_COMMON_LIGHT_BATCH_H_
+#define RTBENCH_COMMON_LIGHT_BATCH_H_
+
+#include <algorithm>
+#include <limits>
+#include <numeric>
+#include <vector>
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <immintrin.h>
+
+#include "arena.h"
+#include "box.h"
+#include "fast_math.h"
+#include "light.h"
+#include "material.h"
+#include "sphere.h"
+#include "vector.h"
+
+// Shading of a hit point against four lights at a time. Light positions
+// and intensities are kept in SoA, so directions, distances, diffuse and
+// specular terms take one SIMD pass per four lights, and the four shadow
+// rays are traced through the scene as one packet.
+//
+// The packets are the leaves of a tree of bounding spheres. For many
+// lights a hit can skip the subtrees whose largest possible contribution
+// is negligible, and trace a fixed number of shadow rays to lights sampled
+// by their unshadowed contribution instead of one ray per light.
+namespace light_batch {
+
+enum class Mode {
+  // One shadow ray per light.
+  kAll,
+  // Skips lights that together add at most kCulledError to a hit.
+  kCulled,
+  // Culls, then traces Settings::shadow_rays rays to sampled lights.
+  kSampled
+};
+
+// Passed with every render, and sent along with the scene to workers and
+// with requests to the server.
+struct Settings {
+  Mode mode = Mode::kAll;
+  int shadow_rays = 4;
+};
+
+// Bound on the diffuse and specular intensity, weighted by the material,
+// that culling may take from one hit: half of an 8-bit step.
+const float kCulledError = 0.5f / 255.0f;
+const int kMaxShadowRays = 64;
+
+struct LightPacket {
+  __m128 vx;
+  __m128 vy;
+  __m128 vz;
+  // Lanes past the last light repeat its position with zero intensity.
+  __m128 vintensity;
+};
+
+// Node of the light tree, stored in depth-first order.
+struct LightNode {
+  // Bounding sphere of the lights below.
+  float x;
+  float y;
+  float z;
+  float radius;
+  // Sum over the lights below.
+  float intensity;
+  // Packet of a leaf, -1 for inner nodes.
+  int packet;
+  // Next node once this subtree is done or skipped.
+  int skip;
+};
+
+// Sphere parameters in every lane, for packets of shadow rays.
+struct SpherePacket {
+  __m128 vx;
+  __m128 vy;
+  __m128 vz;
+  __m128 vr2;
+};
+
+// Box corners in every lane, one axis per register.
+struct BoxPacket {
+  __m128 vmin[3];
+  __m128 vmax[3];
+  int flat_axis;
+};
+
+// Per-frame SoA copy of the scene, allocated from the calling thread's
+// arena, and the settings it is shaded with.
+struct Lights {
+  arena::Buffer<LightPacket> packets;
+  arena::Buffer<LightNode> nodes;
+  arena::Buffer<SpherePacket> spheres;
+  arena::Buffer<BoxPacket> boxes;
+  Settings settings;
+};
+
+inline LightPacket MakePacket(const std::vector<Light>& lights,
+                              const int* begin, const int* end) {
+  alignas(16) float x[4], y[4], z[4], intensity[4];
+  const ptrdiff_t last = end - begin - 1;
+  for (int k = 0; k < 4; ++k) {
+    const Light& light = lights[begin[std::min<ptrdiff_t>(k, last)]];
+    x[k] = light.position().x();
+    y[k] = light.position().y();
+    z[k] = light.position().z();
+    intensity[k] = k <= last ? light.intensity() : 0.0f;
+  }
+  LightPacket packet;
+  packet.vx = _mm_load_ps(x);
+  packet.vy = _mm_load_ps(y);
+  packet.vz = _mm_load_ps(z);
+  packet.vintensity = _mm_load_ps(intensity);
+  return packet;
+}
+
+// Splits at the median of the longest axis, rounded to a multiple of four
+// so that the leaves are mostly full packets.
+inline void BuildNode(const std::vector<Light>& lights, int* begin, int* end,
+                      Lights& packed) {
+  float lo[3] = { std::numeric_limits<float>::max(),
+                  std::numeric_limits<float>::max(),
+                  std::numeric_limits<float>::max() };
+  float hi[3] = { -lo[0], -lo[1], -lo[2] };
+  float intensity = 0.0f;
+  for (const int* i = begin; i != end; ++i) {
+    const Vector position = lights[*i].position();
+    for (int axis = 0; axis < 3; ++axis) {
+      lo[axis] = std::min(lo[axis], position.data()[axis]);
+      hi[axis] = std::max(hi[axis], position.data()[axis]);
+    }
+    intensity += lights[*i].intensity();
+  }
+
+  LightNode node;
+  node.x = 0.5f * (lo[0] + hi[0]);
+  node.y = 0.5f * (lo[1] + hi[1]);
+  node.z = 0.5f * (lo[2] + hi[2]);
+  node.radius = 0.5f * sqrtf((hi[0] - lo[0]) * (hi[0] - lo[0]) +
+                             (hi[1] - lo[1]) * (hi[1] - lo[1]) +
+                             (hi[2] - lo[2]) * (hi[2] - lo[2]));
+  node.intensity = intensity;
+  node.packet = -1;
+  const size_t index = packed.nodes.size();
+  packed.nodes.push_back(node);
+
+  if (end - begin <= 4) {
+    packed.nodes[index].packet = static_cast<int>(packed.packets.size());
+    packed.packets.push_back(MakePacket(lights, begin, end));
+  } else {
+    int axis = 0;
+    for (int a = 1; a < 3; ++a) {
+      if (hi[a] - lo[a] > hi[axis] - lo[axis]) {
+        axis = a;
+      }
+    }
+    int* middle = begin + std::max<ptrdiff_t>((end - begin) / 8 * 4, 4);
+    std::nth_element(begin, middle, end, [&lights, axis](int a, int b) {
+      return lights[a].position().data()[axis] <
+        lights[b].position().data()[axis];
+    });
+    BuildNode(lights, begin, middle, packed);
+    BuildNode(lights, middle, end, packed);
+  }
+  packed.nodes[index].skip = static_cast<int>(packed.nodes.size());
+}
+
+inline Lights Pack(const std::vector<Light>& lights,
+                   const std::vector<Sphere>& spheres,
+                   const std::vector<Box>& boxes,
+                   const Settings& settings) {
+  Lights packed;
+  packed.settings = settings;
+  if (!lights.empty()) {
+    packed.packets.reserve(lights.size());
+    packed.nodes.reserve(2 * lights.size());
+    arena::Buffer<int> order(lights.size());
+    std::iota(order.begin(), order.end(), 0);
+    BuildNode(lights, order.data(), order.data() + order.size(), packed);
+  }
+
+  packed.spheres.resize(spheres.size());
+  for (size_t i = 0; i < spheres.size(); ++i) {
+    const Vector center = spheres[i].center();
+    packed.spheres[i].vx = _mm_set_ps1(center.x());
+    packed.spheres[i].vy = _mm_set_ps1(center.y());
+    packed.spheres[i].vz = _mm_set_ps1(center.z());
+    packed.spheres[i].vr2 = _mm_set_ps1(spheres[i].radius() *
+                                        spheres[i].radius());
+  }
+
+  packed.boxes.resize(boxes.size());
+  for (size_t i = 0; i < boxes.size(); ++i) {
+    for (int k = 0; k < 3; ++k) {
+      packed.boxes[i].vmin[k] = _mm_set_ps1(boxes[i].min().data()[k]);
+      packed.boxes[i].vmax[k] = _mm_set_ps1(boxes[i].max().data()[k]);
+    }
+    packed.boxes[i].flat_axis = boxes[i].flat_axis();
+  }
+  return packed;
+}
+
+template <int kLane>
+inline __m128 Broadcast(const __m128& v) {
+  return _mm_shuffle_ps(v, v, _MM_SHUFFLE(kLane, kLane, kLane, kLane));
+}
+
+// Four rays in SoA against the spheres and boxes, with the same
+// operations as the scalar SceneIntersect of the SSE versions. Returns the
+// lanes that hit something closer than 1000 and their distances in vt.
+inline __m128 Intersect(const Lights& lights,
+                        const __m128& vox, const __m128& voy,
+                        const __m128& voz, const __m128& vdx,
+                        const __m128& vdy, const __m128& vdz,
+                        __m128& vt) {
+  const __m128 vzero = _mm_setzero_ps();
+  vt = _mm_set_ps1(std::numeric_limits<float>::max());
+  for (const SpherePacket& sphere : lights.spheres) {
+    __m128 vLx = _mm_sub_ps(sphere.vx, vox);
+    __m128 vLy = _mm_sub_ps(sphere.vy, voy);
+    __m128 vLz = _mm_sub_ps(sphere.vz, voz);
+    __m128 vtca = _mm_add_ps(_mm_add_ps(_mm_mul_ps(vLx, vdx),
+                                        _mm_mul_ps(vLy, vdy)),
+                             _mm_mul_ps(vLz, vdz));
+    __m128 vLL = _mm_add_ps(_mm_add_ps(_mm_mul_ps(vLx, vLx),
+                                       _mm_mul_ps(vLy, vLy)),
+                            _mm_mul_ps(vLz, vLz));
+    __m128 vd2 = _mm_sub_ps(vLL, _mm_mul_ps(vtca, vtca));
+    __m128 vmask = _mm_cmple_ps(vd2, sphere.vr2);
+    __m128 vthc = _mm_sqrt_ps(_mm_max_ps(_mm_sub_ps(sphere.vr2, vd2), vzero));
+    __m128 vt0 = _mm_sub_ps(vtca, vthc);
+    vt0 = fast_math::Select(_mm_cmplt_ps(vt0, vzero),
+                            _mm_add_ps(vtca, vthc), vt0);
+    vmask = _mm_and_ps(vmask, _mm_cmpge_ps(vt0, vzero));
+    vmask = _mm_and_ps(vmask, _mm_cmplt_ps(vt0, vt));
+    vt = fast_math::Select(vmask, vt0, vt);
+  }
+
+  const __m128 vorig[3] = { vox, voy, voz };
+  const __m128 vdir[3] = { vdx, vdy, vdz };
+  for (const BoxPacket& box : lights.boxes) {
+    __m128 vt0, vmask;
+    if (box.flat_axis >= 0) {
+      const int axis = box.flat_axis;
+      vt0 = _mm_div_ps(_mm_sub_ps(box.vmin[axis], vorig[axis]), vdir[axis]);
+      vmask = _mm_cmpgt_ps(vt0, vzero);
+      for (int k = 0; k < 3; ++k) {
+        if (k != axis) {
+          __m128 vp = _mm_add_ps(vorig[k], _mm_mul_ps(vdir[k], vt0));
+          vmask = _mm_and_ps(vmask, _mm_and_ps(_mm_cmpge_ps(vp, box.vmin[k]),
+                                               _mm_cmple_ps(vp, box.vmax[k])));
+        }
+      }
+    } else {
+      __m128 vnear = _mm_set_ps1(-std::numeric_limits<float>::max());
+      __m128 vfar = _mm_set_ps1(std::numeric_limits<float>::max());
+      for (int k = 0; k < 3; ++k) {
+        __m128 vta = _mm_div_ps(_mm_sub_ps(box.vmin[k], vorig[k]), vdir[k]);
+        __m128 vtb = _mm_div_ps(_mm_sub_ps(box.vmax[k], vorig[k]), vdir[k]);
+        vnear = _mm_max_ps(vnear, _mm_min_ps(vta, vtb));
+        vfar = _mm_min_ps(vfar, _mm_max_ps(vta, vtb));
+      }
+      vt0 = fast_math::Select(_mm_cmpgt_ps(vnear, vzero), vnear, vfar);
+      vmask = _mm_and_ps(_mm_cmple_ps(vnear, vfar),
+                         _mm_cmpgt_ps(vfar, vzero));
+    }
+    vmask = _mm_and_ps(vmask, _mm_cmplt_ps(vt0, vt));
+    vt = fast_math::Select(vmask, vt0, vt);
+  }
+
+  return _mm_cmplt_ps(vt, _mm_set_ps1(1000.0f));
+}
+
+// Hit point, normal and view direction in every lane, and the scalars the
+// light tree is tested with.
+struct Hit {
+  __m128 vpx, vpy, vpz;
+  __m128 vnx, vny, vnz;
+  __m128 vdx, vdy, vdz;
+  __m128 vexponent;
+  float point[3];
+  float normal[3];
+  // View direction reflected about the normal, where specular peaks.
+  float mirror[3];
+  float exponent;
+  // Largest factors of diffuse and specular intensity in the pixel.
+  float diffuse_weight;
+  float specular_weight;
+};
+
+inline Hit MakeHit(const __m128& vpoint, const __m128& vnorm,
+                   const __m128& vdir, const Material& material) {
+  Hit hit;
+  hit.vpx = Broadcast<0>(vpoint);
+  hit.vpy = Broadcast<1>(vpoint);
+  hit.vpz = Broadcast<2>(vpoint);
+  hit.vnx = Broadcast<0>(vnorm);
+  hit.vny = Broadcast<1>(vnorm);
+  hit.vnz = Broadcast<2>(vnorm);
+  hit.vdx = Broadcast<0>(vdir);
+  hit.vdy = Broadcast<1>(vdir);
+  hit.vdz = Broadcast<2>(vdir);
+  hit.exponent = material.specular_exponent();
+  hit.vexponent = _mm_set_ps1(hit.exponent);
+
+  alignas(16) float dir[4], point[4], normal[4];
+  _mm_store_ps(dir, vdir);
+  _mm_store_ps(point, vpoint);
+  _mm_store_ps(normal, vnorm);
+  const float dir_cos = dir[0] * normal[0] + dir[1] * normal[1] +
+    dir[2] * normal[2];
+  for (int axis = 0; axis < 3; ++axis) {
+    hit.point[axis] = point[axis];
+    hit.normal[axis] = normal[axis];
+    hit.mirror[axis] = dir[axis] - 2.0f * dir_cos * normal[axis];
+  }
+
+  const Vector color = material.diffuse_color();
+  hit.diffuse_weight = material.albedo().x() *
+    std::max(color.x(), std::max(color.y(), color.z()));
+  hit.specular_weight = material.albedo().y();
+  return hit;
+}
+
+// Largest cosine between axis and a direction from the hit into the
+// node's bounding sphere, clamped at zero.
+inline float ConeCosine(const float* axis, const Hit& hit,
+                        const LightNode& node) {
+  const float cx = node.x - hit.point[0];
+  const float cy = node.y - hit.point[1];
+  const float cz = node.z - hit.point[2];
+  const float d2 = cx * cx + cy * cy + cz * cz;
+  if (d2 <= node.radius * node.radius) {
+    return 1.0f;
+  }
+  const float d = sqrtf(d2);
+  const float cos_axis = (axis[0] * cx + axis[1] * cy + axis[2] * cz) / d;
+  const float sin_cone = node.radius / d;
+  const float cos_cone = sqrtf(1.0f - sin_cone * sin_cone);
+  if (cos_axis >= cos_cone) {
+    return 1.0f;
+  }
+  const float sin_axis = sqrtf(std::max(0.0f, 1.0f - cos_axis * cos_axis));
+  return std::max(0.0f, cos_axis * cos_cone + sin_axis * sin_cone);
+}
+
+// Upper bound of what the node's lights add to the pixel, unshadowed.
+inline float Bound(const LightNode& node, const Hit& hit) {
+  return node.intensity *
+    (hit.diffuse_weight * ConeCosine(hit.normal, hit, node) +
+     hit.specular_weight * powf(ConeCosine(hit.mirror, hit, node),
+                                hit.exponent));
+}
+
+// Unshadowed terms of four lights.
+struct Terms {
+  __m128 vlx, vly, vlz;
+  __m128 vdist2;
+  __m128 vcos;
+  __m128 vdiffuse;
+  __m128 vspecular;
+};
+
+template <fast_math::Accuracy A>
+inline void Evaluate(const LightPacket& packet, const Hit& hit,
+                     Terms& terms) {
+  const __m128 vzero = _mm_setzero_ps();
+  __m128 vtx = _mm_sub_ps(packet.vx, hit.vpx);
+  __m128 vty = _mm_sub_ps(packet.vy, hit.vpy);
+  __m128 vtz = _mm_sub_ps(packet.vz, hit.vpz);
+  terms.vdist2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(vtx, vtx),
+                                       _mm_mul_ps(vty, vty)),
+                            _mm_mul_ps(vtz, vtz));
+  __m128 vrsqrt = fast_math::Rsqrt<A>(terms.vdist2);
+  terms.vlx = _mm_mul_ps(vtx, vrsqrt);
+  terms.vly = _mm_mul_ps(vty, vrsqrt);
+  terms.vlz = _mm_mul_ps(vtz, vrsqrt);
+  terms.vcos = _mm_add_ps(_mm_add_ps(_mm_mul_ps(terms.vlx, hit.vnx),
+                                     _mm_mul_ps(terms.vly, hit.vny)),
+                          _mm_mul_ps(terms.vlz, hit.vnz));
+  terms.vdiffuse = _mm_mul_ps(packet.vintensity,
+                              _mm_max_ps(vzero, terms.vcos));
+
+  // Reflect(-l, n) = -l + 2 (l . n) n, specular base is -Reflect . dir.
+  __m128 vtwice = _mm_mul_ps(_mm_sub_ps(vzero, terms.vcos),
+                             _mm_set_ps1(2.0f));
+  __m128 vrx = _mm_sub_ps(_mm_sub_ps(vzero, terms.vlx),
+                          _mm_mul_ps(vtwice, hit.vnx));
+  __m128 vry = _mm_sub_ps(_mm_sub_ps(vzero, terms.vly),
+                          _mm_mul_ps(vtwice, hit.vny));
+  __m128 vrz = _mm_sub_ps(_mm_sub_ps(vzero, terms.vlz),
+                          _mm_mul_ps(vtwice, hit.vnz));
+  __m128 vbase = _mm_sub_ps(vzero, _mm_add_ps(
+    _mm_add_ps(_mm_mul_ps(vrx, hit.vdx), _mm_mul_ps(vry, hit.vdy)),
+    _mm_mul_ps(vrz, hit.vdz)));
+  terms.vspecular = _mm_mul_ps(
+    fast_math::Pow<A>(_mm_max_ps(vzero, vbase), hit.vexponent),
+    packet.vintensity);
+}
+
+// Lanes whose shadow ray hits something before the light. Rays start off
+// the surface on the side of their light.
+inline __m128 Occluded(const Lights& lights, const Hit& hit,
+                       const __m128& vlx, const __m128& vly,
+                       const __m128& vlz, const __m128& vcos,
+                       const __m128& vdist2) {
+  const __m128 voffset = _mm_set_ps1(1e-3f);
+  __m128 vsign = fast_math::Select(_mm_cmplt_ps(vcos, _mm_setzero_ps()),
+                                   _mm_set_ps1(-1.0f), _mm_set_ps1(1.0f));
+  __m128 vox = _mm_add_ps(hit.vpx,
+                          _mm_mul_ps(vsign, _mm_mul_ps(hit.vnx, voffset)));
+  __m128 voy = _mm_add_ps(hit.vpy,
+                          _mm_mul_ps(vsign, _mm_mul_ps(hit.vny, voffset)));
+  __m128 voz = _mm_add_ps(hit.vpz,
+                          _mm_mul_ps(vsign, _mm_mul_ps(hit.vnz, voffset)));
+  __m128 vt;
+  __m128 vhit = Intersect(lights, vox, voy, voz, vlx, vly, vlz, vt);
+  __m128 vhx = _mm_sub_ps(_mm_add_ps(vox, _mm_mul_ps(vlx, vt)), vox);
+  __m128 vhy = _mm_sub_ps(_mm_add_ps(voy, _mm_mul_ps(vly, vt)), voy);
+  __m128 vhz = _mm_sub_ps(_mm_add_ps(voz, _mm_mul_ps(vlz, vt)), voz);
+  __m128 vhit2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(vhx, vhx),
+                                       _mm_mul_ps(vhy, vhy)),
+                            _mm_mul_ps(vhz, vhz));
+  return _mm_and_ps(vhit, _mm_cmplt_ps(vhit2, vdist2));
+}
+
+template <fast_math::Accuracy A>
+inline void ShadePacket(const Lights& lights, const Hit& hit,
+                        const LightPacket& packet,
+                        __m128& vdiffuse, __m128& vspecular) {
+  Terms terms;
+  Evaluate<A>(packet, hit, terms);
+  __m128 voccluded = Occluded(lights, hit, terms.vlx, terms.vly, terms.vlz,
+                              terms.vcos, terms.vdist2);
+  vdiffuse = _mm_add_ps(vdiffuse, _mm_andnot_ps(voccluded, terms.vdiffuse));
+  vspecular = _mm_add_ps(vspecular,
+                         _mm_andnot_ps(voccluded, terms.vspecular));
+}
+
+// Visits the packets of the lights that are not culled. Subtrees are
+// skipped greedily while the bounds of everything skipped so far stay
+// within kCulledError.
+template <typename Visit>
+inline void VisitCulled(const Lights& lights, const Hit& hit, Visit visit) {
+  float culled = 0.0f;
+  for (size_t i = 0; i < lights.nodes.size();) {
+    const LightNode& node = lights.nodes[i];
+    const float bound = Bound(node, hit);
+    if (culled + bound <= kCulledError) {
+      culled += bound;
+      i = node.skip;
+      continue;
+    }
+    if (node.packet >= 0) {
+      visit(lights.packets[node.packet]);
+    }
+    ++i;
+  }
+}
+
+// Uniform in [0, 1), fixed for a hit point so that frames are repeatable.
+inline float HashPoint(const Hit& hit) {
+  uint32_t bits[3];
+  memcpy(bits, hit.point, sizeof(bits));
+  uint32_t h = bits[0] * 0x8DA6B343u ^ bits[1] * 0xD8163841u ^
+    bits[2] * 0xCB1AB31Fu;
+  h ^= h >> 16;
+  h *= 0x85EBCA6Bu;
+  h ^= h >> 13;
+  h *= 0xC2B2AE35u;
+  h ^= h >> 16;
+  return (h >> 8) * (1.0f / 16777216.0f);
+}
+
+// Traces shadow_rays rays to lights picked with probability proportional
+// to their unshadowed contribution, by systematic sampling over the
+// running sum, and weights every unoccluded one by 1 / (rays * p). When
+// no more lights remain than there are rays, all of them are traced.
+template <fast_math::Accuracy A>
+inline void ShadeSampled(const Lights& lights, const Hit& hit,
+                         int shadow_rays,
+                         __m128& vdiffuse, __m128& vspecular) {
+  const int budget = std::max(1, std::min(shadow_rays, kMaxShadowRays));
+  const __m128 vzero = _mm_setzero_ps();
+  const __m128 vdiffuse_weight = _mm_set_ps1(hit.diffuse_weight);
+  const __m128 vspecular_weight = _mm_set_ps1(hit.specular_weight);
+
+  // The terms are kept for sampling rather than evaluated twice.
+  arena::Scope scope;
+  arena::Buffer<Terms> evaluated;
+  evaluated.reserve(lights.packets.size());
+  __m128 vtotal = vzero;
+  int candidates = 0;
+  VisitCulled(lights, hit, [&](const LightPacket& packet) {
+    evaluated.emplace_back();
+    Evaluate<A>(packet, hit, evaluated.back());
+    __m128 vimportance = _mm_add_ps(
+      _mm_mul_ps(vdiffuse_weight, evaluated.back().vdiffuse),
+      _mm_mul_ps(vspecular_weight, evaluated.back().vspecular));
+    vtotal = _mm_add_ps(vtotal, vimportance);
+    const int mask = _mm_movemask_ps(_mm_cmpgt_ps(vimportance, vzero));
+    candidates += (mask & 1) + (mask >> 1 & 1) + (mask >> 2 & 1) +
+      (mask >> 3 & 1);
+  });
+
+  if (candidates <= budget) {
+    for (const Terms& terms : evaluated) {
+      __m128 voccluded = Occluded(lights, hit, terms.vlx, terms.vly,
+                                  terms.vlz, terms.vcos, terms.vdist2);
+      vdiffuse = _mm_add_ps(vdiffuse,
+                            _mm_andnot_ps(voccluded, terms.vdiffuse));
+      vspecular = _mm_add_ps(vspecular,
+                             _mm_andnot_ps(voccluded, terms.vspecular));
+    }
+    return;
+  }
+  vtotal = _mm_hadd_ps(vtotal, vtotal);
+  vtotal = _mm_hadd_ps(vtotal, vtotal);
+  const float total = _mm_cvtss_f32(vtotal);
+  if (!(total > 0.0f)) {
+    return;
+  }
+
+  // Samples in SoA, padded to whole packets with zero weights.
+  alignas(16) float lx[kMaxShadowRays + 4], ly[kMaxShadowRays + 4];
+  alignas(16) float lz[kMaxShadowRays + 4], cosine[kMaxShadowRays + 4];
+  alignas(16) float dist2[kMaxShadowRays + 4];
+  alignas(16) float diffuse[kMaxShadowRays + 4];
+  alignas(16) float specular[kMaxShadowRays + 4];
+  const float step = total / budget;
+  float next = HashPoint(hit) * step;
+  float sum = 0.0f;
+  int count = 0;
+  for (const Terms& terms : evaluated) {
+    if (count == budget) {
+      break;
+    }
+    const float* values[7] = {
+      reinterpret_cast<const float*>(&terms.vlx),
+      reinterpret_cast<const float*>(&terms.vly),
+      reinterpret_cast<const float*>(&terms.vlz),
+      reinterpret_cast<const float*>(&terms.vcos),
+      reinterpret_cast<const float*>(&terms.vdist2),
+      reinterpret_cast<const float*>(&terms.vdiffuse),
+      reinterpret_cast<const float*>(&terms.vspecular)
+    };
+    for (int k = 0; k < 4; ++k) {
+      const float weight = hit.diffuse_weight * values[5][k] +
+        hit.specular_weight * values[6][k];
+      if (!(weight > 0.0f)) {
+        continue;
+      }
+      sum += weight;
+      const float scale = step / weight;
+      for (; next < sum && count < budget; next += step, ++count) {
+        lx[count] = values[0][k];
+        ly[count] = values[1][k];
+        lz[count] = values[2][k];
+        cosine[count] = values[3][k];
+        dist2[count] = values[4][k];
+        diffuse[count] = values[5][k] * scale;
+        specular[count] = values[6][k] * scale;
+      }
+    }
+  }
+
+  for (int i = count; i % 4 != 0; ++i) {
+    lx[i] = lx[0];
+    ly[i] = ly[0];
+    lz[i] = lz[0];
+    cosine[i] = cosine[0];
+    dist2[i] = dist2[0];
+    diffuse[i] = specular[i] = 0.0f;
+  }
+  for (int i = 0; i < count; i += 4) {
+    __m128 voccluded = Occluded(lights, hit, _mm_load_ps(lx + i),
+                                _mm_load_ps(ly + i), _mm_load_ps(lz + i),
+                                _mm_load_ps(cosine + i),
+                                _mm_load_ps(dist2 + i));
+    vdiffuse = _mm_add_ps(vdiffuse,
+                          _mm_andnot_ps(voccluded, _mm_load_ps(diffuse + i)));
+    vspecular = _mm_add_ps(vspecular,
+                           _mm_andnot_ps(voccluded,
+                                         _mm_load_ps(specular + i)));
+  }
+}
+
+// Diffuse and specular light intensities at vpoint, with the terms and
+// shadow test of the per-light loop of the SSE versions. Lights are
+// culled or sampled as the settings of the packed lights say.
+template <fast_math::Accuracy A>
+inline void Shade(const Lights& lights, const __m128& vpoint,
+                  const __m128& vnorm, const __m128& vdir,
+                  const Material& material,
+                  float& diffuse, float& specular) {
+  const Hit hit = MakeHit(vpoint, vnorm, vdir, material);
+  __m128 vdiffuse = _mm_setzero_ps();
+  __m128 vspecular = _mm_setzero_ps();
+  auto shade_packet = [&](const LightPacket& packet) {
+    ShadePacket<A>(lights, hit, packet, vdiffuse, vspecular);
+  };
+
+  const Settings& settings = lights.settings;
+  if (settings.mode == Mode::kAll) {
+    for (const LightPacket& packet : lights.packets) {
+      shade_packet(packet);
+    }
+  } else if (settings.mode == Mode::kCulled) {
+    VisitCulled(lights, hit, shade_packet);
+  } else {
+    ShadeSampled<A>(lights, hit, settings.shadow_rays, vdiffuse, vspecular);
+  }
+
+  vdiffuse = _mm_hadd_ps(vdiffuse, vspecular);
+  vdiffuse = _mm_hadd_ps(vdiffuse, vdiffuse);
+  diffuse = _mm_cvtss_f32(vdiffuse);
+  specular = _mm_cvtss_f32(Broadcast<1>(vdiffuse));
+}
+
+} // namespace light_batch
+
+#endif // RTBENCH_COMMON_LIGHT_BATCH_H_
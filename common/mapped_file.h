@@ -0,0 +1,112 @@
+#ifndef RTBENCH_COMMON_MAPPED_FILE_H_
+#define RTBENCH_COMMON_MAPPED_FILE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace io {
+
+// Read-only view of a whole file. Pages are read in by whichever thread
+// touches them first, so converting row bands in parallel also reads the
+// file in parallel.
+class MappedFile {
+ public:
+  MappedFile() : data_(nullptr), size_(0) {}
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  ~MappedFile() {
+    Close();
+  }
+
+  bool Open(const char* filename) {
+    Close();
+#ifdef _WIN32
+    HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ,
+                              nullptr, OPEN_EXISTING,
+                              FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+      return false;
+    }
+    LARGE_INTEGER size;
+    HANDLE mapping = nullptr;
+    if (GetFileSizeEx(file, &size) && size.QuadPart > 0) {
+      mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0,
+                                   nullptr);
+    }
+    if (mapping != nullptr) {
+      data_ = static_cast<const uint8_t*>(
+        MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+      CloseHandle(mapping);
+    }
+    CloseHandle(file);
+    if (data_ == nullptr) {
+      return false;
+    }
+    size_ = static_cast<size_t>(size.QuadPart);
+#else
+    int file = open(filename, O_RDONLY);
+    if (file < 0) {
+      return false;
+    }
+    struct stat status;
+    void* data = MAP_FAILED;
+    if (fstat(file, &status) == 0 && status.st_size > 0) {
+      data = mmap(nullptr, static_cast<size_t>(status.st_size), PROT_READ,
+                  MAP_PRIVATE, file, 0);
+    }
+    close(file);
+    if (data == MAP_FAILED) {
+      return false;
+    }
+    data_ = static_cast<const uint8_t*>(data);
+    size_ = static_cast<size_t>(status.st_size);
+    madvise(data, size_, MADV_WILLNEED);
+#endif
+    return true;
+  }
+
+  void Close() {
+    if (data_ != nullptr) {
+#ifdef _WIN32
+      UnmapViewOfFile(data_);
+#else
+      munmap(const_cast<uint8_t*>(data_), size_);
+#endif
+    }
+    data_ = nullptr;
+    size_ = 0;
+  }
+
+  const uint8_t* data() const {
+    return data_;
+  }
+
+  size_t size() const {
+    return size_;
+  }
+
+ private:
+  const uint8_t* data_;
+  size_t size_;
+};
+
+} // namespace io
+
+#endif // RTBENCH_COMMON_MAPPED_FILE_H_
@@ -0,0 +1,356 @@
+#ifndef RTBENCH_COMMON_NUMA_H_
+#define RTBENCH_COMMON_NUMA_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <new>
+#include <vector>
+
+#include <omp.h>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <intrin.h>
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Thread and memory placement for multi-socket hosts. OpenMP thread t of T
+// runs on node t * N / T of the N active nodes, and large buffers are split
+// into N equal bands with band k on node k. A static schedule over image
+// rows hands every thread rows of its own node's band, so framebuffer
+// writes stay local. Without NUMA support everything is node 0.
+namespace numa {
+
+// Buffers below this size are not worth a separate mapping.
+const size_t kPlacedSize = 1 << 20;
+
+struct AccessStats {
+  long long local = 0;
+  long long remote = 0;
+  long long unknown = 0;
+};
+
+inline int& ActiveNodes() {
+  static int active_nodes = 0;
+  return active_nodes;
+}
+
+inline int GetSystemNodeCount() {
+#ifdef _WIN32
+  ULONG highest = 0;
+  return GetNumaHighestNodeNumber(&highest) ? static_cast<int>(highest) + 1 : 1;
+#else
+  int count = 0;
+  char path[64];
+  do {
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d", count);
+  } while (access(path, F_OK) == 0 && ++count < 64);
+  return std::max(count, 1);
+#endif
+}
+
+inline int GetNodeCount() {
+  if (ActiveNodes() == 0) {
+    ActiveNodes() = GetSystemNodeCount();
+  }
+  return ActiveNodes();
+}
+
+inline int GetCurrentNode() {
+#ifdef _WIN32
+  PROCESSOR_NUMBER processor;
+  GetCurrentProcessorNumberEx(&processor);
+  USHORT node = 0;
+  return GetNumaProcessorNodeEx(&processor, &node) ? node : 0;
+#else
+  unsigned cpu = 0, node = 0;
+  return syscall(SYS_getcpu, &cpu, &node, nullptr) == 0 ?
+    static_cast<int>(node) : 0;
+#endif
+}
+
+inline int GetThreadNode(int thread, int thread_count) {
+  return thread * GetNodeCount() / std::max(thread_count, 1);
+}
+
+#ifndef _WIN32
+inline std::vector<int> GetNodeCpus(int node) {
+  std::vector<int> cpus;
+  char path[64];
+  snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+           node);
+  FILE* file = fopen(path, "r");
+  if (file == nullptr) {
+    return cpus;
+  }
+  int first = 0, last = 0;
+  while (fscanf(file, "%d", &first) == 1) {
+    last = first;
+    int separator = fgetc(file);
+    if (separator == '-') {
+      if (fscanf(file, "%d", &last) != 1) {
+        break;
+      }
+      separator = fgetc(file);
+    }
+    for (int cpu = first; cpu <= last; ++cpu) {
+      cpus.push_back(cpu);
+    }
+    if (separator != ',') {
+      break;
+    }
+  }
+  fclose(file);
+  return cpus;
+}
+#endif
+
+inline int GetNodeProcessorCount(int node) {
+#ifdef _WIN32
+  GROUP_AFFINITY affinity;
+  if (!GetNumaNodeProcessorMaskEx(static_cast<USHORT>(node), &affinity)) {
+    return 0;
+  }
+  return static_cast<int>(__popcnt64(affinity.Mask));
+#else
+  return static_cast<int>(GetNodeCpus(node).size());
+#endif
+}
+
+inline bool PinCurrentThread(int node) {
+#ifdef _WIN32
+  GROUP_AFFINITY affinity;
+  return GetNumaNodeProcessorMaskEx(static_cast<USHORT>(node), &affinity) &&
+    SetThreadGroupAffinity(GetCurrentThread(), &affinity, nullptr);
+#else
+  std::vector<int> cpus = GetNodeCpus(node);
+  if (cpus.empty()) {
+    return false;
+  }
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu : cpus) {
+    CPU_SET(cpu, &set);
+  }
+  return sched_setaffinity(0, sizeof(set), &set) == 0;
+#endif
+}
+
+// Restricts rendering to the first node_count nodes: one thread per
+// processor of those nodes, and every thread pinned to its node. With all
+// nodes active the thread count goes back to the one the process started
+// with, which OMP_NUM_THREADS may set. Nested parallelism is switched off,
+// so renderers called from the parallel tile loops of the server and the
+// compact formats run their own loops on the calling thread. Returns the
+// thread count.
+inline int Configure(int node_count) {
+  static const int default_threads = omp_get_max_threads();
+  const int system_nodes = GetSystemNodeCount();
+  ActiveNodes() = std::max(1, std::min(node_count, system_nodes));
+
+  int threads = default_threads;
+  if (ActiveNodes() < system_nodes) {
+    int processors = 0;
+    for (int node = 0; node < ActiveNodes(); ++node) {
+      processors += GetNodeProcessorCount(node);
+    }
+    if (processors > 0) {
+      threads = processors;
+    }
+  }
+  omp_set_num_threads(threads);
+  omp_set_nested(0);
+
+  int thread_count = 1;
+  #pragma omp parallel
+  {
+    #pragma omp master
+    thread_count = omp_get_num_threads();
+    if (system_nodes > 1) {
+      PinCurrentThread(GetThreadNode(omp_get_thread_num(),
+                                     omp_get_num_threads()));
+    }
+  }
+  return thread_count;
+}
+
+inline void* Allocate(size_t size) {
+  if (size < kPlacedSize) {
+    return ::operator new(size);
+  }
+
+  const int nodes = GetNodeCount();
+  // Bands cover whole huge pages when they are large enough for them.
+  const size_t kHugePage = 2 << 20;
+  const size_t page = size >= nodes * kHugePage ? kHugePage : 4096;
+  size_t band = ((size + nodes - 1) / nodes + page - 1) / page * page;
+#ifdef _WIN32
+  char* data = static_cast<char*>(
+    VirtualAlloc(nullptr, size, MEM_RESERVE, PAGE_READWRITE));
+  if (data == nullptr) {
+    throw std::bad_alloc();
+  }
+  for (int node = 0; node < nodes; ++node) {
+    size_t offset = node * band;
+    if (offset < size && VirtualAllocExNuma(
+          GetCurrentProcess(), data + offset,
+          std::min(band, size - offset), MEM_COMMIT, PAGE_READWRITE,
+          static_cast<DWORD>(node)) == nullptr) {
+      VirtualFree(data, 0, MEM_RELEASE);
+      throw std::bad_alloc();
+    }
+  }
+#else
+  char* data = static_cast<char*>(mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+  if (data == MAP_FAILED) {
+    throw std::bad_alloc();
+  }
+#ifdef MADV_HUGEPAGE
+  // Transparent huge pages still follow the node bands set below.
+  madvise(data, size, MADV_HUGEPAGE);
+#endif
+  // A preferred policy keeps the page allocatable when a node is full.
+  const int kPreferred = 1;
+  for (int node = 0; nodes > 1 && node < nodes; ++node) {
+    size_t offset = node * band;
+    unsigned long mask = 1ul << node;
+    if (offset < size) {
+      syscall(SYS_mbind, data + offset, std::min(band, size - offset),
+              kPreferred, &mask, sizeof(mask) * 8, 0);
+    }
+  }
+#endif
+  return data;
+}
+
+inline void Free(void* data, size_t size) {
+  if (size < kPlacedSize) {
+    ::operator delete(data);
+    return;
+  }
+#ifdef _WIN32
+  VirtualFree(data, 0, MEM_RELEASE);
+#else
+  munmap(data, size);
+#endif
+}
+
+// Node of every page in [data, data + size), -1 where it is not resident
+// or the system can not tell.
+inline std::vector<int> GetPageNodes(const void* data, size_t size) {
+  const uintptr_t kPage = 4096;
+  uintptr_t begin = reinterpret_cast<uintptr_t>(data) & ~(kPage - 1);
+  uintptr_t end = reinterpret_cast<uintptr_t>(data) + size;
+  std::vector<int> nodes((end - begin + kPage - 1) / kPage, -1);
+  if (nodes.empty()) {
+    return nodes;
+  }
+
+#ifdef _WIN32
+  std::vector<PSAPI_WORKING_SET_EX_INFORMATION> info(nodes.size());
+  for (size_t i = 0; i < info.size(); ++i) {
+    info[i].VirtualAddress = reinterpret_cast<void*>(begin + i * kPage);
+  }
+  if (QueryWorkingSetEx(GetCurrentProcess(), info.data(), static_cast<DWORD>(
+        info.size() * sizeof(PSAPI_WORKING_SET_EX_INFORMATION)))) {
+    for (size_t i = 0; i < info.size(); ++i) {
+      if (info[i].VirtualAttributes.Valid) {
+        nodes[i] = static_cast<int>(info[i].VirtualAttributes.Node);
+      }
+    }
+  }
+#else
+  std::vector<void*> pages(nodes.size());
+  for (size_t i = 0; i < pages.size(); ++i) {
+    pages[i] = reinterpret_cast<void*>(begin + i * kPage);
+  }
+  std::vector<int> status(pages.size(), -1);
+  if (syscall(SYS_move_pages, 0, pages.size(), pages.data(), nullptr,
+              status.data(), 0) == 0) {
+    for (size_t i = 0; i < status.size(); ++i) {
+      nodes[i] = status[i] >= 0 ? status[i] : -1;
+    }
+  }
+#endif
+  return nodes;
+}
+
+// Visits image rows under the static schedule of the renderers and counts
+// the pages of each row that sit on the node of the thread visiting it
+// versus on another one. Only queries page placement, nothing is written.
+inline AccessStats CountRowAccesses(const void* data, size_t row_size,
+                                    int rows) {
+  long long local = 0, remote = 0, unknown = 0;
+  #pragma omp parallel for reduction(+: local, remote, unknown)
+  for (int i = 0; i < rows; ++i) {
+    const int node = GetCurrentNode();
+    std::vector<int> nodes = GetPageNodes(
+      static_cast<const char*>(data) + i * row_size, row_size);
+    for (int page_node : nodes) {
+      if (page_node < 0) {
+        ++unknown;
+      } else if (page_node == node) {
+        ++local;
+      } else {
+        ++remote;
+      }
+    }
+  }
+
+  AccessStats stats;
+  stats.local = local;
+  stats.remote = remote;
+  stats.unknown = unknown;
+  return stats;
+}
+
+// Places large containers with Allocate, so std::vector storage is split
+// into node bands before the first element is written.
+template <typename T>
+class Allocator {
+ public:
+  typedef T value_type;
+
+  Allocator() {}
+
+  template <typename U>
+  Allocator(const Allocator<U>&) {}
+
+  T* allocate(size_t count) {
+    return static_cast<T*>(Allocate(count * sizeof(T)));
+  }
+
+  void deallocate(T* data, size_t count) {
+    Free(data, count * sizeof(T));
+  }
+};
+
+template <typename T, typename U>
+bool operator==(const Allocator<T>&, const Allocator<U>&) {
+  return true;
+}
+
+template <typename T, typename U>
+bool operator!=(const Allocator<T>&, const Allocator<U>&) {
+  return false;
+}
+
+} // namespace numa
+
+#endif // RTBENCH_COMMON_NUMA_H_
@@ -0,0 +1,267 @@
+#ifndef RTBENCH_COMMON_PIXEL_FORMAT_H_
+#define RTBENCH_COMMON_PIXEL_FORMAT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <intrin.h>
+#include <immintrin.h>
+
+#include "framebuffer.h"
+#include "vector.h"
+
+// Framebuffer formats smaller than the 16 bytes of a Vector. Pixels are
+// converted four at a time with SSE, so a renderer keeps working on
+// Vectors in cache and only the compact form goes to memory.
+namespace pixel_format {
+
+enum class Format {
+  kRgba32f,
+  // Packed, 12 bytes per pixel.
+  kRgb32f,
+  // F16C half floats padded to 8 bytes, so two pixels fill one store.
+  kRgb16f,
+  // 10 bits per channel in [0, 1]: pixels are normalized as for PNG output,
+  // 4 bytes per pixel.
+  kRgb10a2
+};
+
+const int kFormatCount = 4;
+
+inline const char* GetName(Format format) {
+  static const char* const kNames[kFormatCount] = {
+    "RGBA32F", "RGB32F", "RGB16F", "RGB10A2"
+  };
+  return kNames[static_cast<int>(format)];
+}
+
+inline size_t GetPixelSize(Format format) {
+  static const size_t kSizes[kFormatCount] = { 16, 12, 8, 4 };
+  return kSizes[static_cast<int>(format)];
+}
+
+inline bool HasF16c() {
+  int cpu_info[4] = { 0 };
+  __cpuid(cpu_info, 1);
+  return (cpu_info[2] & (1 << 29)) != 0;
+}
+
+inline bool IsSupported(Format format) {
+  return format != Format::kRgb16f || HasF16c();
+}
+
+// Four pixels from 16-byte aligned Vectors to 4 * pixel size bytes.
+inline void Pack4(const Vector* pixels, Format format, uint8_t* target) {
+  __m128 vp0 = _mm_load_ps(pixels[0].data());
+  __m128 vp1 = _mm_load_ps(pixels[1].data());
+  __m128 vp2 = _mm_load_ps(pixels[2].data());
+  __m128 vp3 = _mm_load_ps(pixels[3].data());
+  float* target_f32 = reinterpret_cast<float*>(target);
+  __m128i* target_i128 = reinterpret_cast<__m128i*>(target);
+
+  if (format == Format::kRgba32f) {
+    _mm_storeu_ps(target_f32 + 0, vp0);
+    _mm_storeu_ps(target_f32 + 4, vp1);
+    _mm_storeu_ps(target_f32 + 8, vp2);
+    _mm_storeu_ps(target_f32 + 12, vp3);
+  } else if (format == Format::kRgb32f) {
+    // r0 g0 b0 r1 | g1 b1 r2 g2 | b2 r3 g3 b3
+    _mm_storeu_ps(target_f32 + 0, _mm_blend_ps(
+      vp0, _mm_shuffle_ps(vp1, vp1, _MM_SHUFFLE(0, 0, 0, 0)), 8));
+    _mm_storeu_ps(target_f32 + 4,
+                  _mm_shuffle_ps(vp1, vp2, _MM_SHUFFLE(1, 0, 2, 1)));
+    _mm_storeu_ps(target_f32 + 8, _mm_blend_ps(
+      _mm_shuffle_ps(vp3, vp3, _MM_SHUFFLE(2, 1, 0, 0)),
+      _mm_shuffle_ps(vp2, vp2, _MM_SHUFFLE(2, 2, 2, 2)), 1));
+  } else if (format == Format::kRgb16f) {
+    const int kNearest = 0;
+    _mm_storeu_si128(target_i128 + 0, _mm_unpacklo_epi64(
+      _mm_cvtps_ph(vp0, kNearest), _mm_cvtps_ph(vp1, kNearest)));
+    _mm_storeu_si128(target_i128 + 1, _mm_unpacklo_epi64(
+      _mm_cvtps_ph(vp2, kNearest), _mm_cvtps_ph(vp3, kNearest)));
+  } else {
+    _MM_TRANSPOSE4_PS(vp0, vp1, vp2, vp3);
+    // Same steps as image::NormalizePixel.
+    const __m128 vone = _mm_set_ps1(1.0f);
+    const __m128 vzero = _mm_set_ps1(0.0f);
+    __m128 vmax = _mm_max_ps(vp0, _mm_max_ps(vp1, vp2));
+    __m128 vscale = _mm_or_ps(
+      _mm_and_ps(_mm_cmpgt_ps(vmax, vone), _mm_div_ps(vone, vmax)),
+      _mm_andnot_ps(_mm_cmpgt_ps(vmax, vone), vone));
+    const __m128 v1023 = _mm_set_ps1(1023.0f);
+    __m128i vr = _mm_cvtps_epi32(_mm_mul_ps(_mm_min_ps(vone, _mm_max_ps(
+      vzero, _mm_mul_ps(vp0, vscale))), v1023));
+    __m128i vg = _mm_cvtps_epi32(_mm_mul_ps(_mm_min_ps(vone, _mm_max_ps(
+      vzero, _mm_mul_ps(vp1, vscale))), v1023));
+    __m128i vb = _mm_cvtps_epi32(_mm_mul_ps(_mm_min_ps(vone, _mm_max_ps(
+      vzero, _mm_mul_ps(vp2, vscale))), v1023));
+    __m128i vpacked = _mm_or_si128(
+      _mm_or_si128(vr, _mm_slli_epi32(vg, 10)),
+      _mm_or_si128(_mm_slli_epi32(vb, 20),
+                   _mm_set1_epi32(static_cast<int>(3u << 30))));
+    _mm_storeu_si128(target_i128, vpacked);
+  }
+}
+
+// Inverse of Pack4. Only RGBA32F keeps w, the others set it to zero as
+// image::Load does.
+inline void Unpack4(const uint8_t* source, Format format, Vector* pixels) {
+  const float* source_f32 = reinterpret_cast<const float*>(source);
+  const __m128i* source_i128 = reinterpret_cast<const __m128i*>(source);
+  const __m128 vzero = _mm_set_ps1(0.0f);
+  __m128 vp0, vp1, vp2, vp3;
+
+  if (format == Format::kRgba32f) {
+    vp0 = _mm_loadu_ps(source_f32 + 0);
+    vp1 = _mm_loadu_ps(source_f32 + 4);
+    vp2 = _mm_loadu_ps(source_f32 + 8);
+    vp3 = _mm_loadu_ps(source_f32 + 12);
+  } else if (format == Format::kRgb32f) {
+    __m128 va = _mm_loadu_ps(source_f32 + 0);
+    __m128 vb = _mm_loadu_ps(source_f32 + 4);
+    __m128 vc = _mm_loadu_ps(source_f32 + 8);
+    __m128 vt = _mm_shuffle_ps(va, vb, _MM_SHUFFLE(1, 0, 3, 3));
+    vp0 = _mm_blend_ps(va, vzero, 8);
+    vp1 = _mm_blend_ps(_mm_shuffle_ps(vt, vt, _MM_SHUFFLE(3, 3, 2, 0)),
+                       vzero, 8);
+    vp2 = _mm_blend_ps(_mm_shuffle_ps(vb, vc, _MM_SHUFFLE(0, 0, 3, 2)),
+                       vzero, 8);
+    vp3 = _mm_blend_ps(_mm_shuffle_ps(vc, vc, _MM_SHUFFLE(3, 3, 2, 1)),
+                       vzero, 8);
+  } else if (format == Format::kRgb16f) {
+    __m128i vh01 = _mm_loadu_si128(source_i128 + 0);
+    __m128i vh23 = _mm_loadu_si128(source_i128 + 1);
+    vp0 = _mm_blend_ps(_mm_cvtph_ps(vh01), vzero, 8);
+    vp1 = _mm_blend_ps(_mm_cvtph_ps(_mm_unpackhi_epi64(vh01, vh01)),
+                       vzero, 8);
+    vp2 = _mm_blend_ps(_mm_cvtph_ps(vh23), vzero, 8);
+    vp3 = _mm_blend_ps(_mm_cvtph_ps(_mm_unpackhi_epi64(vh23, vh23)),
+                       vzero, 8);
+  } else {
+    __m128i vpacked = _mm_loadu_si128(source_i128);
+    const __m128i vmask = _mm_set1_epi32(1023);
+    const __m128 vscale = _mm_set_ps1(1.0f / 1023.0f);
+    vp0 = _mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(vpacked, vmask)), vscale);
+    vp1 = _mm_mul_ps(_mm_cvtepi32_ps(
+      _mm_and_si128(_mm_srli_epi32(vpacked, 10), vmask)), vscale);
+    vp2 = _mm_mul_ps(_mm_cvtepi32_ps(
+      _mm_and_si128(_mm_srli_epi32(vpacked, 20), vmask)), vscale);
+    vp3 = vzero;
+    _MM_TRANSPOSE4_PS(vp0, vp1, vp2, vp3);
+  }
+
+  _mm_store_ps(pixels[0].data(), vp0);
+  _mm_store_ps(pixels[1].data(), vp1);
+  _mm_store_ps(pixels[2].data(), vp2);
+  _mm_store_ps(pixels[3].data(), vp3);
+}
+
+// Any count: the last partial group goes through a local buffer.
+inline void Pack(const Vector* pixels, size_t count, Format format,
+                 uint8_t* target) {
+  const size_t pixel_size = GetPixelSize(format);
+  const size_t full = count & ~static_cast<size_t>(3);
+  for (size_t i = 0; i < full; i += 4) {
+    Pack4(pixels + i, format, target + i * pixel_size);
+  }
+  if (full < count) {
+    Vector tail[4];
+    uint8_t bytes[4 * 16];
+    std::copy(pixels + full, pixels + count, tail);
+    Pack4(tail, format, bytes);
+    memcpy(target + full * pixel_size, bytes, (count - full) * pixel_size);
+  }
+}
+
+inline void Unpack(const uint8_t* source, size_t count, Format format,
+                   Vector* pixels) {
+  const size_t pixel_size = GetPixelSize(format);
+  const size_t full = count & ~static_cast<size_t>(3);
+  for (size_t i = 0; i < full; i += 4) {
+    Unpack4(source + i * pixel_size, format, pixels + i);
+  }
+  if (full < count) {
+    Vector tail[4];
+    uint8_t bytes[4 * 16] = { 0 };
+    memcpy(bytes, source + full * pixel_size, (count - full) * pixel_size);
+    Unpack4(bytes, format, tail);
+    std::copy(tail, tail + (count - full), pixels + full);
+  }
+}
+
+// Row-major image in one format. Storage is placed like a Framebuffer.
+class Image {
+ public:
+  Image() : format_(Format::kRgba32f), w_(0), h_(0) {}
+
+  Image(Format format, int w, int h)
+      : format_(format), w_(w), h_(h),
+        data_(static_cast<size_t>(h) * w * GetPixelSize(format)) {}
+
+  Format format() const {
+    return format_;
+  }
+
+  int w() const {
+    return w_;
+  }
+
+  int h() const {
+    return h_;
+  }
+
+  size_t size_in_bytes() const {
+    return data_.size();
+  }
+
+  uint8_t* Pixel(int x, int y) {
+    return data_.data() + (static_cast<size_t>(y) * w_ + x) *
+      GetPixelSize(format_);
+  }
+
+  const uint8_t* Pixel(int x, int y) const {
+    return data_.data() + (static_cast<size_t>(y) * w_ + x) *
+      GetPixelSize(format_);
+  }
+
+  void Store(const Vector* pixels, int x, int y, int count) {
+    Pack(pixels, count, format_, Pixel(x, y));
+  }
+
+  void Load(int x, int y, int count, Vector* pixels) const {
+    Unpack(Pixel(x, y), count, format_, pixels);
+  }
+
+ private:
+  Format format_;
+  int w_;
+  int h_;
+  std::vector<uint8_t, FramebufferAllocator<uint8_t>> data_;
+};
+
+template <typename Pixels>
+inline void FromPixels(const Pixels& pixels, Image& image) {
+  #pragma omp parallel for
+  for (int i = 0; i < image.h(); ++i) {
+    image.Store(pixels.data() + static_cast<size_t>(i) * image.w(), 0, i,
+                image.w());
+  }
+}
+
+template <typename Pixels>
+inline void ToPixels(const Image& image, Pixels& pixels) {
+  pixels.resize(static_cast<size_t>(image.w()) * image.h());
+  #pragma omp parallel for
+  for (int i = 0; i < image.h(); ++i) {
+    image.Load(0, i, image.w(),
+               pixels.data() + static_cast<size_t>(i) * image.w());
+  }
+}
+
+} // namespace pixel_format
+
+#endif // RTBENCH_COMMON_PIXEL_FORMAT_H_
@@ -0,0 +1,73 @@
+#ifndef RTBENCH_COMMON_RAY_BINNING_H_
+#define RTBENCH_COMMON_RAY_BINNING_H_
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "arena.h"
+#include "vector.h"
+
+// Groups rays of a batch so that neighbours share a direction octant and
+// an origin cell before they are packed into SIMD lanes. Keys are built by
+// the renderer for its own ray layout and sorted here into a permutation.
+namespace binning {
+
+const int kCellBits = 3;
+const int kKeyBits = 3 + 3 * kCellBits;
+const uint32_t kBinCount = 1u << kKeyBits;
+
+struct Bounds {
+  Vector min;
+  Vector max;
+};
+
+inline uint32_t Cell(float value, float min, float max) {
+  const float kCells = static_cast<float>(1 << kCellBits);
+  float cell = (value - min) / (max - min) * kCells;
+  return static_cast<uint32_t>(std::max(0.0f, std::min(kCells - 1.0f, cell)));
+}
+
+// Direction octant in the top bits, Morton code of the origin cell below,
+// so rays of one octant are ordered along a space-filling curve.
+inline uint32_t Key(float ox, float oy, float oz,
+                    float dx, float dy, float dz,
+                    const Bounds& bounds) {
+  uint32_t cx = Cell(ox, bounds.min.x(), bounds.max.x());
+  uint32_t cy = Cell(oy, bounds.min.y(), bounds.max.y());
+  uint32_t cz = Cell(oz, bounds.min.z(), bounds.max.z());
+
+  uint32_t morton = 0;
+  for (int bit = 0; bit < kCellBits; ++bit) {
+    morton |= ((cx >> bit) & 1) << (3 * bit + 0);
+    morton |= ((cy >> bit) & 1) << (3 * bit + 1);
+    morton |= ((cz >> bit) & 1) << (3 * bit + 2);
+  }
+
+  uint32_t octant = (dx < 0.0f ? 1 : 0) | (dy < 0.0f ? 2 : 0) |
+    (dz < 0.0f ? 4 : 0);
+  return (octant << (3 * kCellBits)) | morton;
+}
+
+// Stable counting sort: order[i] is the index of the ray placed at i.
+template <typename Keys, typename Order>
+inline void Sort(const Keys& keys, size_t count, Order& order) {
+  order.resize(count);
+  arena::Scope scope;
+  arena::Buffer<uint32_t> offsets(kBinCount + 1, 0);
+  for (size_t i = 0; i < count; ++i) {
+    ++offsets[keys[i] + 1];
+  }
+  for (uint32_t bin = 0; bin < kBinCount; ++bin) {
+    offsets[bin + 1] += offsets[bin];
+  }
+
+  for (size_t i = 0; i < count; ++i) {
+    order[offsets[keys[i]]++] = static_cast<uint32_t>(i);
+  }
+}
+
+} // namespace binning
+
+#endif // RTBENCH_COMMON_RAY_BINNING_H_
@@ -3,6 +3,10 @@
 
 #include <vector>
 
+#include <math.h>
+
+#include "box.h"
+#include "framebuffer.h"
 #include "light.h"
 #include "material.h"
 #include "sphere.h"
@@ -10,7 +14,9 @@
 
 class Scene {
  public:
-  Scene(const std::vector<Vector>& input) {
+  // The default objects on an empty image; a background is loaded straight
+  // into GetImage() or set with SetBackground.
+  Scene() {
     Material ivory(1.0f,
                   Vector(0.6f, 0.3f, 0.1f, 0.0f),
                   Vector(0.4f, 0.4f, 0.3f),
@@ -33,10 +39,64 @@ class Scene {
     spheres_.push_back(Sphere(Vector(1.5f, -0.5f, -18.0f), 3.0f, red_rubber));
     spheres_.push_back(Sphere(Vector(7.0f, 5.0f, -18.0f), 4.0f, mirror));
 
+    Material floor(1.0f,
+                   Vector(1.0f, 0.0f, 0.0f, 0.0f),
+                   Vector(0.3f, 0.2f, 0.1f),
+                   0.0f);
+    boxes_.push_back(Box(Vector(-10.0f, -4.0f, -30.0f),
+                         Vector(10.0f, -4.0f, -10.0f),
+                         floor, Vector(0.3f, 0.3f, 0.3f)));
+
     lights_.push_back(Light(Vector(-20.0f, 20.0f, 20.0f), 1.5f));
     lights_.push_back(Light(Vector(30.0f, 50.0f, -25.0f), 1.8f));
     lights_.push_back(Light(Vector(30.0f, 20.0f, 30.0f), 1.7f));
+  }
 
+  Scene(const std::vector<Vector>& input) : Scene() {
+    SetBackground(input);
+  }
+
+  // Extra lights for many-light runs, spread on rings around and above the
+  // spheres with intensities between 0.25 and 1.75 of the mean. The total
+  // intensity matches one default light, so the exposure stays the same
+  // whatever the count.
+  void AddLights(int count) {
+    for (int i = 0; i < count; ++i) {
+      const float angle = 2.39996323f * i;
+      const float radius = 12.0f + 6.0f * (i % 5);
+      const float height = 8.0f + 5.0f * (i % 9);
+      const float weight = 0.25f + 1.5f * ((i * 7) % 11) / 10.0f;
+      lights_.push_back(Light(Vector(radius * cosf(angle), height,
+                                     -16.0f + radius * sinf(angle)),
+                              1.7f * weight / count));
+    }
+  }
+
+  // Procedural spheres for scenes larger than the caches, scattered over a
+  // slab behind the default spheres along a low-discrepancy sequence, with
+  // the materials of the default spheres in turn. Radii shrink with the
+  // count so that about a third of the rays crossing the slab still get
+  // through, whatever the count, and traversals reach deep into the tree.
+  void AddSpheres(int count) {
+    const size_t first = spheres_.size();
+    const float radius = sqrtf(80.0f * 34.0f / (3.14159265f * count));
+    spheres_.reserve(first + count);
+    for (int i = 0; i < count; ++i) {
+      const double n = i + 1.0;
+      const float u = static_cast<float>(fmod(0.5 + n * 0.8191725134, 1.0));
+      const float v = static_cast<float>(fmod(0.5 + n * 0.6710436067, 1.0));
+      const float s = static_cast<float>(fmod(0.5 + n * 0.5497004779, 1.0));
+      spheres_.push_back(Sphere(Vector(-40.0f + 80.0f * u,
+                                       -4.0f + 34.0f * v,
+                                       -25.0f - 75.0f * s),
+                                radius * (0.5f + ((i * 7) % 11) / 10.0f),
+                                spheres_[i % first].material()));
+    }
+  }
+
+  // Starts a new frame from the background. The image keeps its storage,
+  // so a scene built once serves every frame.
+  void SetBackground(const std::vector<Vector>& input) {
     image_.resize(input.size());
     std::copy(input.begin(), input.end(), image_.begin());
   }
@@ -45,18 +105,23 @@ class Scene {
     return spheres_;
   }
 
+  const std::vector<Box>& GetBoxes() const {
+    return boxes_;
+  }
+
   const std::vector<Light>& GetLights() const {
     return lights_;
   }
 
-  std::vector<Vector>& GetImage() {
+  Framebuffer& GetImage() {
     return image_;
   }
 
  private:
   std::vector<Sphere> spheres_;
+  std::vector<Box> boxes_;
   std::vector<Light> lights_;
-  std::vector<Vector> image_;
+  Framebuffer image_;
 };
 
 #endif // RTBENCH_COMMON_SCENE_H_
\ No newline at end of file
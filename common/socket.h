@@ -0,0 +1,247 @@
+#ifndef RTBENCH_COMMON_SOCKET_H_
+#define RTBENCH_COMMON_SOCKET_H_
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <vector>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "Ws2_32.lib")
+#else
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+
+// Minimal blocking TCP socket over Winsock and BSD sockets.
+namespace net {
+
+#ifdef _WIN32
+typedef SOCKET Handle;
+const Handle kInvalidHandle = INVALID_SOCKET;
+#else
+typedef int Handle;
+const Handle kInvalidHandle = -1;
+#endif
+
+inline bool Initialize() {
+#ifdef _WIN32
+  static bool initialized = false;
+  if (!initialized) {
+    WSADATA data;
+    initialized = WSAStartup(MAKEWORD(2, 2), &data) == 0;
+  }
+  return initialized;
+#else
+  return true;
+#endif
+}
+
+class Socket {
+ public:
+  Socket() : handle_(kInvalidHandle) {}
+  explicit Socket(Handle handle) : handle_(handle) {}
+
+  Socket(Socket&& other) : handle_(other.handle_) {
+    other.handle_ = kInvalidHandle;
+  }
+
+  Socket& operator=(Socket&& other) {
+    if (this != &other) {
+      Close();
+      handle_ = other.handle_;
+      other.handle_ = kInvalidHandle;
+    }
+    return *this;
+  }
+
+  Socket(const Socket&) = delete;
+  Socket& operator=(const Socket&) = delete;
+
+  ~Socket() {
+    Close();
+  }
+
+  bool valid() const {
+    return handle_ != kInvalidHandle;
+  }
+
+  Handle handle() const {
+    return handle_;
+  }
+
+  // Binds to all local interfaces.
+  bool Listen(int port, int backlog) {
+    Close();
+    handle_ = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (!valid()) {
+      return false;
+    }
+
+    int reuse = 1;
+    setsockopt(handle_, SOL_SOCKET, SO_REUSEADDR,
+               reinterpret_cast<const char*>(&reuse), sizeof(reuse));
+
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(static_cast<unsigned short>(port));
+    if (bind(handle_, reinterpret_cast<sockaddr*>(&address),
+             sizeof(address)) != 0 || listen(handle_, backlog) != 0) {
+      Close();
+      return false;
+    }
+    return true;
+  }
+
+  Socket Accept() {
+    Socket client(accept(handle_, nullptr, nullptr));
+    client.SetNoDelay();
+    return client;
+  }
+
+  bool Connect(const char* host, int port) {
+    Close();
+    char service[16] = { 0 };
+    snprintf(service, sizeof(service), "%d", port);
+
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* info = nullptr;
+    if (getaddrinfo(host, service, &hints, &info) != 0) {
+      return false;
+    }
+
+    for (addrinfo* it = info; it != nullptr && !valid(); it = it->ai_next) {
+      handle_ = socket(it->ai_family, it->ai_socktype, it->ai_protocol);
+      if (valid() && connect(handle_, it->ai_addr,
+                             static_cast<int>(it->ai_addrlen)) != 0) {
+        Close();
+      }
+    }
+    freeaddrinfo(info);
+
+    if (valid()) {
+      SetNoDelay();
+    }
+    return valid();
+  }
+
+  // Makes receives fail instead of blocking forever on a hung peer.
+  bool SetTimeout(int timeout_ms) {
+#ifdef _WIN32
+    DWORD timeout = timeout_ms;
+#else
+    timeval timeout;
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_usec = (timeout_ms % 1000) * 1000;
+#endif
+    return setsockopt(handle_, SOL_SOCKET, SO_RCVTIMEO,
+                      reinterpret_cast<const char*>(&timeout),
+                      sizeof(timeout)) == 0;
+  }
+
+  bool SendAll(const void* data, size_t size) {
+    const char* bytes = static_cast<const char*>(data);
+    while (size > 0) {
+      int chunk = static_cast<int>(size < (1 << 30) ? size : (1 << 30));
+#ifdef _WIN32
+      int sent = send(handle_, bytes, chunk, 0);
+#else
+      int sent = static_cast<int>(send(handle_, bytes, chunk, MSG_NOSIGNAL));
+#endif
+      if (sent <= 0) {
+        return false;
+      }
+      bytes += sent;
+      size -= sent;
+    }
+    return true;
+  }
+
+  bool RecvAll(void* data, size_t size) {
+    char* bytes = static_cast<char*>(data);
+    while (size > 0) {
+      int chunk = static_cast<int>(size < (1 << 30) ? size : (1 << 30));
+      int received = static_cast<int>(recv(handle_, bytes, chunk, 0));
+      if (received <= 0) {
+        return false;
+      }
+      bytes += received;
+      size -= received;
+    }
+    return true;
+  }
+
+  void Close() {
+    if (valid()) {
+#ifdef _WIN32
+      closesocket(handle_);
+#else
+      close(handle_);
+#endif
+      handle_ = kInvalidHandle;
+    }
+  }
+
+ private:
+  void SetNoDelay() {
+    if (valid()) {
+      int no_delay = 1;
+      setsockopt(handle_, IPPROTO_TCP, TCP_NODELAY,
+                 reinterpret_cast<const char*>(&no_delay), sizeof(no_delay));
+    }
+  }
+
+  Handle handle_;
+};
+
+// Waits up to timeout_ms for any of the sockets to become readable and
+// returns their indices; an empty result means a timeout.
+inline std::vector<size_t> WaitReadable(const std::vector<Socket*>& sockets,
+                                        int timeout_ms) {
+  fd_set set;
+  FD_ZERO(&set);
+  Handle max_handle = 0;
+  for (size_t i = 0; i < sockets.size(); ++i) {
+    FD_SET(sockets[i]->handle(), &set);
+    max_handle = sockets[i]->handle() > max_handle ?
+      sockets[i]->handle() : max_handle;
+  }
+
+  timeval timeout;
+  timeout.tv_sec = timeout_ms / 1000;
+  timeout.tv_usec = (timeout_ms % 1000) * 1000;
+
+  std::vector<size_t> readable;
+  if (select(static_cast<int>(max_handle + 1), &set, nullptr, nullptr,
+             &timeout) > 0) {
+    for (size_t i = 0; i < sockets.size(); ++i) {
+      if (FD_ISSET(sockets[i]->handle(), &set)) {
+        readable.push_back(i);
+      }
+    }
+  }
+  return readable;
+}
+
+} // namespace net
+
+#endif // RTBENCH_COMMON_SOCKET_H_
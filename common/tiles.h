@@ -0,0 +1,72 @@
+#ifndef RTBENCH_COMMON_TILES_H_
+#define RTBENCH_COMMON_TILES_H_
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "vector.h"
+
+// Square image tiles numbered row by row, used to split frames into
+// independent jobs. Fields are fixed-size so a tile can go on the wire.
+namespace tiles {
+
+const int kTileSize = 64;
+
+struct Tile {
+  int32_t id;
+  int32_t x0;
+  int32_t y0;
+  int32_t w;
+  int32_t h;
+};
+
+inline int GetTileCount(int w, int h) {
+  return ((w + kTileSize - 1) / kTileSize) * ((h + kTileSize - 1) / kTileSize);
+}
+
+inline Tile GetTile(int id, int w, int h) {
+  const int tiles_x = (w + kTileSize - 1) / kTileSize;
+  Tile tile;
+  tile.id = id;
+  tile.x0 = id % tiles_x * kTileSize;
+  tile.y0 = id / tiles_x * kTileSize;
+  tile.w = std::min(kTileSize, w - tile.x0);
+  tile.h = std::min(kTileSize, h - tile.y0);
+  return tile;
+}
+
+inline bool IsValid(const Tile& tile, int w, int h) {
+  if (tile.id < 0 || tile.id >= GetTileCount(w, h)) {
+    return false;
+  }
+  Tile expected = GetTile(tile.id, w, h);
+  return tile.x0 == expected.x0 && tile.y0 == expected.y0 &&
+    tile.w == expected.w && tile.h == expected.h;
+}
+
+// Copies the tile window of a w-wide image into a packed tile buffer.
+template <typename Source, typename Target>
+inline void Extract(const Source& image, int w, const Tile& tile,
+                    Target& pixels) {
+  pixels.resize(static_cast<size_t>(tile.w) * tile.h);
+  for (int i = 0; i < tile.h; ++i) {
+    const Vector* row = image.data() +
+      static_cast<size_t>(tile.y0 + i) * w + tile.x0;
+    std::copy(row, row + tile.w, pixels.begin() + i * tile.w);
+  }
+}
+
+template <typename Target>
+inline void Store(const Vector* pixels, const Tile& tile,
+                  Target& image, int w) {
+  for (int i = 0; i < tile.h; ++i) {
+    std::copy(pixels + i * tile.w, pixels + (i + 1) * tile.w,
+              image.begin() + static_cast<size_t>(tile.y0 + i) * w + tile.x0);
+  }
+}
+
+} // namespace tiles
+
+#endif // RTBENCH_COMMON_TILES_H_
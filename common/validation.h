@@ -0,0 +1,289 @@
+#ifndef RTBENCH_COMMON_VALIDATION_H_
+#define RTBENCH_COMMON_VALIDATION_H_
+
+#include <assert.h>
+#include <math.h>
+
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+#include <intrin.h>
+#include <immintrin.h>
+
+#include "tiles.h"
+#include "vector.h"
+
+// Whole-image comparison of an output to a reference on the normalized
+// pixels that go to the PNG output, so approximate versions can be gated on
+// how far they drift instead of on the first pixel that differs.
+namespace validation {
+
+const int kSsimWindow = 8;
+const int kSsimStride = 4;
+
+struct Thresholds {
+  // Largest norm of a pixel difference, as checked for every version.
+  float max_error;
+  double min_psnr;
+  double min_ssim;
+};
+
+struct Report {
+  int w = 0;
+  int h = 0;
+  float max_error = 0.0f;
+  int max_x = 0;
+  int max_y = 0;
+  double mean_error = 0.0;
+  // Infinite for identical images.
+  double psnr = 0.0;
+  double ssim = 0.0;
+  // Largest error of every tiles::Tile, row by row.
+  std::vector<float> tile_errors;
+};
+
+namespace internal {
+
+inline __m128 Normalize(__m128 vp, __m128 vmax) {
+  const __m128 vone = _mm_set_ps1(1.0f);
+  __m128 vscale = _mm_or_ps(
+    _mm_and_ps(_mm_cmpgt_ps(vmax, vone), _mm_div_ps(vone, vmax)),
+    _mm_andnot_ps(_mm_cmpgt_ps(vmax, vone), vone));
+  return _mm_min_ps(vone, _mm_max_ps(_mm_setzero_ps(),
+                                     _mm_mul_ps(vp, vscale)));
+}
+
+// Same steps as image::NormalizePixel for four pixels, one channel per
+// register.
+inline void Normalize4(const Vector* pixels, __m128& vr, __m128& vg,
+                       __m128& vb) {
+  __m128 vp0 = _mm_load_ps(pixels[0].data());
+  __m128 vp1 = _mm_load_ps(pixels[1].data());
+  __m128 vp2 = _mm_load_ps(pixels[2].data());
+  __m128 vp3 = _mm_load_ps(pixels[3].data());
+  _MM_TRANSPOSE4_PS(vp0, vp1, vp2, vp3);
+  __m128 vmax = _mm_max_ps(vp0, _mm_max_ps(vp1, vp2));
+  vr = Normalize(vp0, vmax);
+  vg = Normalize(vp1, vmax);
+  vb = Normalize(vp2, vmax);
+}
+
+inline __m128 Luminance(__m128 vr, __m128 vg, __m128 vb) {
+  return _mm_add_ps(
+    _mm_mul_ps(vr, _mm_set_ps1(0.2126f)),
+    _mm_add_ps(_mm_mul_ps(vg, _mm_set_ps1(0.7152f)),
+               _mm_mul_ps(vb, _mm_set_ps1(0.0722f))));
+}
+
+inline float HorizontalSum(__m128 v) {
+  v = _mm_add_ps(v, _mm_movehl_ps(v, v));
+  v = _mm_add_ss(v, _mm_movehdup_ps(v));
+  return _mm_cvtss_f32(v);
+}
+
+struct TileSums {
+  float max_error;
+  int max_x;
+  int max_y;
+  double errors;
+  double squares;
+};
+
+// Errors of one tile, and the luminance of both images for SSIM.
+template <typename Output, typename Reference>
+inline TileSums CompareTile(const Output& output, const Reference& reference,
+                            int w, const tiles::Tile& tile,
+                            float* output_luma, float* reference_luma) {
+  TileSums sums = { 0.0f, tile.x0, tile.y0, 0.0, 0.0 };
+  alignas(16) Vector output_tail[4];
+  alignas(16) Vector reference_tail[4];
+  alignas(16) float errors[4];
+  for (int i = tile.y0; i < tile.y0 + tile.h; ++i) {
+    const size_t row = static_cast<size_t>(i) * w;
+    __m128 vsquares = _mm_setzero_ps();
+    __m128 verrors = _mm_setzero_ps();
+    for (int j = tile.x0; j < tile.x0 + tile.w; j += 4) {
+      const int count = std::min(4, tile.x0 + tile.w - j);
+      const Vector* output_pixels = output.data() + row + j;
+      const Vector* reference_pixels = reference.data() + row + j;
+      // Black padding normalizes to zero in both images.
+      if (count < 4) {
+        for (int k = 0; k < 4; ++k) {
+          output_tail[k] = k < count ? output_pixels[k] : Vector();
+          reference_tail[k] = k < count ? reference_pixels[k] : Vector();
+        }
+        output_pixels = output_tail;
+        reference_pixels = reference_tail;
+      }
+
+      __m128 vor, vog, vob, vrr, vrg, vrb;
+      Normalize4(output_pixels, vor, vog, vob);
+      Normalize4(reference_pixels, vrr, vrg, vrb);
+      __m128 vdr = _mm_sub_ps(vor, vrr);
+      __m128 vdg = _mm_sub_ps(vog, vrg);
+      __m128 vdb = _mm_sub_ps(vob, vrb);
+      __m128 vsquare = _mm_add_ps(
+        _mm_mul_ps(vdr, vdr),
+        _mm_add_ps(_mm_mul_ps(vdg, vdg), _mm_mul_ps(vdb, vdb)));
+      __m128 verror = _mm_sqrt_ps(vsquare);
+      vsquares = _mm_add_ps(vsquares, vsquare);
+      verrors = _mm_add_ps(verrors, verror);
+
+      _mm_store_ps(errors, verror);
+      for (int k = 0; k < count; ++k) {
+        if (errors[k] > sums.max_error) {
+          sums.max_error = errors[k];
+          sums.max_x = j + k;
+          sums.max_y = i;
+        }
+      }
+
+      alignas(16) float luma[4];
+      _mm_store_ps(luma, Luminance(vor, vog, vob));
+      std::copy(luma, luma + count, output_luma + row + j);
+      _mm_store_ps(luma, Luminance(vrr, vrg, vrb));
+      std::copy(luma, luma + count, reference_luma + row + j);
+    }
+    sums.squares += HorizontalSum(vsquares);
+    sums.errors += HorizontalSum(verrors);
+  }
+  return sums;
+}
+
+// Mean SSIM of the windows starting on one row, constants of Wang et al.
+// for a dynamic range of 1.
+inline double SsimRow(const float* x, const float* y, int w, int i) {
+  const float kC1 = 0.01f * 0.01f;
+  const float kC2 = 0.03f * 0.03f;
+  const float kCount = static_cast<float>(kSsimWindow * kSsimWindow);
+  double sum = 0.0;
+  for (int j = 0; j + kSsimWindow <= w; j += kSsimStride) {
+    __m128 vx = _mm_setzero_ps(), vy = _mm_setzero_ps();
+    __m128 vxx = _mm_setzero_ps(), vyy = _mm_setzero_ps();
+    __m128 vxy = _mm_setzero_ps();
+    for (int k = 0; k < kSsimWindow; ++k) {
+      const size_t offset = static_cast<size_t>(i + k) * w + j;
+      for (int l = 0; l < kSsimWindow; l += 4) {
+        __m128 vpx = _mm_loadu_ps(x + offset + l);
+        __m128 vpy = _mm_loadu_ps(y + offset + l);
+        vx = _mm_add_ps(vx, vpx);
+        vy = _mm_add_ps(vy, vpy);
+        vxx = _mm_add_ps(vxx, _mm_mul_ps(vpx, vpx));
+        vyy = _mm_add_ps(vyy, _mm_mul_ps(vpy, vpy));
+        vxy = _mm_add_ps(vxy, _mm_mul_ps(vpx, vpy));
+      }
+    }
+    float mean_x = HorizontalSum(vx) / kCount;
+    float mean_y = HorizontalSum(vy) / kCount;
+    float var_x = HorizontalSum(vxx) / kCount - mean_x * mean_x;
+    float var_y = HorizontalSum(vyy) / kCount - mean_y * mean_y;
+    float cov = HorizontalSum(vxy) / kCount - mean_x * mean_y;
+    sum += (2.0f * mean_x * mean_y + kC1) * (2.0f * cov + kC2) /
+      ((mean_x * mean_x + mean_y * mean_y + kC1) * (var_x + var_y + kC2));
+  }
+  return sum;
+}
+
+} // namespace internal
+
+// Both images are w x h Vectors. Tiles are compared in parallel and the
+// partial sums are added in tile order, so reports do not depend on the
+// thread count.
+template <typename Output, typename Reference>
+inline Report Compare(const Output& output, const Reference& reference,
+                      int w, int h) {
+  assert(output.size() == static_cast<size_t>(w) * h);
+  assert(reference.size() == output.size());
+
+  Report report;
+  report.w = w;
+  report.h = h;
+  const int tile_count = tiles::GetTileCount(w, h);
+  std::vector<internal::TileSums> sums(tile_count);
+  std::vector<float> output_luma(output.size());
+  std::vector<float> reference_luma(output.size());
+  #pragma omp parallel for schedule(dynamic)
+  for (int t = 0; t < tile_count; ++t) {
+    sums[t] = internal::CompareTile(output, reference, w,
+                                    tiles::GetTile(t, w, h),
+                                    output_luma.data(),
+                                    reference_luma.data());
+  }
+
+  double errors = 0.0, squares = 0.0;
+  report.tile_errors.resize(tile_count);
+  for (int t = 0; t < tile_count; ++t) {
+    errors += sums[t].errors;
+    squares += sums[t].squares;
+    report.tile_errors[t] = sums[t].max_error;
+    if (sums[t].max_error > report.max_error) {
+      report.max_error = sums[t].max_error;
+      report.max_x = sums[t].max_x;
+      report.max_y = sums[t].max_y;
+    }
+  }
+  const double pixel_count = static_cast<double>(output.size());
+  report.mean_error = errors / pixel_count;
+  const double mse = squares / (3.0 * pixel_count);
+  report.psnr = mse > 0.0 ? 10.0 * log10(1.0 / mse) :
+    std::numeric_limits<double>::infinity();
+
+  // Images smaller than a window have no SSIM, only identical ones pass.
+  const int window_rows = h < kSsimWindow ? 0 :
+    (h - kSsimWindow) / kSsimStride + 1;
+  const int windows_per_row = w < kSsimWindow ? 0 :
+    (w - kSsimWindow) / kSsimStride + 1;
+  std::vector<double> ssim_rows(window_rows);
+  #pragma omp parallel for
+  for (int r = 0; r < window_rows; ++r) {
+    ssim_rows[r] = internal::SsimRow(output_luma.data(),
+                                     reference_luma.data(), w,
+                                     r * kSsimStride);
+  }
+  double ssim = 0.0;
+  for (int r = 0; r < window_rows; ++r) {
+    ssim += ssim_rows[r];
+  }
+  const double window_count = static_cast<double>(window_rows) *
+    windows_per_row;
+  report.ssim = window_count > 0 ? ssim / window_count :
+    (mse > 0.0 ? 0.0 : 1.0);
+  return report;
+}
+
+inline bool Passes(const Report& report, const Thresholds& thresholds) {
+  return report.max_error <= thresholds.max_error &&
+    report.psnr >= thresholds.min_psnr && report.ssim >= thresholds.min_ssim;
+}
+
+inline int CountTilesAbove(const Report& report, float max_error) {
+  return static_cast<int>(std::count_if(
+    report.tile_errors.begin(), report.tile_errors.end(),
+    [max_error](float error) { return error > max_error; }));
+}
+
+// Every tile filled with its largest error, black through red and yellow
+// to white at the scale and above, so failing tiles stand out in white.
+inline std::vector<Vector> Heatmap(const Report& report, float scale) {
+  assert(scale > 0.0f);
+  std::vector<Vector> image(static_cast<size_t>(report.w) * report.h);
+  const int tile_count = static_cast<int>(report.tile_errors.size());
+  #pragma omp parallel for
+  for (int t = 0; t < tile_count; ++t) {
+    float level = 3.0f * std::min(1.0f, report.tile_errors[t] / scale);
+    Vector color(std::min(1.0f, level),
+                 std::max(0.0f, std::min(1.0f, level - 1.0f)),
+                 std::max(0.0f, level - 2.0f));
+    const tiles::Tile tile = tiles::GetTile(t, report.w, report.h);
+    for (int i = tile.y0; i < tile.y0 + tile.h; ++i) {
+      std::fill_n(image.begin() + static_cast<size_t>(i) * report.w +
+                  tile.x0, tile.w, color);
+    }
+  }
+  return image;
+}
+
+} // namespace validation
+
+#endif // RTBENCH_COMMON_VALIDATION_H_
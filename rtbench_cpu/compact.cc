@@ -0,0 +1,68 @@
+#include "compact.h"
+
+#include <assert.h>
+
+#include "common/arena.h"
+#include "common/tiles.h"
+
+namespace compact {
+
+bool Render(const distributed::RenderFunction& render,
+            const std::vector<Sphere>& spheres,
+            const std::vector<Box>& boxes,
+            const std::vector<Light>& lights,
+            const Camera& camera,
+            const pixel_format::Image& background,
+            pixel_format::Image& image,
+            int version, fast_math::Accuracy accuracy,
+            const light_batch::Settings& light_settings) {
+  assert(background.w() == image.w() && background.h() == image.h());
+  const int w = image.w();
+  const int h = image.h();
+  const int tile_count = tiles::GetTileCount(w, h);
+
+  // One tile per thread at a time, see numa::Configure.
+  int failures = 0;
+  #pragma omp parallel reduction(+: failures)
+  {
+    Framebuffer pixels;
+    #pragma omp for schedule(dynamic)
+    for (int id = 0; id < tile_count; ++id) {
+      const tiles::Tile tile = tiles::GetTile(id, w, h);
+      Camera tile_camera(camera.position(), camera.target(),
+                         camera.world_up(), camera.fov());
+      tile_camera.SetCrop(tile.x0, tile.y0, w, h);
+
+      pixels.resize(static_cast<size_t>(tile.w) * tile.h);
+      for (int i = 0; i < tile.h; ++i) {
+        background.Load(tile.x0, tile.y0 + i, tile.w,
+                        pixels.data() + i * tile.w);
+      }
+      if (!render(spheres, boxes, lights, tile_camera, pixels, tile.w,
+                  tile.h, version, accuracy, light_settings)) {
+        ++failures;
+      }
+      for (int i = 0; i < tile.h; ++i) {
+        image.Store(pixels.data() + i * tile.w, tile.x0, tile.y0 + i,
+                    tile.w);
+      }
+    }
+  }
+  return failures == 0;
+}
+
+void Copy(const pixel_format::Image& background, pixel_format::Image& image) {
+  assert(background.w() == image.w() && background.h() == image.h());
+  #pragma omp parallel
+  {
+    arena::Scope scope;
+    arena::Buffer<Vector> row(image.w());
+    #pragma omp for
+    for (int i = 0; i < image.h(); ++i) {
+      background.Load(0, i, image.w(), row.data());
+      image.Store(row.data(), 0, i, image.w());
+    }
+  }
+}
+
+} // namespace compact
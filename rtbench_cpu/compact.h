@@ -0,0 +1,37 @@
+#ifndef RTBENCH_COMPACT_H_
+#define RTBENCH_COMPACT_H_
+
+#include <vector>
+
+#include "common/box.h"
+#include "common/camera.h"
+#include "common/fast_math.h"
+#include "common/light.h"
+#include "common/light_batch.h"
+#include "common/pixel_format.h"
+#include "common/sphere.h"
+#include "distributed.h"
+
+// Rendering into compact framebuffers. Every thread unpacks the background
+// of one tile into a cache resident Framebuffer, renders the tile there and
+// packs the result into the image, so only compact pixels go to memory.
+namespace compact {
+
+// Background and image must have the same size, formats may differ.
+bool Render(const distributed::RenderFunction& render,
+            const std::vector<Sphere>& spheres,
+            const std::vector<Box>& boxes,
+            const std::vector<Light>& lights,
+            const Camera& camera,
+            const pixel_format::Image& background,
+            pixel_format::Image& image,
+            int version, fast_math::Accuracy accuracy,
+            const light_batch::Settings& light_settings);
+
+// Converts the background into the image with no shading in between: the
+// memory traffic of one frame on its own.
+void Copy(const pixel_format::Image& background, pixel_format::Image& image);
+
+} // namespace compact
+
+#endif // RTBENCH_COMPACT_H_
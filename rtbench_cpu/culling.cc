@@ -0,0 +1,178 @@
+#include "culling.h"
+
+#include <mutex>
+
+#include <math.h>
+
+#include "common/arena.h"
+
+namespace culling {
+
+Bounds GetBounds(const std::vector<Sphere>& spheres,
+                 const std::vector<Box>& boxes) {
+  float min[3] = { std::numeric_limits<float>::max(),
+                   std::numeric_limits<float>::max(),
+                   std::numeric_limits<float>::max() };
+  float max[3] = { -std::numeric_limits<float>::max(),
+                   -std::numeric_limits<float>::max(),
+                   -std::numeric_limits<float>::max() };
+  for (size_t i = 0; i < boxes.size(); ++i) {
+    for (int k = 0; k < 3; ++k) {
+      min[k] = std::min(min[k], boxes[i].min().data()[k]);
+      max[k] = std::max(max[k], boxes[i].max().data()[k]);
+    }
+  }
+  for (size_t i = 0; i < spheres.size(); ++i) {
+    Vector center = spheres[i].center();
+    for (int k = 0; k < 3; ++k) {
+      min[k] = std::min(min[k], center.data()[k] - spheres[i].radius());
+      max[k] = std::max(max[k], center.data()[k] + spheres[i].radius());
+    }
+  }
+  for (int k = 0; k < 3; ++k) {
+    min[k] -= 1e-3f + 1e-5f * fabsf(min[k]);
+    max[k] += 1e-3f + 1e-5f * fabsf(max[k]);
+  }
+
+  Bounds bounds;
+  bounds.min = Vector(min[0], min[1], min[2]);
+  bounds.max = Vector(max[0], max[1], max[2]);
+  return bounds;
+}
+
+// Candidate lists of a w x h render of the camera.
+static std::shared_ptr<const TileLists> BuildLists(
+    const std::vector<Sphere>& spheres, const Camera& camera, int w, int h) {
+  std::shared_ptr<TileLists> lists = std::make_shared<TileLists>();
+  lists->tiles_x = (w + kTileSize - 1) / kTileSize;
+  lists->tiles_y = (h + kTileSize - 1) / kTileSize;
+  const int tile_count = lists->tiles_x * lists->tiles_y;
+
+  // Tile ranges of the screen rectangles, then counts, offsets and the
+  // lists themselves.
+  const int count = static_cast<int>(spheres.size());
+  arena::Scope scope;
+  arena::Buffer<ScreenRect> rects(count);
+  #pragma omp parallel for
+  for (int i = 0; i < count; ++i) {
+    ScreenRect rect = camera.ProjectSphere(spheres[i].center(),
+                                           spheres[i].radius(), w, h);
+    if (rect.x0 >= rect.x1 || rect.y0 >= rect.y1) {
+      rects[i] = { 0, 0, 0, 0 };
+      continue;
+    }
+    rects[i].x0 = rect.x0 / kTileSize;
+    rects[i].y0 = rect.y0 / kTileSize;
+    rects[i].x1 = (rect.x1 - 1) / kTileSize + 1;
+    rects[i].y1 = (rect.y1 - 1) / kTileSize + 1;
+  }
+
+  lists->first.assign(tile_count + 1, 0);
+  for (int i = 0; i < count; ++i) {
+    for (int ty = rects[i].y0; ty < rects[i].y1; ++ty) {
+      for (int tx = rects[i].x0; tx < rects[i].x1; ++tx) {
+        ++lists->first[ty * lists->tiles_x + tx + 1];
+      }
+    }
+  }
+  for (int t = 0; t < tile_count; ++t) {
+    lists->first[t + 1] += lists->first[t];
+  }
+
+  lists->candidates.resize(lists->first[tile_count]);
+  arena::Buffer<int> next(lists->first.begin(), lists->first.end() - 1);
+  for (int i = 0; i < count; ++i) {
+    for (int ty = rects[i].y0; ty < rects[i].y1; ++ty) {
+      for (int tx = rects[i].x0; tx < rects[i].x1; ++tx) {
+        lists->candidates[next[ty * lists->tiles_x + tx]++] = i;
+      }
+    }
+  }
+  return lists;
+}
+
+static bool Equal(const Vector& a, const Vector& b) {
+  return a.x() == b.x() && a.y() == b.y() && a.z() == b.z();
+}
+
+// The lists last built for a whole image, with what they depend on: the
+// camera parameters, the image size and every sphere's center and radius.
+struct Cache {
+  std::mutex mutex;
+  Camera camera;
+  int w = 0;
+  int h = 0;
+  std::vector<float> spheres;
+  std::shared_ptr<const TileLists> lists;
+
+  bool Matches(const std::vector<Sphere>& scene, const Camera& view,
+               int view_w, int view_h) const {
+    if (!lists || view_w != w || view_h != h ||
+        !Equal(view.position(), camera.position()) ||
+        !Equal(view.target(), camera.target()) ||
+        !Equal(view.world_up(), camera.world_up()) ||
+        view.fov() != camera.fov() || 4 * scene.size() != spheres.size()) {
+      return false;
+    }
+    for (size_t i = 0; i < scene.size(); ++i) {
+      const Vector center = scene[i].center();
+      if (center.x() != spheres[4 * i] || center.y() != spheres[4 * i + 1] ||
+          center.z() != spheres[4 * i + 2] ||
+          scene[i].radius() != spheres[4 * i + 3]) {
+        return false;
+      }
+    }
+    return true;
+  }
+};
+
+Precomputed Precompute(const std::vector<Sphere>& spheres,
+                       const std::vector<Box>& boxes,
+                       const Camera& camera, int w, int h) {
+  Precomputed scene;
+  scene.bounds = GetBounds(spheres, boxes);
+  scene.tiles_x = (w + kTileSize - 1) / kTileSize;
+  scene.tiles_y = (h + kTileSize - 1) / kTileSize;
+
+  // A crop starting on a tile is a window of the whole image's lists,
+  // others get lists of their own.
+  int full_w = w, full_h = h;
+  if (camera.crop_w() > 0) {
+    if (camera.crop_x0() % kTileSize != 0 ||
+        camera.crop_y0() % kTileSize != 0) {
+      scene.lists = BuildLists(spheres, camera, w, h);
+      return scene;
+    }
+    full_w = camera.crop_w();
+    full_h = camera.crop_h();
+    scene.tile_x0 = camera.crop_x0() / kTileSize;
+    scene.tile_y0 = camera.crop_y0() / kTileSize;
+  }
+  const Camera full(camera.position(), camera.target(), camera.world_up(),
+                    camera.fov());
+  if (!camera.cache_rays()) {
+    scene.lists = BuildLists(spheres, full, full_w, full_h);
+    return scene;
+  }
+
+  static Cache cache;
+  std::lock_guard<std::mutex> lock(cache.mutex);
+  if (!cache.Matches(spheres, full, full_w, full_h)) {
+    cache.lists = BuildLists(spheres, full, full_w, full_h);
+    cache.camera = full;
+    cache.w = full_w;
+    cache.h = full_h;
+    cache.spheres.resize(4 * spheres.size());
+    for (size_t i = 0; i < spheres.size(); ++i) {
+      const Vector center = spheres[i].center();
+      cache.spheres[4 * i] = center.x();
+      cache.spheres[4 * i + 1] = center.y();
+      cache.spheres[4 * i + 2] = center.z();
+      cache.spheres[4 * i + 3] = spheres[i].radius();
+    }
+  }
+  scene.lists = cache.lists;
+  return scene;
+}
+
+} // namespace culling
@@ -0,0 +1,116 @@
+#ifndef RTBENCH_CULLING_H_
+#define RTBENCH_CULLING_H_
+
+#include <algorithm>
+#include <limits>
+#include <memory>
+#include <vector>
+
+#include <immintrin.h>
+
+#include "common/box.h"
+#include "common/camera.h"
+#include "common/sphere.h"
+#include "common/vector.h"
+
+// Scene data precomputed for early ray rejection: the world bounds, which
+// no ray missing them can hit anything inside, and for every tile of the
+// image the spheres whose screen rectangle overlaps it, which are the only
+// ones its primary rays have to test. It is kept while neither the view nor
+// the scene change, and crops of the image share it.
+namespace culling {
+
+const int kTileSize = 32;
+
+struct Bounds {
+  Vector min;
+  Vector max;
+};
+
+// Candidate spheres of every tile of a whole image.
+struct TileLists {
+  int tiles_x = 0;
+  int tiles_y = 0;
+  // Tile t holds candidates[first[t]] to candidates[first[t + 1]], in scene
+  // order so that ties between spheres resolve as in the full loop.
+  std::vector<int> first;
+  std::vector<int> candidates;
+};
+
+// Culling data of one render. Tiles are numbered over the render, which
+// is a window at tile (tile_x0, tile_y0) of the image the lists cover.
+struct Precomputed {
+  Bounds bounds;
+  int tiles_x = 0;
+  int tiles_y = 0;
+  int tile_x0 = 0;
+  int tile_y0 = 0;
+  std::shared_ptr<const TileLists> lists;
+
+  int GetTile(int i, int j) const {
+    return i / kTileSize * tiles_x + j / kTileSize;
+  }
+
+  // Tile of the lists that tile of the render lies in.
+  int GetListTile(int tile) const {
+    return (tile / tiles_x + tile_y0) * lists->tiles_x + tile % tiles_x +
+      tile_x0;
+  }
+
+  const int* begin(int tile) const {
+    return lists->candidates.data() + lists->first[GetListTile(tile)];
+  }
+
+  const int* end(int tile) const {
+    return lists->candidates.data() + lists->first[GetListTile(tile) + 1];
+  }
+};
+
+// Bounds of every sphere and box, padded so that the slab test never
+// rejects a ray that the primitive tests would hit.
+Bounds GetBounds(const std::vector<Sphere>& spheres,
+                 const std::vector<Box>& boxes);
+
+// Reuses the tile lists of the last call while the camera parameters, the
+// image size and the spheres are the same, unless the camera does not cache
+// its rays. A crop aligned to tiles uses the lists of the whole image.
+// Thread-safe; the scratch arena of the calling thread holds temporaries.
+Precomputed Precompute(const std::vector<Sphere>& spheres,
+                       const std::vector<Box>& boxes,
+                       const Camera& camera, int w, int h);
+
+// False only when the ray certainly misses the bounds.
+inline bool Hits(const Bounds& bounds, const Vector& orig,
+                 const Vector& dir) {
+  float t_near = -std::numeric_limits<float>::max();
+  float t_far = std::numeric_limits<float>::max();
+  for (int k = 0; k < 3; ++k) {
+    float ta = (bounds.min.data()[k] - orig.data()[k]) / dir.data()[k];
+    float tb = (bounds.max.data()[k] - orig.data()[k]) / dir.data()[k];
+    t_near = std::max(t_near, std::min(ta, tb));
+    t_far = std::min(t_far, std::max(ta, tb));
+  }
+  return t_near <= t_far && t_far >= 0.0f;
+}
+
+// Lanes of four rays from one origin that may hit the bounds.
+inline __m128 Hits(const Bounds& bounds, const Vector& orig,
+                   const __m128& vdx, const __m128& vdy, const __m128& vdz) {
+  const __m128 vdirs[3] = { vdx, vdy, vdz };
+  __m128 vnear = _mm_set_ps1(-std::numeric_limits<float>::max());
+  __m128 vfar = _mm_set_ps1(std::numeric_limits<float>::max());
+  for (int k = 0; k < 3; ++k) {
+    __m128 vta = _mm_div_ps(
+      _mm_set_ps1(bounds.min.data()[k] - orig.data()[k]), vdirs[k]);
+    __m128 vtb = _mm_div_ps(
+      _mm_set_ps1(bounds.max.data()[k] - orig.data()[k]), vdirs[k]);
+    vnear = _mm_max_ps(vnear, _mm_min_ps(vta, vtb));
+    vfar = _mm_min_ps(vfar, _mm_max_ps(vta, vtb));
+  }
+  return _mm_and_ps(_mm_cmple_ps(vnear, vfar),
+                    _mm_cmpge_ps(vfar, _mm_setzero_ps()));
+}
+
+} // namespace culling
+
+#endif // RTBENCH_CULLING_H_
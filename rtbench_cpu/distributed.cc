@@ -0,0 +1,538 @@
+#include "distributed.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+namespace distributed {
+
+namespace {
+
+const size_t kTilesInFlight = 2;
+const int kConnectAttempts = 100;
+const int kConnectRetryMs = 100;
+// Layout of the scene message. Bump it whenever SceneHeader or the data
+// structs after it change, so that a worker built from other sources drops
+// the connection instead of misreading the scene.
+const uint32_t kSceneFormat = 3;
+
+enum MessageType : uint32_t {
+  kHello = 0x52544231,
+  kScene,
+  kTile,
+  kPixels,
+  kShutdown
+};
+
+struct MessageHeader {
+  uint32_t type;
+  uint32_t size;
+};
+
+struct SceneHeader {
+  uint32_t format;
+  int32_t w;
+  int32_t h;
+  int32_t version;
+  int32_t accuracy;
+  int32_t light_mode;
+  int32_t shadow_rays;
+  int32_t sphere_count;
+  int32_t box_count;
+  int32_t light_count;
+  int32_t cache_rays;
+  float position[3];
+  float target[3];
+  float up[3];
+  float fov;
+};
+
+struct SphereData {
+  float center[3];
+  float radius;
+  float refractive_index;
+  float albedo[4];
+  float diffuse_color[3];
+  float specular_exponent;
+};
+
+struct BoxData {
+  float min[3];
+  float max[3];
+  float refractive_index;
+  float albedo[4];
+  float diffuse_color[3];
+  float specular_exponent;
+  int32_t texture;
+  float checker_color[3];
+};
+
+struct LightData {
+  float position[3];
+  float intensity;
+};
+
+void StoreVector(const Vector& v, float* out, int size) {
+  memcpy(out, v.data(), size * sizeof(float));
+}
+
+Vector LoadVector(const float* v) {
+  return Vector(v[0], v[1], v[2]);
+}
+
+template <typename T>
+void Append(std::vector<char>& buffer, const T* data, size_t count) {
+  const char* bytes = reinterpret_cast<const char*>(data);
+  buffer.insert(buffer.end(), bytes, bytes + count * sizeof(T));
+}
+
+template <typename T>
+bool Extract(const std::vector<char>& buffer, size_t& offset,
+             T* data, size_t count) {
+  size_t size = count * sizeof(T);
+  if (offset + size > buffer.size()) {
+    return false;
+  }
+  memcpy(static_cast<void*>(data), buffer.data() + offset, size);
+  offset += size;
+  return true;
+}
+
+bool SendMessage(net::Socket& socket, MessageType type,
+                 const std::vector<char>& payload) {
+  MessageHeader header = { type, static_cast<uint32_t>(payload.size()) };
+  return socket.SendAll(&header, sizeof(header)) &&
+    (payload.empty() || socket.SendAll(payload.data(), payload.size()));
+}
+
+bool ReceiveMessage(net::Socket& socket, MessageHeader& header,
+                    std::vector<char>& payload) {
+  if (!socket.RecvAll(&header, sizeof(header))) {
+    return false;
+  }
+  payload.resize(header.size);
+  return header.size == 0 || socket.RecvAll(payload.data(), header.size);
+}
+
+} // namespace
+
+// Scene state resident on both ends of the connection.
+struct SceneState {
+  std::vector<Sphere> spheres;
+  std::vector<Box> boxes;
+  std::vector<Light> lights;
+  Camera camera;
+  std::vector<Vector> background;
+  int w = 0;
+  int h = 0;
+  int version = 0;
+  fast_math::Accuracy accuracy = fast_math::Accuracy::kExact;
+  light_batch::Settings light_settings;
+};
+
+namespace {
+
+std::vector<char> PackScene(const SceneState& scene) {
+  SceneHeader header;
+  header.format = kSceneFormat;
+  header.w = scene.w;
+  header.h = scene.h;
+  header.version = scene.version;
+  header.accuracy = static_cast<int32_t>(scene.accuracy);
+  header.light_mode = static_cast<int32_t>(scene.light_settings.mode);
+  header.shadow_rays = scene.light_settings.shadow_rays;
+  header.sphere_count = static_cast<int32_t>(scene.spheres.size());
+  header.box_count = static_cast<int32_t>(scene.boxes.size());
+  header.light_count = static_cast<int32_t>(scene.lights.size());
+  header.cache_rays = scene.camera.cache_rays() ? 1 : 0;
+  StoreVector(scene.camera.position(), header.position, 3);
+  StoreVector(scene.camera.target(), header.target, 3);
+  StoreVector(scene.camera.world_up(), header.up, 3);
+  header.fov = scene.camera.fov();
+
+  std::vector<char> payload;
+  Append(payload, &header, 1);
+  for (const Sphere& sphere : scene.spheres) {
+    const Material material = sphere.material();
+    SphereData data;
+    StoreVector(sphere.center(), data.center, 3);
+    data.radius = sphere.radius();
+    data.refractive_index = material.refractive_index();
+    StoreVector(material.albedo(), data.albedo, 4);
+    StoreVector(material.diffuse_color(), data.diffuse_color, 3);
+    data.specular_exponent = material.specular_exponent();
+    Append(payload, &data, 1);
+  }
+  for (const Box& box : scene.boxes) {
+    const Material material = box.material();
+    BoxData data;
+    StoreVector(box.min(), data.min, 3);
+    StoreVector(box.max(), data.max, 3);
+    data.refractive_index = material.refractive_index();
+    StoreVector(material.albedo(), data.albedo, 4);
+    StoreVector(material.diffuse_color(), data.diffuse_color, 3);
+    data.specular_exponent = material.specular_exponent();
+    data.texture = static_cast<int32_t>(box.texture());
+    StoreVector(box.checker_color(), data.checker_color, 3);
+    Append(payload, &data, 1);
+  }
+  for (const Light& light : scene.lights) {
+    LightData data;
+    StoreVector(light.position(), data.position, 3);
+    data.intensity = light.intensity();
+    Append(payload, &data, 1);
+  }
+  Append(payload, scene.background.data(), scene.background.size());
+  return payload;
+}
+
+// Versions from version_count on are rejected, like by the server.
+bool UnpackScene(const std::vector<char>& payload, int version_count,
+                 SceneState& scene) {
+  size_t offset = 0;
+  SceneHeader header;
+  if (!Extract(payload, offset, &header, 1) ||
+      header.format != kSceneFormat || header.w <= 0 ||
+      header.h <= 0 || header.version < 0 ||
+      header.version >= version_count ||
+      header.accuracy < static_cast<int32_t>(fast_math::Accuracy::kExact) ||
+      header.accuracy > static_cast<int32_t>(fast_math::Accuracy::kFastest) ||
+      header.sphere_count < 0 || header.box_count < 0 ||
+      header.light_count < 0 ||
+      header.light_mode < static_cast<int32_t>(light_batch::Mode::kAll) ||
+      header.light_mode > static_cast<int32_t>(light_batch::Mode::kSampled) ||
+      header.shadow_rays < 1 ||
+      header.shadow_rays > light_batch::kMaxShadowRays) {
+    return false;
+  }
+
+  scene.spheres.clear();
+  for (int i = 0; i < header.sphere_count; ++i) {
+    SphereData data;
+    if (!Extract(payload, offset, &data, 1)) {
+      return false;
+    }
+    Material material(data.refractive_index,
+                      Vector(data.albedo[0], data.albedo[1],
+                             data.albedo[2], data.albedo[3]),
+                      LoadVector(data.diffuse_color),
+                      data.specular_exponent);
+    scene.spheres.push_back(
+      Sphere(LoadVector(data.center), data.radius, material));
+  }
+
+  scene.boxes.clear();
+  for (int i = 0; i < header.box_count; ++i) {
+    BoxData data;
+    if (!Extract(payload, offset, &data, 1)) {
+      return false;
+    }
+    Material material(data.refractive_index,
+                      Vector(data.albedo[0], data.albedo[1],
+                             data.albedo[2], data.albedo[3]),
+                      LoadVector(data.diffuse_color),
+                      data.specular_exponent);
+    if (data.texture == static_cast<int32_t>(Texture::kCheckerboard)) {
+      scene.boxes.push_back(Box(LoadVector(data.min), LoadVector(data.max),
+                                material, LoadVector(data.checker_color)));
+    } else {
+      scene.boxes.push_back(Box(LoadVector(data.min), LoadVector(data.max),
+                                material));
+    }
+  }
+
+  scene.lights.clear();
+  for (int i = 0; i < header.light_count; ++i) {
+    LightData data;
+    if (!Extract(payload, offset, &data, 1)) {
+      return false;
+    }
+    scene.lights.push_back(Light(LoadVector(data.position), data.intensity));
+  }
+
+  scene.background.resize(static_cast<size_t>(header.w) * header.h);
+  if (!Extract(payload, offset, scene.background.data(),
+               scene.background.size())) {
+    return false;
+  }
+
+  scene.camera = Camera(LoadVector(header.position), LoadVector(header.target),
+                        LoadVector(header.up), header.fov);
+  scene.camera.SetCacheRays(header.cache_rays != 0);
+  scene.w = header.w;
+  scene.h = header.h;
+  scene.version = header.version;
+  scene.accuracy = static_cast<fast_math::Accuracy>(header.accuracy);
+  scene.light_settings.mode = static_cast<light_batch::Mode>(header.light_mode);
+  scene.light_settings.shadow_rays = header.shadow_rays;
+  return true;
+}
+
+// Renders one tile through a cropped camera over its background window.
+bool RenderTile(const RenderFunction& render, SceneState& scene,
+                const tiles::Tile& tile, Framebuffer& pixels) {
+  tiles::Extract(scene.background, scene.w, tile, pixels);
+  scene.camera.SetCrop(tile.x0, tile.y0, scene.w, scene.h);
+  bool succeed = render(scene.spheres, scene.boxes, scene.lights,
+                        scene.camera, pixels, tile.w, tile.h, scene.version,
+                        scene.accuracy, scene.light_settings);
+  scene.camera.ClearCrop();
+  return succeed;
+}
+
+} // namespace
+
+Coordinator::Coordinator(RenderFunction render)
+    : render_(render), local_tiles_(0), scene_(new SceneState()) {}
+
+Coordinator::~Coordinator() {
+  Shutdown();
+}
+
+bool Coordinator::Start(int port, int worker_count, int timeout_ms) {
+  if (!net::Initialize() || !listener_.Listen(port, worker_count)) {
+    return false;
+  }
+
+  auto deadline = std::chrono::steady_clock::now() +
+    std::chrono::milliseconds(timeout_ms);
+  while (static_cast<int>(workers_.size()) < worker_count) {
+    auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+      deadline - std::chrono::steady_clock::now()).count();
+    if (left <= 0 ||
+        net::WaitReadable({ &listener_ }, static_cast<int>(left)).empty()) {
+      break;
+    }
+
+    Worker worker;
+    worker.socket = listener_.Accept();
+    MessageHeader header;
+    if (worker.socket.valid() && worker.socket.SetTimeout(timeout_ms) &&
+        worker.socket.RecvAll(&header, sizeof(header)) &&
+        header.type == kHello && header.size == 0) {
+      workers_.push_back(std::move(worker));
+    }
+  }
+
+  stats_.assign(workers_.size(), WorkerStats());
+  return !workers_.empty();
+}
+
+void Coordinator::SendScene(const std::vector<Sphere>& spheres,
+                            const std::vector<Box>& boxes,
+                            const std::vector<Light>& lights,
+                            const Camera& camera,
+                            const std::vector<Vector>& background,
+                            int w, int h, int version,
+                            fast_math::Accuracy accuracy,
+                            const light_batch::Settings& light_settings) {
+  assert(background.size() == w * h);
+  scene_->spheres = spheres;
+  scene_->boxes = boxes;
+  scene_->lights = lights;
+  scene_->camera = camera;
+  scene_->background = background;
+  scene_->w = w;
+  scene_->h = h;
+  scene_->version = version;
+  scene_->accuracy = accuracy;
+  scene_->light_settings = light_settings;
+
+  const std::vector<char> payload = PackScene(*scene_);
+  std::deque<int> queue;
+  for (size_t k = 0; k < workers_.size(); ++k) {
+    if (!stats_[k].failed &&
+        !SendMessage(workers_[k].socket, kScene, payload)) {
+      Fail(k, queue);
+    }
+  }
+}
+
+void Coordinator::RenderFrame(Framebuffer& image, int timeout_ms) {
+  assert(image.size() == scene_->w * scene_->h);
+  std::deque<int> queue;
+  for (int id = 0; id < tiles::GetTileCount(scene_->w, scene_->h); ++id) {
+    queue.push_back(id);
+  }
+
+  const auto timeout = std::chrono::milliseconds(timeout_ms);
+  for (;;) {
+    // Workers pull tiles as they return results, so faster workers end up
+    // with more of the frame. A second tile in flight hides the round trip.
+    for (size_t k = 0; k < workers_.size(); ++k) {
+      while (!stats_[k].failed && !queue.empty() &&
+             workers_[k].in_flight.size() < kTilesInFlight) {
+        tiles::Tile tile =
+          tiles::GetTile(queue.front(), scene_->w, scene_->h);
+        queue.pop_front();
+        if (workers_[k].in_flight.empty()) {
+          workers_[k].deadline = std::chrono::steady_clock::now() + timeout;
+        }
+        workers_[k].in_flight.push_back(tile.id);
+
+        std::vector<char> payload;
+        Append(payload, &tile, 1);
+        if (!SendMessage(workers_[k].socket, kTile, payload)) {
+          Fail(k, queue);
+        }
+      }
+    }
+
+    std::vector<net::Socket*> sockets;
+    std::vector<size_t> owners;
+    for (size_t k = 0; k < workers_.size(); ++k) {
+      if (!workers_[k].in_flight.empty()) {
+        sockets.push_back(&workers_[k].socket);
+        owners.push_back(k);
+      }
+    }
+    if (sockets.empty()) {
+      break;
+    }
+
+    // A busy neighbour keeps select() returning, so hung workers are found
+    // by their own deadline rather than by a global timeout. Only workers
+    // with nothing to read are checked, before receiving can take time.
+    std::vector<size_t> readable = net::WaitReadable(sockets, timeout_ms);
+    std::vector<bool> answered(owners.size(), false);
+    for (size_t r : readable) {
+      answered[r] = true;
+    }
+    auto now = std::chrono::steady_clock::now();
+    for (size_t r = 0; r < owners.size(); ++r) {
+      if (!answered[r] && now > workers_[owners[r]].deadline) {
+        Fail(owners[r], queue);
+      }
+    }
+
+    for (size_t r : readable) {
+      if (!Receive(owners[r], image, timeout_ms)) {
+        Fail(owners[r], queue);
+      }
+    }
+  }
+
+  // Whatever is left had no worker to go to.
+  Framebuffer pixels;
+  for (int id : queue) {
+    tiles::Tile tile = tiles::GetTile(id, scene_->w, scene_->h);
+    bool succeed = RenderTile(render_, *scene_, tile, pixels);
+    assert(succeed);
+    tiles::Store(pixels.data(), tile, image, scene_->w);
+    ++local_tiles_;
+  }
+}
+
+void Coordinator::Shutdown() {
+  for (Worker& worker : workers_) {
+    if (worker.socket.valid()) {
+      SendMessage(worker.socket, kShutdown, std::vector<char>());
+      worker.socket.Close();
+    }
+  }
+  listener_.Close();
+}
+
+void Coordinator::Fail(size_t worker, std::deque<int>& queue) {
+  stats_[worker].failed = true;
+  stats_[worker].requeued_tiles +=
+    static_cast<int>(workers_[worker].in_flight.size());
+  queue.insert(queue.begin(), workers_[worker].in_flight.begin(),
+               workers_[worker].in_flight.end());
+  workers_[worker].in_flight.clear();
+  workers_[worker].socket.Close();
+}
+
+bool Coordinator::Receive(size_t worker, Framebuffer& image,
+                          int timeout_ms) {
+  MessageHeader header;
+  std::vector<char> payload;
+  if (!ReceiveMessage(workers_[worker].socket, header, payload) ||
+      header.type != kPixels) {
+    return false;
+  }
+
+  size_t offset = 0;
+  tiles::Tile tile;
+  if (!Extract(payload, offset, &tile, 1) ||
+      !tiles::IsValid(tile, scene_->w, scene_->h)) {
+    return false;
+  }
+
+  std::deque<int>& in_flight = workers_[worker].in_flight;
+  auto it = std::find(in_flight.begin(), in_flight.end(), tile.id);
+  if (it == in_flight.end()) {
+    return false;
+  }
+
+  std::vector<Vector> pixels(static_cast<size_t>(tile.w) * tile.h);
+  if (!Extract(payload, offset, pixels.data(), pixels.size())) {
+    return false;
+  }
+  tiles::Store(pixels.data(), tile, image, scene_->w);
+
+  in_flight.erase(it);
+  workers_[worker].deadline = std::chrono::steady_clock::now() +
+    std::chrono::milliseconds(timeout_ms);
+  ++stats_[worker].tiles;
+  return true;
+}
+
+bool RunWorker(const char* host, int port, int version_count,
+               RenderFunction render) {
+  if (!net::Initialize()) {
+    return false;
+  }
+
+  net::Socket socket;
+  for (int attempt = 1; !socket.Connect(host, port); ++attempt) {
+    if (attempt == kConnectAttempts) {
+      return false;
+    }
+    std::this_thread::sleep_for(
+      std::chrono::milliseconds(kConnectRetryMs));
+  }
+  if (!SendMessage(socket, kHello, std::vector<char>())) {
+    return false;
+  }
+
+  SceneState scene;
+  bool has_scene = false;
+  MessageHeader header;
+  std::vector<char> payload;
+  Framebuffer pixels;
+  while (ReceiveMessage(socket, header, payload)) {
+    if (header.type == kShutdown) {
+      return true;
+    } else if (header.type == kScene) {
+      has_scene = UnpackScene(payload, version_count, scene);
+      if (!has_scene) {
+        return false;
+      }
+    } else if (header.type == kTile && has_scene) {
+      size_t offset = 0;
+      tiles::Tile tile;
+      if (!Extract(payload, offset, &tile, 1) ||
+          !tiles::IsValid(tile, scene.w, scene.h) ||
+          !RenderTile(render, scene, tile, pixels)) {
+        return false;
+      }
+
+      std::vector<char> result;
+      Append(result, &tile, 1);
+      Append(result, pixels.data(), pixels.size());
+      if (!SendMessage(socket, kPixels, result)) {
+        return false;
+      }
+    } else {
+      return false;
+    }
+  }
+  return false;
+}
+
+} // namespace distributed
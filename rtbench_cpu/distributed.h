@@ -0,0 +1,107 @@
+#ifndef RTBENCH_DISTRIBUTED_H_
+#define RTBENCH_DISTRIBUTED_H_
+
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "common/box.h"
+#include "common/camera.h"
+#include "common/fast_math.h"
+#include "common/framebuffer.h"
+#include "common/light.h"
+#include "common/light_batch.h"
+#include "common/socket.h"
+#include "common/sphere.h"
+#include "common/tiles.h"
+
+// Splits frames into tiles rendered by worker processes connected over TCP.
+// The coordinator sends the scene once, then hands out tiles on demand and
+// assembles the returned pixel blocks. Both ends must share the byte order
+// and float layout, which holds for local workers.
+namespace distributed {
+
+const int kDefaultPort = 5555;
+
+// Renders a full w x h image, or the window selected by the camera crop.
+typedef std::function<bool(const std::vector<Sphere>& spheres,
+                           const std::vector<Box>& boxes,
+                           const std::vector<Light>& lights,
+                           const Camera& camera,
+                           Framebuffer& image,
+                           int w, int h, int version,
+                           fast_math::Accuracy accuracy,
+                           const light_batch::Settings& light_settings)>
+  RenderFunction;
+
+struct SceneState;
+
+struct WorkerStats {
+  int tiles = 0;
+  int requeued_tiles = 0;
+  bool failed = false;
+};
+
+class Coordinator {
+ public:
+  // The render function draws tiles locally once all workers are lost.
+  explicit Coordinator(RenderFunction render);
+  ~Coordinator();
+
+  // Waits until worker_count workers connect or timeout_ms passes and
+  // returns whether at least one worker is available.
+  bool Start(int port, int worker_count, int timeout_ms);
+
+  // Sends the scene to every worker; the background is the initial image.
+  void SendScene(const std::vector<Sphere>& spheres,
+                 const std::vector<Box>& boxes,
+                 const std::vector<Light>& lights,
+                 const Camera& camera,
+                 const std::vector<Vector>& background,
+                 int w, int h, int version,
+                 fast_math::Accuracy accuracy,
+                 const light_batch::Settings& light_settings);
+
+  // A worker that does not answer within the timeout is dropped and its
+  // tiles go back to the queue.
+  void RenderFrame(Framebuffer& image, int timeout_ms);
+
+  void Shutdown();
+
+  const std::vector<WorkerStats>& worker_stats() const {
+    return stats_;
+  }
+
+  int local_tiles() const {
+    return local_tiles_;
+  }
+
+ private:
+  struct Worker {
+    net::Socket socket;
+    std::deque<int> in_flight;
+    std::chrono::steady_clock::time_point deadline;
+  };
+
+  void Fail(size_t worker, std::deque<int>& queue);
+  bool Receive(size_t worker, Framebuffer& image, int timeout_ms);
+
+  RenderFunction render_;
+  net::Socket listener_;
+  std::vector<Worker> workers_;
+  std::vector<WorkerStats> stats_;
+  int local_tiles_;
+  std::unique_ptr<SceneState> scene_;
+};
+
+// Connects to the coordinator, retrying until it listens, and serves tiles
+// until it is told to shut down or the connection drops. Scenes for a
+// version from version_count on or an unknown accuracy end the connection.
+bool RunWorker(const char* host, int port, int version_count,
+               RenderFunction render);
+
+} // namespace distributed
+
+#endif // RTBENCH_DISTRIBUTED_H_
@@ -1,19 +1,51 @@
 #include <assert.h>
 #include <intrin.h>
+#define _USE_MATH_DEFINES
+#include <math.h>
 #include <memory.h>
+#include <omp.h>
 
 #include <chrono>
 #include <iomanip>
 #include <iostream>
+#include <string>
+#include <thread>
 #include <vector>
 
+#include "common/arena.h"
+#include "common/camera.h"
 #include "common/image.h"
+#include "common/isa.h"
+#include "common/light_batch.h"
+#include "common/numa.h"
+#include "common/pixel_format.h"
 #include "common/scene.h"
+#include "common/validation.h"
+#include "compact.h"
+#include "distributed.h"
+#include "render_baked.h"
 #include "render_baseline.h"
+#include "render_interleaved.h"
+#include "render_scalar_avx2.h"
 #include "render_sequential.h"
 #include "render_sse.h"
+#include "render_sse_fast.h"
+#include "render_wavefront.h"
+#include "server.h"
 
 const unsigned kFrameCount = 10;
+const int kWorkerTimeoutMs = 10000;
+const unsigned kBandwidthFrames = 5;
+const unsigned kInterleaveFrames = 3;
+const int kSuiteResolutions[6][2] = {
+  { 256, 256 }, { 512, 512 }, { 1024, 768 }, { 1920, 1080 }, { 3840, 2160 },
+  { 7680, 4320 }
+};
+const double kSuiteMs = 1000.0;
+// Every version at every accuracy: against Baseline's float output Fast
+// Math stays within 0.1/255 on the default view and seven -c views, the
+// rest of the budget is the 8-bit rounding of reference.png.
+const validation::Thresholds kThresholds = { 2.0f / 255.0f, 40.0, 0.99 };
 
 static inline std::string GetHostCPU() {
   int cpu_info[4] = { 0 };
@@ -36,42 +68,661 @@ static inline std::string GetHostCPU() {
 }
 
 inline std::vector<std::string> GetVersionList() {
-  return std::vector<std::string>{"Sequential", "Baseline", "SSE"};
+  return std::vector<std::string>{"Sequential", "Baseline", "SSE", "Baked",
+                                  "SSE Fast Math", "Wavefront",
+                                  "Wavefront Binned", "Interleaved"};
 }
 
 inline bool Render(const std::vector<Sphere>& spheres,
+                   const std::vector<Box>& boxes,
                    const std::vector<Light>& lights,
-                   std::vector<Vector>& image,
-                   int w, int h, int version) {
+                   const Camera& camera,
+                   Framebuffer& image,
+                   int w, int h, int version,
+                   fast_math::Accuracy accuracy,
+                   const light_batch::Settings& light_settings,
+                   wavefront::Stats& wavefront_stats) {
   if (version == 0) {
-    sequential::Render(spheres, lights, image, w, h);
+    if (isa::UseAvx2()) {
+      sequential_avx2::Render(spheres, boxes, lights, camera, image, w, h);
+    } else {
+      sequential::Render(spheres, boxes, lights, camera, image, w, h);
+    }
     return true;
   } else if (version == 1) {
-    baseline::Render(spheres, lights, image, w, h);
+    if (isa::UseAvx2()) {
+      baseline_avx2::Render(spheres, boxes, lights, camera, image, w, h);
+    } else {
+      baseline::Render(spheres, boxes, lights, camera, image, w, h);
+    }
     return true;
   } else if (version == 2) {
-    sse::Render(spheres, lights, image, w, h);
+    sse::Render(spheres, boxes, lights, camera, image, w, h);
+    return true;
+  } else if (version == 3) {
+    return baked::Render(spheres, boxes, lights, camera, image, w, h);
+  } else if (version == 4) {
+    return sse_fast::Render(spheres, boxes, lights, camera, image, w, h,
+                            accuracy, light_settings);
+  } else if (version == 5 || version == 6) {
+    wavefront::Render(spheres, boxes, lights, camera, image, w, h,
+                      version == 6, wavefront_stats);
+    return true;
+  } else if (version == 7) {
+    interleaved::Render(spheres, boxes, lights, camera, image, w, h);
     return true;
   }
   return false;
 }
 
+static void PrintQueueStats(const char* name,
+                            const wavefront::QueueStats& stats) {
+  if (stats.rays == 0) {
+    return;
+  }
+  const long long passed = stats.packet_tests - stats.rejected_tests;
+  float utilization = passed == 0 ? 0.0f :
+    100.0f * stats.active_lanes / (4.0f * passed);
+  float rejected = stats.packet_tests == 0 ? 0.0f :
+    100.0f * stats.rejected_tests / stats.packet_tests;
+  float throughput = stats.trace_ms == 0.0 ? 0.0f : static_cast<float>(
+    stats.rays / (stats.trace_ms * 1000.0));
+  std::cout << name << " Rays per Frame: " << stats.rays / kFrameCount <<
+    ", Lane Utilization: " << utilization << "%" <<
+    ", Rejected Packets: " << rejected << "%" <<
+    ", Throughput: " << throughput << " Mrays/s";
+  if (stats.binning_ms > 0.0) {
+    float total = static_cast<float>(
+      stats.rays / ((stats.trace_ms + stats.binning_ms) * 1000.0));
+    std::cout << ", Binning: " << stats.binning_ms / kFrameCount <<
+      " ms per frame (" << total << " Mrays/s including binning)";
+  }
+  std::cout << std::endl;
+}
+
+static void PrintWorkerStats(const distributed::Coordinator& coordinator) {
+  const std::vector<distributed::WorkerStats>& stats =
+    coordinator.worker_stats();
+  for (size_t k = 0; k < stats.size(); ++k) {
+    std::cout << "Worker " << k << ": " << stats[k].tiles / kFrameCount <<
+      " tiles per frame";
+    if (stats[k].failed) {
+      std::cout << ", FAILED (" << stats[k].requeued_tiles <<
+        " tiles requeued)";
+    }
+    std::cout << std::endl;
+  }
+  if (coordinator.local_tiles() > 0) {
+    std::cout << "Coordinator: " << coordinator.local_tiles() <<
+      " tiles rendered locally" << std::endl;
+  }
+}
+
+static void PrintAllocations(const arena::Counters& counters) {
+  std::cout << "Allocations per Frame: " <<
+    counters.allocations / kFrameCount << " arena (" <<
+    counters.bytes / kFrameCount / 1024 << " KB), " <<
+    counters.system_allocations / kFrameCount << " system (" <<
+    counters.system_bytes / kFrameCount / 1024 << " KB)" << std::endl;
+}
+
+// Difference of an image to the one with every light evaluated, on the
+// normalized pixels that go to the PNG output.
+static void PrintLightError(const std::vector<Vector>& image,
+                            const Framebuffer& reference) {
+  double squares = 0.0;
+  float max_error = 0.0f;
+  long long visible = 0;
+  for (size_t i = 0; i < image.size(); ++i) {
+    Vector diff = image::NormalizePixel(image[i]) -
+      image::NormalizePixel(reference[i]);
+    float error = std::max(fabsf(diff.x()),
+                           std::max(fabsf(diff.y()), fabsf(diff.z())));
+    squares += diff.x() * diff.x() + diff.y() * diff.y() + diff.z() * diff.z();
+    max_error = std::max(max_error, error);
+    if (error > 1.0f / 255.0f) {
+      ++visible;
+    }
+  }
+  std::cout << "Error vs All Lights: RMSE " <<
+    sqrt(squares / (3.0 * image.size())) * 255.0 << "/255, max " <<
+    max_error * 255.0f << "/255, " << 100.0 * visible / image.size() <<
+    "% of pixels above 1/255" << std::endl;
+}
+
+// A reference that is missing or has another size fails.
+template <typename Image>
+static bool Validate(const Image& image, int w, int h,
+                     const std::string& reference_image,
+                     const validation::Thresholds& thresholds,
+                     validation::Report& report) {
+  std::vector<Vector> reference;
+  int reference_w = 0, reference_h = 0;
+  if (!image::Load(reference_image.c_str(), reference_w, reference_h,
+                   reference)) {
+    std::cout << "Reference output file was not found: " <<
+      reference_image << "...";
+    return false;
+  }
+  if (reference_w != w || reference_h != h || image.size() != w * h) {
+    return false;
+  }
+  report = validation::Compare(image, reference, w, h);
+  return validation::Passes(report, thresholds);
+}
+
+static void PrintReport(const validation::Report& report,
+                        const validation::Thresholds& thresholds) {
+  const std::streamsize precision = std::cout.precision();
+  std::cout << "Max Error: " << report.max_error * 255.0f << "/255 at (" <<
+    report.max_y << ", " << report.max_x << "), Mean Error: " <<
+    report.mean_error * 255.0 << "/255, PSNR: " << report.psnr <<
+    " dB, SSIM: " << std::setprecision(4) << report.ssim <<
+    std::setprecision(precision) << ", Tiles above " <<
+    thresholds.max_error * 255.0f << "/255: " <<
+    validation::CountTilesAbove(report, thresholds.max_error) << " of " <<
+    report.tile_errors.size() << std::endl;
+}
+
+static void PrintPageAccesses(const void* data, size_t row_size, int rows) {
+  numa::AccessStats stats = numa::CountRowAccesses(data, row_size, rows);
+  std::cout << "Framebuffer Pages: " << stats.local << " local, " <<
+    stats.remote << " remote";
+  if (stats.unknown > 0) {
+    std::cout << ", " << stats.unknown << " unknown";
+  }
+  std::cout << std::endl;
+}
+
+// Renders on the first 1, 2, ... nodes; every step places threads and the
+// framebuffer again for its node count.
+static void RunSocketScaling(const std::vector<Vector>& input,
+                             const Camera& camera, int w, int h,
+                             int version, fast_math::Accuracy accuracy,
+                             const light_batch::Settings& light_settings) {
+  float base_fps = 0.0f;
+  for (int nodes = 1; nodes <= numa::GetSystemNodeCount(); ++nodes) {
+    int thread_count = numa::Configure(nodes);
+    wavefront::Stats wavefront_stats;
+    Scene warm_up(input);
+    Render(warm_up.GetSpheres(), warm_up.GetBoxes(), warm_up.GetLights(),
+           camera, warm_up.GetImage(), w, h, version, accuracy,
+           light_settings, wavefront_stats);
+
+    unsigned wall_time = 0;
+    for (unsigned i = 0; i < kFrameCount; ++i) {
+      warm_up.SetBackground(input);
+      auto start = std::chrono::steady_clock::now();
+      Render(warm_up.GetSpheres(), warm_up.GetBoxes(), warm_up.GetLights(),
+             camera, warm_up.GetImage(), w, h, version, accuracy,
+             light_settings, wavefront_stats);
+      auto end = std::chrono::steady_clock::now();
+      wall_time += static_cast<unsigned>(
+        std::chrono::duration_cast<std::chrono::milliseconds>(
+          end - start).count());
+      arena::ResetAll();
+    }
+
+    float fps = kFrameCount * 1000.0f / std::max(wall_time, 1u);
+    base_fps = nodes == 1 ? fps : base_fps;
+    std::cout << "Sockets: " << nodes << ", Threads: " << thread_count <<
+      ", FPS rate: " << fps << ", Speed-up: " << fps / base_fps << "x, ";
+    PrintPageAccesses(warm_up.GetImage().data(), w * sizeof(Vector), h);
+  }
+}
+
+// The plain one ray at a time traversal (a group of 1) against growing
+// groups of interleaved pixels per thread, on one hierarchy built up front.
+static void RunInterleave(Scene& scene, const std::vector<Vector>& input,
+                          const Camera& camera, int w, int h) {
+  interleaved::Bvh bvh;
+  auto build_start = std::chrono::steady_clock::now();
+  bvh.Build(scene.GetSpheres(), scene.GetBoxes());
+  double build_ms = std::chrono::duration<double, std::milli>(
+    std::chrono::steady_clock::now() - build_start).count();
+  std::cout << "BVH: " << scene.GetSpheres().size() << " spheres, " <<
+    scene.GetBoxes().size() << " boxes, " <<
+    bvh.node_count() << " nodes, " <<
+    bvh.size_in_bytes() / static_cast<double>(1 << 20) << " MB, Build: " <<
+    build_ms << " ms" << std::endl;
+
+  double base_ms = 0.0;
+  for (int group = 1; group <= interleaved::kMaxGroup; group *= 2) {
+    double render_ms = 0.0;
+    for (unsigned f = 0; f < kInterleaveFrames; ++f) {
+      scene.SetBackground(input);
+      auto start = std::chrono::steady_clock::now();
+      interleaved::Render(bvh, scene.GetSpheres(), scene.GetBoxes(),
+                          scene.GetLights(), camera, scene.GetImage(), w, h,
+                          group);
+      render_ms += std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now() - start).count();
+      arena::ResetAll();
+    }
+    render_ms /= kInterleaveFrames;
+    base_ms = group == 1 ? render_ms : base_ms;
+    std::cout << "Group: " << group << (group == 1 ? " (plain loop)" : "") <<
+      ", Render: " << render_ms << " ms (" << base_ms / render_ms << "x)" <<
+      std::endl;
+  }
+}
+
+// Every format at the input resolution, 4K and 8K: a copy pass that only
+// moves the background into the framebuffer, and one rendered frame.
+static void RunBandwidth(const distributed::RenderFunction& render,
+                         const std::vector<Vector>& input,
+                         const Camera& camera, int input_w, int input_h,
+                         int version, fast_math::Accuracy accuracy,
+                         const light_batch::Settings& light_settings,
+                         const std::string& reference_image) {
+  const int kResolutions[3][2] = {
+    { input_w, input_h }, { 3840, 2160 }, { 7680, 4320 }
+  };
+  Scene scene(input);
+  for (int r = 0; r < 3; ++r) {
+    const int w = kResolutions[r][0];
+    const int h = kResolutions[r][1];
+    std::vector<Vector> pixels = image::Resample(input, input_w, input_h,
+                                                 w, h);
+    double base_copy_ms = 0.0, base_render_ms = 0.0;
+    for (int f = 0; f < pixel_format::kFormatCount; ++f) {
+      const pixel_format::Format format =
+        static_cast<pixel_format::Format>(f);
+      if (!pixel_format::IsSupported(format)) {
+        continue;
+      }
+      pixel_format::Image background(format, w, h);
+      pixel_format::FromPixels(pixels, background);
+      pixel_format::Image image(format, w, h);
+      compact::Copy(background, image);
+
+      auto start = std::chrono::steady_clock::now();
+      for (unsigned i = 0; i < kBandwidthFrames; ++i) {
+        compact::Copy(background, image);
+      }
+      auto end = std::chrono::steady_clock::now();
+      double copy_ms = std::chrono::duration<double, std::milli>(
+        end - start).count() / kBandwidthFrames;
+
+      start = std::chrono::steady_clock::now();
+      compact::Render(render, scene.GetSpheres(), scene.GetBoxes(),
+                      scene.GetLights(), camera, background, image, version,
+                      accuracy, light_settings);
+      end = std::chrono::steady_clock::now();
+      double render_ms =
+        std::chrono::duration<double, std::milli>(end - start).count();
+      arena::ResetAll();
+
+      base_copy_ms = f == 0 ? copy_ms : base_copy_ms;
+      base_render_ms = f == 0 ? render_ms : base_render_ms;
+      // Background read and framebuffer write.
+      double traffic_mb = 2.0 * image.size_in_bytes() / (1 << 20);
+      std::cout << w << "x" << h << " " << pixel_format::GetName(format) <<
+        ": " << pixel_format::GetPixelSize(format) << " B/pixel, " <<
+        traffic_mb << " MB per frame, Copy: " << copy_ms << " ms (" <<
+        traffic_mb / copy_ms * 1000.0 / 1024.0 << " GB/s, " <<
+        base_copy_ms / copy_ms <<
+        "x), Render: " << render_ms << " ms (" <<
+        base_render_ms / render_ms << "x)";
+      if (r == 0) {
+        std::cout << ", Checking for results...";
+        pixel_format::ToPixels(image, scene.GetImage());
+        validation::Report report;
+        bool same = Validate(scene.GetImage(), w, h, reference_image,
+                             kThresholds, report);
+        std::cout << (same ? "OK" : "FAIL");
+      }
+      std::cout << std::endl;
+    }
+  }
+}
+
+// 1, 2, 4, ... threads and always max_threads itself.
+static std::vector<int> GetThreadCounts(int max_threads) {
+  std::vector<int> counts;
+  for (int count = 1; count < max_threads; count *= 2) {
+    counts.push_back(count);
+  }
+  counts.push_back(max_threads);
+  return counts;
+}
+
+// Every version (or only the given one) at every resolution up to
+// max_w x max_h, on 1 to max_threads threads. Backgrounds are resampled
+// from the input, and each resolution first gets its own reference from
+// the Sequential version, saved as reference_<w>x<h>.png.
+static void RunSuite(const std::vector<Vector>& input, int input_w,
+                     int input_h, const Camera& camera, int version,
+                     fast_math::Accuracy accuracy,
+                     const light_batch::Settings& light_settings,
+                     int max_w, int max_h, int max_threads) {
+  const std::vector<std::string> version_list = GetVersionList();
+  std::cout << "| Resolution | Version | Threads | FPS Rate | Speed-up |" <<
+    " Efficiency | Check |" << std::endl;
+  std::cout << "|------------|---------|---------|----------|----------|" <<
+    "------------|-------|" << std::endl;
+
+  for (const int* resolution : kSuiteResolutions) {
+    const int w = resolution[0];
+    const int h = resolution[1];
+    if (w > max_w || h > max_h) {
+      continue;
+    }
+    const std::vector<Vector> background =
+      image::Resample(input, input_w, input_h, w, h);
+    const std::string reference = "reference_" + std::to_string(w) + "x" +
+      std::to_string(h) + ".png";
+    wavefront::Stats wavefront_stats;
+    Scene scene(background);
+    Render(scene.GetSpheres(), scene.GetBoxes(), scene.GetLights(), camera,
+           scene.GetImage(), w, h, 0, accuracy, light_settings,
+           wavefront_stats);
+    bool saved = image::SavePng(reference.c_str(), w, h, scene.GetImage());
+    assert(saved);
+
+    for (int v = 0; v < static_cast<int>(version_list.size()); ++v) {
+      if (version >= 0 && v != version) {
+        continue;
+      }
+      // Sequential does not use the thread pool.
+      const std::vector<int> thread_counts =
+        GetThreadCounts(v == 0 ? 1 : max_threads);
+      float base_fps = 0.0f;
+      for (int threads : thread_counts) {
+        omp_set_num_threads(threads);
+        scene.SetBackground(background);
+        Render(scene.GetSpheres(), scene.GetBoxes(), scene.GetLights(),
+               camera, scene.GetImage(), w, h, v, accuracy, light_settings,
+               wavefront_stats);
+        arena::ResetAll();
+
+        // Frames until about a second has passed, at most kFrameCount.
+        double render_ms = 0.0;
+        unsigned frames = 0;
+        while (frames < kFrameCount && render_ms < kSuiteMs) {
+          scene.SetBackground(background);
+          auto start = std::chrono::steady_clock::now();
+          Render(scene.GetSpheres(), scene.GetBoxes(), scene.GetLights(),
+                 camera, scene.GetImage(), w, h, v, accuracy,
+                 light_settings, wavefront_stats);
+          render_ms += std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - start).count();
+          arena::ResetAll();
+          ++frames;
+        }
+
+        float fps = static_cast<float>(frames * 1000.0 / render_ms);
+        base_fps = threads == 1 ? fps : base_fps;
+        float speed_up = fps / base_fps;
+        validation::Report report;
+        bool same = Validate(scene.GetImage(), w, h, reference,
+                             kThresholds, report);
+        std::cout << "| " << w << "x" << h << " | " << version_list[v] <<
+          " | " << threads << " | " << fps << " | " << speed_up <<
+          "x | " << 100.0f * speed_up / threads << "% | " <<
+          (same ? "OK" : "FAIL") << " |" << std::endl;
+      }
+    }
+  }
+  omp_set_num_threads(max_threads);
+}
+
+static void PrintLatency(const char* name, const std::vector<double>& ms) {
+  server::Percentiles percentiles = server::GetPercentiles(ms);
+  std::cout << name << " Latency: p50 " << percentiles.p50 <<
+    " ms, p90 " << percentiles.p90 << " ms, p99 " << percentiles.p99 <<
+    " ms, max " << percentiles.max << " ms" << std::endl;
+}
+
+static void RunServer(const std::string& input_image, int port,
+                      const distributed::RenderFunction& render) {
+  std::cout << "Target Device: " << GetHostCPU() << std::endl;
+
+  int w = 0, h = 0;
+  std::vector<Vector> input;
+  bool loaded = image::Load(input_image.c_str(), w, h, input);
+  if (!loaded) {
+    std::cout << "Input image file was not found: " <<
+      input_image.c_str() << std::endl;
+    return;
+  }
+
+  std::cout << "Warming-up...";
+  server::Server server(render, input, w, h);
+  server.WarmUp(static_cast<int>(GetVersionList().size()));
+  std::cout << "DONE" << std::endl;
+
+  std::cout << "Serving on port " << port << "..." << std::endl;
+  if (!server.Run(port)) {
+    std::cout << "Cannot listen on port " << port << std::endl;
+    return;
+  }
+
+  std::cout << std::fixed << std::setprecision(2);
+  std::cout << "Requests: " << server.total_ms().size() << " in " <<
+    server.batches() << " batches" << std::endl;
+  PrintLatency("Queue", server.queue_ms());
+  PrintLatency("Render", server.render_ms());
+  PrintLatency("Total", server.total_ms());
+}
+
+// Sends count requests over concurrency connections and reports round trip
+// and server latencies; the last image is checked and saved as usual.
+static void RunClient(const std::string& host, int port,
+                      const server::RenderRequest& request,
+                      int count, int concurrency,
+                      const std::string& output_image,
+                      const std::string& reference_image) {
+  std::vector<std::vector<double>> round_trip_ms(concurrency);
+  std::vector<std::vector<double>> queue_ms(concurrency);
+  std::vector<std::vector<double>> render_ms(concurrency);
+  std::vector<Vector> image;
+  int w = 0, h = 0;
+
+  net::Initialize();
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (int c = 0; c < concurrency; ++c) {
+    threads.emplace_back([&, c] {
+      net::Socket socket;
+      if (!socket.Connect(host.c_str(), port)) {
+        return;
+      }
+
+      std::vector<Vector> result;
+      int result_w = 0, result_h = 0;
+      for (int r = c; r < count; r += concurrency) {
+        auto sent = std::chrono::steady_clock::now();
+        server::Latency latency;
+        if (!server::Request(socket, request, result, result_w, result_h,
+                             latency)) {
+          return;
+        }
+        round_trip_ms[c].push_back(std::chrono::duration<double, std::milli>(
+          std::chrono::steady_clock::now() - sent).count());
+        queue_ms[c].push_back(latency.queue_ms);
+        render_ms[c].push_back(latency.render_ms);
+      }
+
+      if (c == 0) {
+        image.swap(result);
+        w = result_w;
+        h = result_h;
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  auto wall_time = std::chrono::duration<double, std::milli>(
+    std::chrono::steady_clock::now() - start).count();
+
+  std::vector<double> all_round_trip_ms, all_queue_ms, all_render_ms;
+  for (int c = 0; c < concurrency; ++c) {
+    all_round_trip_ms.insert(all_round_trip_ms.end(),
+                             round_trip_ms[c].begin(), round_trip_ms[c].end());
+    all_queue_ms.insert(all_queue_ms.end(),
+                        queue_ms[c].begin(), queue_ms[c].end());
+    all_render_ms.insert(all_render_ms.end(),
+                         render_ms[c].begin(), render_ms[c].end());
+  }
+
+  std::cout << std::fixed << std::setprecision(2);
+  std::cout << "Requests: " << all_round_trip_ms.size() << " of " << count <<
+    " succeeded" << std::endl;
+  std::cout << "Wall Time: " << wall_time << " ms" << std::endl;
+  std::cout << "Requests per Second: " <<
+    all_round_trip_ms.size() * 1000.0 / wall_time << std::endl;
+  PrintLatency("Round Trip", all_round_trip_ms);
+  PrintLatency("Server Queue", all_queue_ms);
+  PrintLatency("Server Render", all_render_ms);
+  if (image.empty()) {
+    return;
+  }
+
+  // The reference only exists for the background resolution.
+  if (request.w == 0 && request.h == 0) {
+    std::cout << "Checking for results...";
+    validation::Report report;
+    bool same = Validate(image, w, h, reference_image, kThresholds, report);
+    std::cout << (same ? "OK" : "FAIL") << std::endl;
+    if (!report.tile_errors.empty()) {
+      PrintReport(report, kThresholds);
+    }
+  }
+
+  bool saved = image::Save(output_image.c_str(), w, h, image);
+  assert(saved);
+}
+
 static void Usage() {
   std::cout << "How To Tun: rtbech -v <version> [-i <input.jpg>]" <<
-    " [-r <reference.png>] [-o <output.png>]" << std::endl;
+    " [-r <reference.png>] [-o <output.png|pfm|raw>] [-a <accuracy>]" <<
+    " [-heatmap <errors.png>]" <<
+    " [-c <x,y,z,target_x,target_y,target_z,fov>] [-rc <0|1>]" <<
+    " [-m <coordinator|worker|server|client|stop|suite>] [-p <port>]" <<
+    " [-host <address>] [-n <count>] [-j <connections>] [-s <WxH>]" <<
+    " [-scene <id>] [-sockets <count>] [-scaling <0|1>] [-f <format>]" <<
+    " [-bandwidth <0|1>] [-lights <count>] [-cull <0|1>]" <<
+    " [-shadows <rays>] [-spheres <count>] [-interleave <0|1>]" <<
+    " [-avx2 <0|1>]" <<
+    std::endl;
   std::cout << "Available Versions:" << std::endl;
   std::vector<std::string> version_list = GetVersionList();
   assert(version_list.size() > 0);
   for (size_t j = 0; j < version_list.size(); ++j) {
     std::cout << "[" << j << "] " << version_list[j] << std::endl;
   }
+  std::cout << "Available Accuracies (Fast Math versions only):" << std::endl;
+  std::cout << "[0] Exact" << std::endl;
+  std::cout << "[1] Fast (default)" << std::endl;
+  std::cout << "[2] Fastest" << std::endl;
+  std::cout << "Framebuffer Formats (-f):" << std::endl;
+  for (int f = 0; f < pixel_format::kFormatCount; ++f) {
+    pixel_format::Format format = static_cast<pixel_format::Format>(f);
+    std::cout << "[" << f << "] " << pixel_format::GetName(format) << " (" <<
+      pixel_format::GetPixelSize(format) << " bytes per pixel)" <<
+      (f == 0 ? ", default" : "") << std::endl;
+  }
+  std::cout << "Images (-i, -r, -o): .pfm and .raw float images are" <<
+    " mapped instead of decoded, other inputs go through stb_image" <<
+    std::endl;
+  std::cout << "Validation (-r): whole-image max error, PSNR and SSIM" <<
+    " against the reference, gated at 2/255 for every version and" <<
+    " accuracy; -heatmap saves the largest error of every" <<
+    " tile, white at the threshold" << std::endl;
+  std::cout << "Camera (-c): position, look-at target and vertical FOV" <<
+    " in degrees, default is 0,0,0,0,0,-1,60" << std::endl;
+  std::cout << "Ray Cache (-rc): reuse primary rays and culling tile" <<
+    " lists across frames," <<
+    " default is 1" << std::endl;
+  std::cout << "Distributed (-m): coordinator renders with -n workers" <<
+    " listening on -p (default " << distributed::kDefaultPort << ")," <<
+    " worker connects to -host:-p (default 127.0.0.1)" << std::endl;
+  std::cout << "Server (-m server): keeps the scene loaded and renders" <<
+    " client requests on -p (default " << server::kDefaultPort << ")," <<
+    " client sends -n requests over -j connections at -s resolution" <<
+    " (default is the input size), stop shuts the server down" << std::endl;
+  std::cout << "NUMA: -sockets limits threads and memory to the first" <<
+    " nodes (default all), -scaling 1 also measures FPS on 1, 2, ..." <<
+    " nodes" << std::endl;
+  std::cout << "Suite (-m suite): every version, or only -v, from 256x256" <<
+    " up to 8K or the -s limit on 1, 2, 4, ... threads, checked against" <<
+    " Sequential references saved as reference_<w>x<h>.png" << std::endl;
+  std::cout << "Lights (-lights): adds lights around the spheres for" <<
+    " many-light runs, which have no reference; -cull 1 skips lights" <<
+    " whose contribution to a hit is negligible, -shadows samples that" <<
+    " many shadow rays per hit by importance (SSE Fast Math only)" <<
+    std::endl;
+  std::cout << "Spheres (-spheres): adds procedural spheres behind the" <<
+    " default ones for scenes larger than the caches, which have no" <<
+    " reference; -interleave 1 renders them with 1, 2, 4, ..." <<
+    " interleaved pixels per thread (Interleaved traversal)" << std::endl;
+  std::cout << "AVX2 (-avx2): Sequential and Baseline run code built" <<
+    " for AVX2 when the CPU has it, -avx2 0 forces the generic code" <<
+    std::endl;
+  std::cout << "Bandwidth (-bandwidth 1): copy and render every format at" <<
+    " the input size, 4K and 8K" << std::endl;
+}
+
+static bool ParseResolution(const char* str, int& w, int& h) {
+  char* end = nullptr;
+  w = static_cast<int>(strtol(str, &end, 10));
+  if (end == str || *end != 'x') {
+    return false;
+  }
+  str = end + 1;
+  h = static_cast<int>(strtol(str, &end, 10));
+  return end != str && *end == '\0' && w > 0 && h > 0;
+}
+
+static bool ParseCamera(const char* str, Camera& camera) {
+  float values[7] = { 0.0f };
+  for (int i = 0; i < 7; ++i) {
+    char* end = nullptr;
+    values[i] = strtof(str, &end);
+    if (end == str || *end != (i < 6 ? ',' : '\0')) {
+      return false;
+    }
+    str = end + 1;
+  }
+  if (values[6] <= 0.0f || values[6] >= 180.0f) {
+    return false;
+  }
+
+  camera = Camera(Vector(values[0], values[1], values[2]),
+                  Vector(values[3], values[4], values[5]),
+                  Vector(0.0f, 1.0f, 0.0f),
+                  static_cast<float>(values[6] * M_PI / 180.0));
+  return camera.IsValid();
 }
 
 int main(int argc, char* argv[]) {
   int version = -1;
+  int accuracy = static_cast<int>(fast_math::Accuracy::kFast);
+  int cache_rays = 1;
+  const char* camera_str = nullptr;
+  std::string mode;
+  std::string host("127.0.0.1");
+  int port = -1;
+  int count = 1;
+  int concurrency = 1;
+  int scene_id = 0;
+  const char* resolution_str = nullptr;
+  int sockets = 0;
+  int scaling = 0;
+  int format_id = 0;
+  int bandwidth = 0;
+  int extra_lights = 0;
+  int extra_spheres = 0;
+  int interleave = 0;
+  int avx2 = 1;
+  int cull_lights = 0;
+  int shadow_rays = 0;
   std::string input_image("input.jpg");
   std::string output_image("output.png");
   std::string reference_image("reference.png");
+  std::string heatmap_image;
 
   for (int i = 1; i < argc - 1; ++i) {
     if (strcmp(argv[i], "-v") == 0) {
@@ -82,10 +733,117 @@ int main(int argc, char* argv[]) {
       output_image = argv[i + 1];
     } else if (strcmp(argv[i], "-r") == 0) {
       reference_image = argv[i + 1];
+    } else if (strcmp(argv[i], "-heatmap") == 0) {
+      heatmap_image = argv[i + 1];
+    } else if (strcmp(argv[i], "-a") == 0) {
+      accuracy = atoi(argv[i + 1]);
+    } else if (strcmp(argv[i], "-c") == 0) {
+      camera_str = argv[i + 1];
+    } else if (strcmp(argv[i], "-rc") == 0) {
+      cache_rays = atoi(argv[i + 1]);
+    } else if (strcmp(argv[i], "-m") == 0) {
+      mode = argv[i + 1];
+    } else if (strcmp(argv[i], "-p") == 0) {
+      port = atoi(argv[i + 1]);
+    } else if (strcmp(argv[i], "-host") == 0) {
+      host = argv[i + 1];
+    } else if (strcmp(argv[i], "-n") == 0) {
+      count = atoi(argv[i + 1]);
+    } else if (strcmp(argv[i], "-j") == 0) {
+      concurrency = atoi(argv[i + 1]);
+    } else if (strcmp(argv[i], "-s") == 0) {
+      resolution_str = argv[i + 1];
+    } else if (strcmp(argv[i], "-scene") == 0) {
+      scene_id = atoi(argv[i + 1]);
+    } else if (strcmp(argv[i], "-sockets") == 0) {
+      sockets = atoi(argv[i + 1]);
+    } else if (strcmp(argv[i], "-scaling") == 0) {
+      scaling = atoi(argv[i + 1]);
+    } else if (strcmp(argv[i], "-f") == 0) {
+      format_id = atoi(argv[i + 1]);
+    } else if (strcmp(argv[i], "-bandwidth") == 0) {
+      bandwidth = atoi(argv[i + 1]);
+    } else if (strcmp(argv[i], "-lights") == 0) {
+      extra_lights = std::max(0, atoi(argv[i + 1]));
+    } else if (strcmp(argv[i], "-spheres") == 0) {
+      extra_spheres = std::max(0, atoi(argv[i + 1]));
+    } else if (strcmp(argv[i], "-interleave") == 0) {
+      interleave = atoi(argv[i + 1]);
+    } else if (strcmp(argv[i], "-avx2") == 0) {
+      avx2 = atoi(argv[i + 1]);
+    } else if (strcmp(argv[i], "-cull") == 0) {
+      cull_lights = atoi(argv[i + 1]);
+    } else if (strcmp(argv[i], "-shadows") == 0) {
+      shadow_rays = atoi(argv[i + 1]);
     }
   }
 
-  if (version < 0) {
+  isa::GetSettings().avx2 = avx2 != 0;
+
+  light_batch::Settings light_settings;
+  if (shadow_rays > 0) {
+    light_settings.mode = light_batch::Mode::kSampled;
+    light_settings.shadow_rays = std::min(shadow_rays,
+                                          light_batch::kMaxShadowRays);
+  } else if (cull_lights != 0) {
+    light_settings.mode = light_batch::Mode::kCulled;
+  }
+
+  // Threads are pinned per node before any rendering so that the pool
+  // keeps its placement across frames.
+  if (sockets <= 0) {
+    sockets = numa::GetSystemNodeCount();
+  }
+  int thread_count = numa::Configure(sockets);
+
+  bool server_mode = mode == "server" || mode == "client" || mode == "stop";
+  if (port < 0) {
+    port = server_mode ? server::kDefaultPort : distributed::kDefaultPort;
+  }
+
+  // Tiles may be rendered concurrently, so queue statistics stay local.
+  distributed::RenderFunction render =
+    [](const std::vector<Sphere>& spheres,
+       const std::vector<Box>& boxes,
+       const std::vector<Light>& lights,
+       const Camera& camera,
+       Framebuffer& image,
+       int w, int h, int version,
+       fast_math::Accuracy accuracy,
+       const light_batch::Settings& light_settings) {
+      wavefront::Stats stats;
+      return Render(spheres, boxes, lights, camera, image, w, h, version,
+                    accuracy, light_settings, stats);
+    };
+
+  // Workers get the version and the scene from the coordinator.
+  if (mode == "worker") {
+    std::cout << "Worker connecting to " << host << ":" << port << std::endl;
+    bool served = distributed::RunWorker(
+      host.c_str(), port, static_cast<int>(GetVersionList().size()), render);
+    std::cout << (served ? "DONE" : "Connection lost") << std::endl;
+    return 0;
+  }
+
+  // The server takes version, camera and resolution from every request.
+  if (mode == "server") {
+    RunServer(input_image, port, render);
+    return 0;
+  } else if (mode == "stop") {
+    bool stopped = server::RequestStop(host.c_str(), port);
+    std::cout << (stopped ? "Server stopped" : "Server was not found") <<
+      std::endl;
+    return 0;
+  }
+
+  if (!mode.empty() && mode != "coordinator" && mode != "client" &&
+      mode != "suite") {
+    std::cout << "Invalid mode " << mode << std::endl;
+    Usage();
+    return 0;
+  }
+
+  if (version < 0 && mode != "suite") {
     Usage();
     return 0;
   }
@@ -93,63 +851,293 @@ int main(int argc, char* argv[]) {
   std::vector<std::string> version_list = GetVersionList();
   assert(version_list.size() > 0);
 
-  if (version >= version_list.size()) {
+  if (version >= static_cast<int>(version_list.size())) {
     std::cout << "Invalid version " << version << std::endl;
     Usage();
     return 0;
   }
 
+  // Baked has the default scene compiled in and renders nothing else.
+  if (version == 3 && (extra_lights > 0 || extra_spheres > 0)) {
+    std::cout << "Baked renders only the default scene, -lights and" <<
+      " -spheres are not supported" << std::endl;
+    Usage();
+    return 0;
+  }
+
+  // Only SSE Fast Math shades through light_batch, the others would
+  // silently evaluate every light.
+  if (version != 4 && (cull_lights != 0 || shadow_rays > 0)) {
+    std::cout << "-cull and -shadows are only supported by SSE Fast Math" <<
+      std::endl;
+    Usage();
+    return 0;
+  }
+
+  if (accuracy < static_cast<int>(fast_math::Accuracy::kExact) ||
+      accuracy > static_cast<int>(fast_math::Accuracy::kFastest)) {
+    std::cout << "Invalid accuracy " << accuracy << std::endl;
+    Usage();
+    return 0;
+  }
+
+  if (format_id < 0 || format_id >= pixel_format::kFormatCount ||
+      !pixel_format::IsSupported(
+        static_cast<pixel_format::Format>(format_id))) {
+    std::cout << "Invalid format " << format_id << std::endl;
+    Usage();
+    return 0;
+  }
+  const pixel_format::Format format =
+    static_cast<pixel_format::Format>(format_id);
+
+  Camera camera;
+  if (camera_str != nullptr && !ParseCamera(camera_str, camera)) {
+    std::cout << "Invalid camera " << camera_str << std::endl;
+    Usage();
+    return 0;
+  }
+  camera.SetCacheRays(cache_rays != 0);
+
+  if (mode == "suite") {
+    int max_w = kSuiteResolutions[5][0], max_h = kSuiteResolutions[5][1];
+    if (resolution_str != nullptr &&
+        !ParseResolution(resolution_str, max_w, max_h)) {
+      std::cout << "Invalid resolution " << resolution_str << std::endl;
+      Usage();
+      return 0;
+    }
+
+    int w = 0, h = 0;
+    std::vector<Vector> input;
+    if (!image::Load(input_image.c_str(), w, h, input)) {
+      std::cout << "Input image file was not found: " <<
+        input_image.c_str() << std::endl;
+      return 0;
+    }
+    std::cout << "Target Device: " << GetHostCPU() << std::endl;
+    std::cout << std::fixed << std::setprecision(2);
+    RunSuite(input, w, h, camera, version,
+             static_cast<fast_math::Accuracy>(accuracy), light_settings,
+             max_w, max_h, thread_count);
+    return 0;
+  }
+
+  if (mode == "client") {
+    server::RenderRequest request;
+    if (resolution_str != nullptr &&
+        !ParseResolution(resolution_str, request.w, request.h)) {
+      std::cout << "Invalid resolution " << resolution_str << std::endl;
+      Usage();
+      return 0;
+    }
+    request.scene_id = scene_id;
+    request.version = version;
+    request.accuracy = accuracy;
+    request.light_mode = static_cast<int32_t>(light_settings.mode);
+    request.shadow_rays = light_settings.shadow_rays;
+    memcpy(request.position, camera.position().data(), sizeof(float) * 3);
+    memcpy(request.target, camera.target().data(), sizeof(float) * 3);
+    request.fov = camera.fov();
+
+    std::cout << "Target Version: " << version_list[version] << std::endl;
+    RunClient(host, port, request, count, std::max(1, concurrency),
+              output_image, reference_image);
+    return 0;
+  }
+
   std::cout << "Target Device: " << GetHostCPU() << std::endl;
   std::cout << "Target Version: " << version_list[version] << std::endl;
+  std::cout << "NUMA Nodes: " << numa::GetNodeCount() << " of " <<
+    numa::GetSystemNodeCount() << ", Threads: " << thread_count << std::endl;
+  std::cout << "Framebuffer Format: " << pixel_format::GetName(format) <<
+    std::endl;
+  if (version <= 1) {
+    std::cout << "Scalar Code: " <<
+      (isa::UseAvx2() ? "AVX2" : "Generic") << std::endl;
+  }
 
+  // The input is converted straight into the placed framebuffer, which the
+  // warm-up frame renders on; later frames start again from a copy.
   int w = 0, h = 0;
-  std::vector<Vector> input;
-  bool loaded = image::Load(input_image.c_str(), w, h, input);
+  Scene scene;
+  auto load_start = std::chrono::steady_clock::now();
+  bool loaded = image::Load(input_image.c_str(), w, h, scene.GetImage());
   if (!loaded) {
     std::cout << "Input image file was not found: " <<
       input_image.c_str() << std::endl;
     return 0;
   }
+  double load_ms = std::chrono::duration<double, std::milli>(
+    std::chrono::steady_clock::now() - load_start).count();
+  std::cout << "Input Load Time: " << load_ms << " ms" << std::endl;
+  const std::vector<Vector> input(scene.GetImage().begin(),
+                                  scene.GetImage().end());
+
+  scene.AddLights(extra_lights);
+  if (extra_lights > 0) {
+    std::cout << "Lights: " << scene.GetLights().size() << std::endl;
+  }
+  scene.AddSpheres(extra_spheres);
+  if (extra_spheres > 0) {
+    std::cout << "Spheres: " << scene.GetSpheres().size() << std::endl;
+  }
+  if (light_settings.mode == light_batch::Mode::kSampled) {
+    std::cout << "Light Mode: Culled, " << light_settings.shadow_rays <<
+      " sampled shadow rays per hit" << std::endl;
+  } else if (light_settings.mode == light_batch::Mode::kCulled) {
+    std::cout << "Light Mode: Culled" << std::endl;
+  }
+
+  // The coordinator splits every frame into tiles among its workers and
+  // only sends the scene once.
+  distributed::Coordinator coordinator(render);
+  bool use_workers = mode == "coordinator";
+  if (use_workers) {
+    std::cout << "Waiting for " << count << " workers on port " <<
+      port << "...";
+    if (!coordinator.Start(port, count, kWorkerTimeoutMs)) {
+      std::cout << "no workers connected, rendering locally" << std::endl;
+    } else {
+      std::cout << coordinator.worker_stats().size() << " connected" <<
+        std::endl;
+    }
+    coordinator.SendScene(scene.GetSpheres(), scene.GetBoxes(),
+                          scene.GetLights(), camera, input, w, h, version,
+                          static_cast<fast_math::Accuracy>(accuracy),
+                          light_settings);
+  }
+
+  // Compact formats render tile by tile from a compact copy of the
+  // background; the image is unpacked once at the end for the check.
+  bool use_compact = format != pixel_format::Format::kRgba32f && !use_workers;
+  pixel_format::Image background, compact_image;
+  if (use_compact) {
+    background = pixel_format::Image(format, w, h);
+    pixel_format::FromPixels(input, background);
+    compact_image = pixel_format::Image(format, w, h);
+  }
+
+  wavefront::Stats wavefront_stats;
+  auto render_frame = [&](const light_batch::Settings& settings) {
+    if (use_workers) {
+      coordinator.RenderFrame(scene.GetImage(), kWorkerTimeoutMs);
+      return true;
+    } else if (use_compact) {
+      return compact::Render(render, scene.GetSpheres(), scene.GetBoxes(),
+                             scene.GetLights(), camera, background,
+                             compact_image, version,
+                             static_cast<fast_math::Accuracy>(accuracy),
+                             settings);
+    }
+    return Render(scene.GetSpheres(), scene.GetBoxes(), scene.GetLights(),
+                  camera, scene.GetImage(), w, h, version,
+                  static_cast<fast_math::Accuracy>(accuracy), settings,
+                  wavefront_stats);
+  };
 
   std::cout << "Warming-up...";
-  Scene scene(input);
-  bool succeed = Render(scene.GetSpheres(), scene.GetLights(),
-                        scene.GetImage(), w, h, version);
+  bool succeed = render_frame(light_settings);
   assert(succeed);
+  wavefront_stats = wavefront::Stats();
+  arena::ResetAll();
   std::cout << "DONE" << std::endl;
 
   std::cout << "Computing...";
   unsigned wall_time = 0;
+  const arena::Counters counters = arena::GetCounters();
   for (unsigned i = 0; i < kFrameCount; ++i) {
-    Scene scene(input);
+    if (!use_compact) {
+      scene.SetBackground(input);
+    }
     auto start = std::chrono::steady_clock::now();
-    bool succeed = Render(scene.GetSpheres(), scene.GetLights(),
-                          scene.GetImage(), w, h, version);
+    bool succeed = render_frame(light_settings);
     assert(succeed);
     auto end = std::chrono::steady_clock::now();
     auto elapsed =
       std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
     wall_time += static_cast<unsigned>(elapsed.count());
+    arena::ResetAll();
     std::cout << ".";
   }
   std::cout << std::endl;
+  const arena::Counters frame_counters = arena::GetCounters() - counters;
   
   std::cout << "Wall Time: " << wall_time << " ms" << std::endl;
   std::cout << "Time per Frame: " << wall_time / kFrameCount <<
     " ms" << std::endl;
   std::cout << "FPS rate: " << std::fixed << std::setprecision(2) <<
     kFrameCount * 1000.0f / wall_time << std::endl;
-
-  std::cout << "Checking for results...";
-  bool same = image::Compare(scene.GetImage(), reference_image.c_str());
-  if (!same) {
-    std::cout << "FAIL" << std::endl;
+  PrintQueueStats("Primary", wavefront_stats.primary);
+  PrintQueueStats("Secondary", wavefront_stats.secondary);
+  PrintQueueStats("Shadow", wavefront_stats.shadow);
+  PrintAllocations(frame_counters);
+  if (use_workers) {
+    coordinator.Shutdown();
+    PrintWorkerStats(coordinator);
+  } else if (use_compact) {
+    PrintPageAccesses(compact_image.Pixel(0, 0),
+                      w * pixel_format::GetPixelSize(format), h);
+    pixel_format::ToPixels(compact_image, scene.GetImage());
   } else {
-    std::cout << "OK" << std::endl;
+    PrintPageAccesses(scene.GetImage().data(), w * sizeof(Vector), h);
   }
 
-  bool saved = image::SavePng(output_image.c_str(), w, h, scene.GetImage());
+  // The reference is rendered with the default scene only.
+  if (extra_lights == 0 && extra_spheres == 0) {
+    std::cout << "Checking for results...";
+    validation::Report report;
+    bool same = Validate(scene.GetImage(), w, h, reference_image,
+                         kThresholds, report);
+    if (!same) {
+      std::cout << "FAIL" << std::endl;
+    } else {
+      std::cout << "OK" << std::endl;
+    }
+    if (!report.tile_errors.empty()) {
+      PrintReport(report, kThresholds);
+      if (!heatmap_image.empty()) {
+        bool saved = image::Save(heatmap_image.c_str(), w, h,
+                                 validation::Heatmap(report,
+                                                     kThresholds.max_error));
+        assert(saved);
+      }
+    }
+  }
+
+  bool saved = image::Save(output_image.c_str(), w, h, scene.GetImage());
   assert(saved);
 
+  // One more frame with every light gives the error of culling and
+  // sampling. Workers keep the settings the scene was sent with.
+  if (light_settings.mode != light_batch::Mode::kAll && !use_workers) {
+    const std::vector<Vector> approximate(scene.GetImage().begin(),
+                                          scene.GetImage().end());
+    scene.SetBackground(input);
+    bool succeed = render_frame(light_batch::Settings());
+    assert(succeed);
+    arena::ResetAll();
+    if (use_compact) {
+      pixel_format::ToPixels(compact_image, scene.GetImage());
+    }
+    PrintLightError(approximate, scene.GetImage());
+  }
+
+  if (scaling != 0 && !use_workers) {
+    RunSocketScaling(input, camera, w, h, version,
+                     static_cast<fast_math::Accuracy>(accuracy),
+                     light_settings);
+  }
+
+  if (interleave != 0 && !use_workers) {
+    RunInterleave(scene, input, camera, w, h);
+  }
+
+  if (bandwidth != 0 && !use_workers) {
+    RunBandwidth(render, input, camera, w, h, version,
+                 static_cast<fast_math::Accuracy>(accuracy), light_settings,
+                 reference_image);
+  }
+
   return 0;
 }
\ No newline at end of file
@@ -0,0 +1,73 @@
+# Profile-guided build: Release, a PGInstrument binary trained on the
+# benchmark scene with every version, and the PGOptimize binary built from
+# that profile. Prints the FPS of every version as a speed-up table, with
+# the AVX2 scalar code against the generic one for Sequential and Baseline.
+# Run from a Developer PowerShell for VS 2019 so that msbuild is found.
+param(
+  [string]$InputImage = "..\input.jpg",
+  [string]$ReferenceImage = "..\reference.png",
+  [int]$Runs = 3
+)
+
+$ErrorActionPreference = "Stop"
+Set-Location $PSScriptRoot
+$versions = 0..7
+$output = Join-Path $env:TEMP "rtbench_pgo.png"
+
+function Build([string]$configuration) {
+  msbuild rtbench.sln /m /nologo /v:minimal "/p:Configuration=$configuration" `
+    /p:Platform=x64
+  if ($LASTEXITCODE -ne 0) {
+    throw "$configuration build failed"
+  }
+}
+
+function Run([string]$configuration, [int]$version, [string[]]$options) {
+  & "x64\$configuration\rtbench.exe" -v $version -i $InputImage `
+    -r $ReferenceImage -o $output @options
+}
+
+# Best of a few runs, the first frames of a run warm the caches anyway.
+function Measure([string]$configuration, [int]$version, [string[]]$options) {
+  $best = 0.0
+  for ($run = 0; $run -lt $Runs; ++$run) {
+    $match = Run $configuration $version $options |
+      Select-String "FPS rate: ([0-9.]+)"
+    $best = [Math]::Max($best, [double]$match.Matches[0].Groups[1].Value)
+  }
+  return $best
+}
+
+Build "Release"
+Remove-Item -Recurse -Force "x64\PGO" -ErrorAction SilentlyContinue
+New-Item -ItemType Directory "x64\PGO" | Out-Null
+Build "PGInstrument"
+
+# The .pgc counts go next to the .pgd, where the PGOptimize link merges
+# them.
+$env:VCPROFILE_PATH = (Resolve-Path "x64\PGO").Path
+foreach ($version in $versions) {
+  Run "PGInstrument" $version @() | Out-Null
+}
+Remove-Item Env:\VCPROFILE_PATH
+Build "PGOptimize"
+
+"| Version | Release FPS | PGO FPS | PGO Speed-up | Generic FPS | " +
+  "AVX2 Speed-up |"
+"|---------|-------------|---------|--------------|-------------|" +
+  "---------------|"
+foreach ($version in $versions) {
+  $name = (Run "Release" $version @() |
+    Select-String "Target Version: (.+)").Matches[0].Groups[1].Value
+  $release = Measure "Release" $version @()
+  $pgo = Measure "PGOptimize" $version @()
+  $generic = "-"
+  $avx2 = "-"
+  if ($version -le 1) {
+    $fps = Measure "Release" $version @("-avx2", "0")
+    $generic = "{0:F2}" -f $fps
+    $avx2 = "{0:F2}x" -f ($release / $fps)
+  }
+  "| {0} | {1:F2} | {2:F2} | {3:F2}x | {4} | {5} |" -f $name, $release,
+    $pgo, ($pgo / $release), $generic, $avx2
+}
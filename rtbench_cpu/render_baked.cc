@@ -0,0 +1,494 @@
+#include "render_baked.h"
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+#include <assert.h>
+#define _USE_MATH_DEFINES
+#include <math.h>
+
+#include "common/arena.h"
+#include "culling.h"
+
+namespace baked {
+
+struct MaterialDesc {
+  float refractive_index;
+  float albedo[4];
+  float diffuse_color[3];
+  float specular_exponent;
+};
+
+struct SphereDesc {
+  float center[3];
+  float radius;
+  MaterialDesc material;
+};
+
+struct LightDesc {
+  float position[3];
+  float intensity;
+};
+
+struct BoxDesc {
+  float min[3];
+  float max[3];
+  MaterialDesc material;
+  Texture texture;
+  float checker_color[3];
+};
+
+// Must be kept in sync with the Scene constructor.
+constexpr MaterialDesc kIvory = {
+  1.0f, {0.6f, 0.3f, 0.1f, 0.0f}, {0.4f, 0.4f, 0.3f}, 50.0f};
+constexpr MaterialDesc kGlass = {
+  1.5f, {0.0f, 0.5f, 0.1f, 0.8f}, {0.6f, 0.7f, 0.8f}, 125.0f};
+constexpr MaterialDesc kRedRubber = {
+  1.0f, {0.9f, 0.1f, 0.0f, 0.0f}, {0.3f, 0.1f, 0.1f}, 10.0f};
+constexpr MaterialDesc kMirror = {
+  1.0f, {0.0f, 10.0f, 0.8f, 0.0f}, {1.0f, 1.0f, 1.0f}, 1425.0f};
+constexpr MaterialDesc kFloor = {
+  1.0f, {1.0f, 0.0f, 0.0f, 0.0f}, {0.3f, 0.2f, 0.1f}, 0.0f};
+
+constexpr SphereDesc kSpheres[] = {
+  {{-3.0f, 0.0f, -16.0f}, 2.0f, kIvory},
+  {{-1.0f, -1.5f, -12.0f}, 2.0f, kGlass},
+  {{1.5f, -0.5f, -18.0f}, 3.0f, kRedRubber},
+  {{7.0f, 5.0f, -18.0f}, 4.0f, kMirror},
+};
+
+constexpr LightDesc kLights[] = {
+  {{-20.0f, 20.0f, 20.0f}, 1.5f},
+  {{30.0f, 50.0f, -25.0f}, 1.8f},
+  {{30.0f, 20.0f, 30.0f}, 1.7f},
+};
+
+constexpr BoxDesc kBoxes[] = {
+  {{-10.0f, -4.0f, -30.0f}, {10.0f, -4.0f, -10.0f}, kFloor,
+   Texture::kCheckerboard, {0.3f, 0.3f, 0.3f}},
+};
+
+constexpr size_t kSphereCount = sizeof(kSpheres) / sizeof(kSpheres[0]);
+constexpr size_t kBoxCount = sizeof(kBoxes) / sizeof(kBoxes[0]);
+constexpr size_t kObjectCount = kSphereCount + kBoxCount;
+constexpr size_t kLightCount = sizeof(kLights) / sizeof(kLights[0]);
+constexpr unsigned kMaxDepth = 4;
+// Primary rays test only the spheres of their tile, one bit per sphere.
+constexpr uint32_t kAllSpheres = ~0u;
+static_assert(kSphereCount <= 32, "Sphere masks hold 32 spheres");
+
+// Object indices past the spheres stand for the boxes.
+constexpr const MaterialDesc& MaterialOf(size_t index) {
+  return index < kSphereCount ? kSpheres[index].material :
+    kBoxes[index - kSphereCount].material;
+}
+
+// Axis along which a box is flat, -1 for a solid box.
+constexpr int FlatAxis(const BoxDesc& box) {
+  return box.min[0] == box.max[0] ? 0 :
+    box.min[1] == box.max[1] ? 1 :
+    box.min[2] == box.max[2] ? 2 : -1;
+}
+
+static bool Equals(const Vector& v, const float (&desc)[3]) {
+  return v.x() == desc[0] && v.y() == desc[1] && v.z() == desc[2];
+}
+
+static bool Equals(const Material& material, const MaterialDesc& desc) {
+  const Vector albedo = material.albedo();
+  return material.refractive_index() == desc.refractive_index &&
+    albedo.x() == desc.albedo[0] && albedo.y() == desc.albedo[1] &&
+    albedo.z() == desc.albedo[2] && albedo.w() == desc.albedo[3] &&
+    Equals(material.diffuse_color(), desc.diffuse_color) &&
+    material.specular_exponent() == desc.specular_exponent;
+}
+
+// True when the scene is the one baked in. Anything else, such as added
+// lights or spheres, would be rendered as the baked scene regardless.
+static bool MatchesBakedScene(const std::vector<Sphere>& spheres,
+                              const std::vector<Box>& boxes,
+                              const std::vector<Light>& lights) {
+  if (spheres.size() != kSphereCount || boxes.size() != kBoxCount ||
+      lights.size() != kLightCount) {
+    return false;
+  }
+  for (size_t i = 0; i < kSphereCount; ++i) {
+    if (!Equals(spheres[i].center(), kSpheres[i].center) ||
+        spheres[i].radius() != kSpheres[i].radius ||
+        !Equals(spheres[i].material(), kSpheres[i].material)) {
+      return false;
+    }
+  }
+  for (size_t i = 0; i < kBoxCount; ++i) {
+    if (!Equals(boxes[i].min(), kBoxes[i].min) ||
+        !Equals(boxes[i].max(), kBoxes[i].max) ||
+        !Equals(boxes[i].material(), kBoxes[i].material) ||
+        boxes[i].texture() != kBoxes[i].texture ||
+        (kBoxes[i].texture == Texture::kCheckerboard &&
+         !Equals(boxes[i].checker_color(), kBoxes[i].checker_color))) {
+      return false;
+    }
+  }
+  for (size_t i = 0; i < kLightCount; ++i) {
+    if (!Equals(lights[i].position(), kLights[i].position) ||
+        lights[i].intensity() != kLights[i].intensity) {
+      return false;
+    }
+  }
+  return true;
+}
+
+template <unsigned kExponent>
+struct Pow {
+  static float Eval(float x) {
+    float half = Pow<kExponent / 2>::Eval(x);
+    return (kExponent & 1) ? half * half * x : half * half;
+  }
+};
+
+template <>
+struct Pow<0> {
+  static float Eval(float) {
+    return 1.0f;
+  }
+};
+
+static Vector Reflect(const Vector& i, const Vector& n) {
+  return i - n * 2.0f * (i * n);
+}
+
+static Vector Refract(const Vector& i, const Vector& n,
+                      const float eta_t, const float eta_i = 1.f) {
+  float cosi = -std::max(-1.0f, std::min(1.0f, i * n));
+  if (cosi < 0) return Refract(i, -n, eta_i, eta_t);
+  float eta = eta_i / eta_t;
+  float k = 1 - eta * eta * (1 - cosi * cosi);
+  return k < 0 ? Vector(1.0f, 0.0f, 0.0f) :
+    i * eta + n * (eta * cosi - sqrtf(k));
+}
+
+template <size_t I>
+static Vector SphereCenter() {
+  return Vector(kSpheres[I].center[0],
+                kSpheres[I].center[1],
+                kSpheres[I].center[2]);
+}
+
+template <size_t I, size_t N>
+struct SphereLoop {
+  static void Intersect(const Vector& orig, const Vector& dir,
+                        uint32_t mask, float& dist, size_t& index) {
+    constexpr float kRadius2 = kSpheres[I].radius * kSpheres[I].radius;
+    Vector L = SphereCenter<I>() - orig;
+    float tca = L * dir;
+    float d2 = L * L - tca * tca;
+    if ((mask & (1u << I)) && d2 <= kRadius2) {
+      float thc = sqrtf(kRadius2 - d2);
+      float t0 = tca - thc;
+      if (t0 < 0) {
+        t0 = tca + thc;
+      }
+      if (t0 >= 0 && t0 < dist) {
+        dist = t0;
+        index = I;
+      }
+    }
+    SphereLoop<I + 1, N>::Intersect(orig, dir, mask, dist, index);
+  }
+};
+
+template <size_t N>
+struct SphereLoop<N, N> {
+  static void Intersect(const Vector&, const Vector&, uint32_t, float&,
+                        size_t&) {}
+};
+
+template <size_t I, size_t N>
+struct BoxLoop {
+  static void Intersect(const Vector& orig, const Vector& dir,
+                        float& dist, size_t& index) {
+    constexpr const BoxDesc& kBox = kBoxes[I];
+    constexpr int kFlatAxis = FlatAxis(kBox);
+    // Only used when the box is flat, kept in range otherwise.
+    constexpr int kAxis = kFlatAxis >= 0 ? kFlatAxis : 0;
+    float t0 = 0.0f;
+    bool hit = true;
+    if (kFlatAxis >= 0) {
+      t0 = (kBox.min[kAxis] - orig.data()[kAxis]) / dir.data()[kAxis];
+      hit = t0 > 0;
+      Vector pt = orig + dir * t0;
+      for (int k = 0; k < 3; ++k) {
+        if (k != kAxis) {
+          hit = hit && pt.data()[k] >= kBox.min[k] &&
+            pt.data()[k] <= kBox.max[k];
+        }
+      }
+    } else {
+      float t_near = -std::numeric_limits<float>::max();
+      float t_far = std::numeric_limits<float>::max();
+      for (int k = 0; k < 3; ++k) {
+        float ta = (kBox.min[k] - orig.data()[k]) / dir.data()[k];
+        float tb = (kBox.max[k] - orig.data()[k]) / dir.data()[k];
+        t_near = std::max(t_near, std::min(ta, tb));
+        t_far = std::min(t_far, std::max(ta, tb));
+      }
+      hit = t_near <= t_far && t_far > 0;
+      t0 = t_near > 0 ? t_near : t_far;
+    }
+    if (hit && t0 < dist) {
+      dist = t0;
+      index = kSphereCount + I;
+    }
+    BoxLoop<I + 1, N>::Intersect(orig, dir, dist, index);
+  }
+};
+
+template <size_t N>
+struct BoxLoop<N, N> {
+  static void Intersect(const Vector&, const Vector&, float&, size_t&) {}
+};
+
+static bool SceneIntersect(const Vector& orig, const Vector& dir,
+                           float& dist, size_t& index,
+                           uint32_t mask = kAllSpheres) {
+  dist = std::numeric_limits<float>::max();
+  SphereLoop<0, kSphereCount>::Intersect(orig, dir, mask, dist, index);
+  BoxLoop<0, kBoxCount>::Intersect(orig, dir, dist, index);
+  return dist < 1000.0f;
+}
+
+template <size_t I, bool kIsSphere = (I < kSphereCount)>
+struct Surface {
+  static void At(const Vector& point, Vector& norm, Vector& diffuse_color) {
+    norm = (point - SphereCenter<I>()).Normalize();
+    diffuse_color = Vector(MaterialOf(I).diffuse_color[0],
+                           MaterialOf(I).diffuse_color[1],
+                           MaterialOf(I).diffuse_color[2]);
+  }
+};
+
+// Same normal and texture as Box, with the flat axis and the texture
+// known at compile time.
+template <size_t I>
+struct Surface<I, false> {
+  static void At(const Vector& point, Vector& norm, Vector& diffuse_color) {
+    constexpr const BoxDesc& kBox = kBoxes[I - kSphereCount];
+    constexpr int kFlatAxis = FlatAxis(kBox);
+    constexpr int kAxis = kFlatAxis >= 0 ? kFlatAxis : 0;
+    norm = Vector();
+    if (kFlatAxis >= 0) {
+      norm.data()[kAxis] = 1.0f;
+    } else {
+      int axis = 0;
+      float sign = 1.0f;
+      float nearest = std::numeric_limits<float>::infinity();
+      for (int k = 0; k < 3; ++k) {
+        float to_min = fabsf(point.data()[k] - kBox.min[k]);
+        float to_max = fabsf(point.data()[k] - kBox.max[k]);
+        if (to_min < nearest) {
+          nearest = to_min;
+          axis = k;
+          sign = -1.0f;
+        }
+        if (to_max < nearest) {
+          nearest = to_max;
+          axis = k;
+          sign = 1.0f;
+        }
+      }
+      norm.data()[axis] = sign;
+    }
+
+    const float* color = kBox.material.diffuse_color;
+    if (kBox.texture == Texture::kCheckerboard &&
+        ((static_cast<int>(0.5f * point.x() + 1000.0f) +
+          static_cast<int>(0.5f * point.z())) & 1)) {
+      color = kBox.checker_color;
+    }
+    diffuse_color = Vector(color[0], color[1], color[2]);
+  }
+};
+
+template <size_t L, size_t N, unsigned kExponent, bool kSpecular>
+struct LightLoop {
+  static void Accumulate(const Vector& point, const Vector& norm,
+                         const Vector& dir, float& diffuse_light_intensity,
+                         float& specular_light_intensity) {
+    constexpr float kIntensity = kLights[L].intensity;
+    Vector position(kLights[L].position[0],
+                    kLights[L].position[1],
+                    kLights[L].position[2]);
+    Vector light_dir = (position - point).Normalize();
+    float light_distance = (position - point).norm();
+
+    Vector shadow_orig = light_dir * norm < 0 ?
+      point - norm * 1e-3f : point + norm * 1e-3f;
+    float shadow_dist = 0.0f;
+    size_t shadow_index = 0;
+    bool shadowed =
+      SceneIntersect(shadow_orig, light_dir, shadow_dist, shadow_index) &&
+      ((shadow_orig + light_dir * shadow_dist - shadow_orig).norm() <
+       light_distance);
+
+    if (!shadowed) {
+      diffuse_light_intensity += kIntensity *
+        std::max(0.f, light_dir * norm);
+      if (kSpecular) {
+        specular_light_intensity += Pow<kExponent>::Eval(
+          std::max(0.0f, -Reflect(-light_dir, norm) * dir)) * kIntensity;
+      }
+    }
+
+    LightLoop<L + 1, N, kExponent, kSpecular>::Accumulate(
+      point, norm, dir, diffuse_light_intensity, specular_light_intensity);
+  }
+};
+
+template <size_t N, unsigned kExponent, bool kSpecular>
+struct LightLoop<N, N, kExponent, kSpecular> {
+  static void Accumulate(const Vector&, const Vector&, const Vector&,
+                         float&, float&) {}
+};
+
+template <unsigned kDepth>
+struct Tracer {
+  static Vector CastRay(const Vector& background,
+                        const Vector& orig, const Vector& dir,
+                        uint32_t mask = kAllSpheres);
+};
+
+template <>
+struct Tracer<kMaxDepth + 1> {
+  static Vector CastRay(const Vector& background,
+                        const Vector&, const Vector&,
+                        uint32_t = kAllSpheres) {
+    return background;
+  }
+};
+
+// Shades a hit on object I; terms whose albedo is zero are never traced.
+template <size_t I, unsigned kDepth>
+struct Shader {
+  static Vector Shade(const Vector& background,
+                      const Vector& orig, const Vector& dir, float dist) {
+    constexpr float kRefractiveIndex = MaterialOf(I).refractive_index;
+    constexpr float kDiffuseAlbedo = MaterialOf(I).albedo[0];
+    constexpr float kSpecularAlbedo = MaterialOf(I).albedo[1];
+    constexpr float kReflectAlbedo = MaterialOf(I).albedo[2];
+    constexpr float kRefractAlbedo = MaterialOf(I).albedo[3];
+    constexpr unsigned kExponent =
+      static_cast<unsigned>(MaterialOf(I).specular_exponent);
+
+    Vector point = orig + dir * dist;
+    Vector norm, diffuse_color;
+    Surface<I>::At(point, norm, diffuse_color);
+
+    Vector reflect_color, refract_color;
+    if (kReflectAlbedo != 0.0f) {
+      Vector reflect_dir = Reflect(dir, norm).Normalize();
+      Vector reflect_orig = reflect_dir * norm < 0 ?
+        point - norm * 1e-3f : point + norm * 1e-3f;
+      reflect_color = Tracer<kDepth + 1>::CastRay(background, reflect_orig,
+                                                  reflect_dir);
+    }
+    if (kRefractAlbedo != 0.0f) {
+      Vector refract_dir = Refract(dir, norm, kRefractiveIndex).Normalize();
+      Vector refract_orig = refract_dir * norm < 0 ?
+        point - norm * 1e-3f : point + norm * 1e-3f;
+      refract_color = Tracer<kDepth + 1>::CastRay(background, refract_orig,
+                                                  refract_dir);
+    }
+
+    float diffuse_light_intensity = 0, specular_light_intensity = 0;
+    LightLoop<0, kLightCount, kExponent, kSpecularAlbedo != 0.0f>::Accumulate(
+      point, norm, dir, diffuse_light_intensity, specular_light_intensity);
+
+    Vector color = diffuse_color * diffuse_light_intensity * kDiffuseAlbedo;
+    if (kSpecularAlbedo != 0.0f) {
+      color = color + Vector(1., 1., 1.) * specular_light_intensity *
+        kSpecularAlbedo;
+    }
+    if (kReflectAlbedo != 0.0f) {
+      color = color + reflect_color * kReflectAlbedo;
+    }
+    if (kRefractAlbedo != 0.0f) {
+      color = color + refract_color * kRefractAlbedo;
+    }
+    return color;
+  }
+};
+
+template <size_t I, unsigned kDepth>
+struct ShadeDispatch {
+  static Vector Shade(size_t index, const Vector& background,
+                      const Vector& orig, const Vector& dir, float dist) {
+    return index == I ?
+      Shader<I, kDepth>::Shade(background, orig, dir, dist) :
+      ShadeDispatch<I + 1, kDepth>::Shade(index, background, orig, dir, dist);
+  }
+};
+
+template <unsigned kDepth>
+struct ShadeDispatch<kObjectCount - 1, kDepth> {
+  static Vector Shade(size_t, const Vector& background,
+                      const Vector& orig, const Vector& dir, float dist) {
+    return Shader<kObjectCount - 1, kDepth>::Shade(background, orig, dir,
+                                                   dist);
+  }
+};
+
+template <unsigned kDepth>
+Vector Tracer<kDepth>::CastRay(const Vector& background,
+                               const Vector& orig, const Vector& dir,
+                               uint32_t mask) {
+  float dist = 0.0f;
+  size_t index = 0;
+  if (!SceneIntersect(orig, dir, dist, index, mask)) {
+    return background;
+  }
+  return ShadeDispatch<0, kDepth>::Shade(index, background, orig, dir, dist);
+}
+
+bool Render(const std::vector<Sphere>& spheres,
+            const std::vector<Box>& boxes,
+            const std::vector<Light>& lights,
+            const Camera& camera,
+            Framebuffer& image,
+            int w, int h) {
+  assert(image.size() == w * h);
+  if (!MatchesBakedScene(spheres, boxes, lights)) {
+    return false;
+  }
+  arena::Scope scope;
+  const culling::Precomputed scene = culling::Precompute(spheres, boxes,
+                                                         camera, w, h);
+  const int tile_count = scene.tiles_x * scene.tiles_y;
+  arena::Buffer<uint32_t> masks(tile_count, 0);
+  for (int t = 0; t < tile_count; ++t) {
+    for (const int* i = scene.begin(t); i != scene.end(t); ++i) {
+      if (*i < static_cast<int>(kSphereCount)) {
+        masks[t] |= 1u << *i;
+      }
+    }
+  }
+
+  #pragma omp parallel for
+  for (int i = 0; i < h; ++i) {
+    for (int j = 0; j < w; ++j) {
+      // A ray missing the scene keeps the background.
+      const Vector dir = camera.Direction(i, j, w, h).Normalize();
+      if (!culling::Hits(scene.bounds, camera.position(), dir)) {
+        continue;
+      }
+      image[i * w + j] = Tracer<0>::CastRay(image[i * w + j],
+                                            camera.position(), dir,
+                                            masks[scene.GetTile(i, j)]);
+    }
+  }
+  return true;
+}
+
+} // namespace baked
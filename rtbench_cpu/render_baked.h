@@ -0,0 +1,26 @@
+#ifndef RTBENCH_RENDER_BAKED_H_
+#define RTBENCH_RENDER_BAKED_H_
+
+#include <vector>
+
+#include "common/box.h"
+#include "common/camera.h"
+#include "common/framebuffer.h"
+#include "common/light.h"
+#include "common/sphere.h"
+
+namespace baked {
+
+// Renders the benchmark scene baked in at compile time; spheres, boxes and
+// lights are only checked to match the baked description. Returns false
+// without rendering when they do not.
+bool Render(const std::vector<Sphere>& spheres,
+            const std::vector<Box>& boxes,
+            const std::vector<Light>& lights,
+            const Camera& camera,
+            Framebuffer& image,
+            int w, int h);
+
+} // namespace baked
+
+#endif // RTBENCH_RENDER_BAKED_H_
@@ -0,0 +1,574 @@
+#include "render_interleaved.h"
+
+#include <algorithm>
+#include <limits>
+#include <numeric>
+#include <vector>
+
+#include <assert.h>
+#define _USE_MATH_DEFINES
+#include <math.h>
+#include <immintrin.h>
+
+#include "culling.h"
+
+namespace interleaved {
+
+namespace {
+
+const int kLeafSize = 4;
+const int kMaxDepth = 4;
+const int kStackSize = 64;
+const float kFar = 1000.0f;
+
+// A reflected or refracted ray still to trace. Colors are linear in the
+// albedo weights, so a pixel adds up weighted rays instead of recursing.
+struct Ray {
+  Vector orig;
+  Vector dir;
+  float weight;
+  int depth;
+};
+
+// A node pair (count 0) or a leaf, with the distance at which the ray
+// enters its box.
+struct Item {
+  int32_t first;
+  int32_t count;
+  float t;
+};
+
+enum class Phase {
+  kNextRay,
+  kClosest,
+  kLight,
+  kShadow
+};
+
+// State of one pixel between two resumptions.
+struct Pixel {
+  int index;
+  Phase phase;
+  Vector background;
+  Vector color;
+  // Each bounce takes one ray and adds at most two.
+  Ray rays[kMaxDepth + 2];
+  int ray_count;
+  Ray ray;
+
+  // Traversal of the current closest hit or shadow ray.
+  Vector orig;
+  Vector dir;
+  Vector inv_dir;
+  Item stack[kStackSize];
+  int stack_size;
+  float t_max;
+  // Leaf index of the nearest sphere or box hit so far, -1 for none.
+  int nearest;
+  int nearest_box;
+  bool occluded;
+
+  // Shading of the current hit.
+  Vector point;
+  Vector norm;
+  Material material;
+  size_t light;
+  float light_distance;
+  Vector light_dir;
+  float diffuse;
+  float specular;
+};
+
+struct Context {
+  const Bvh& bvh;
+  const std::vector<Sphere>& spheres;
+  const std::vector<Light>& lights;
+};
+
+Vector Reflect(const Vector& i, const Vector& n) {
+  return i - n * 2.0f * (i * n);
+}
+
+Vector Refract(const Vector& i, const Vector& n,
+               const float eta_t, const float eta_i = 1.f) {
+  float cosi = -std::max(-1.0f, std::min(1.0f, i * n));
+  if (cosi < 0) return Refract(i, -n, eta_i, eta_t);
+  float eta = eta_i / eta_t;
+  float k = 1 - eta * eta * (1 - cosi * cosi);
+  return k < 0 ? Vector(1.0f, 0.0f, 0.0f) :
+    i * eta + n * (eta * cosi - sqrtf(k));
+}
+
+// Same test as the baseline, on a center with the radius in w.
+bool RayIntersect(const Vector& sphere, const Vector& orig,
+                  const Vector& dir, float& t0) {
+  Vector L = Vector(sphere.x(), sphere.y(), sphere.z()) - orig;
+  float tca = L * dir;
+  float d2 = L * L - tca * tca;
+  float r2 = sphere.w() * sphere.w();
+  if (d2 > r2) {
+    return false;
+  }
+  float thc = sqrtf(r2 - d2);
+  t0 = tca - thc;
+  float t1 = tca + thc;
+  if (t0 < 0) {
+    t0 = t1;
+  }
+  if (t0 < 0) {
+    return false;
+  }
+  return true;
+}
+
+bool RayIntersect(const Box& box, const Vector& orig, const Vector& dir,
+                  float& t0) {
+  const int axis = box.flat_axis();
+  if (axis >= 0) {
+    float t = (box.min().data()[axis] - orig.data()[axis]) / dir.data()[axis];
+    if (!(t > 0)) {
+      return false;
+    }
+    Vector pt = orig + dir * t;
+    for (int k = 0; k < 3; ++k) {
+      if (k != axis && !(pt.data()[k] >= box.min().data()[k] &&
+                         pt.data()[k] <= box.max().data()[k])) {
+        return false;
+      }
+    }
+    t0 = t;
+    return true;
+  }
+
+  float t_near = -std::numeric_limits<float>::max();
+  float t_far = std::numeric_limits<float>::max();
+  for (int k = 0; k < 3; ++k) {
+    float ta = (box.min().data()[k] - orig.data()[k]) / dir.data()[k];
+    float tb = (box.max().data()[k] - orig.data()[k]) / dir.data()[k];
+    t_near = std::max(t_near, std::min(ta, tb));
+    t_far = std::min(t_far, std::max(ta, tb));
+  }
+  if (t_near > t_far || t_far <= 0) {
+    return false;
+  }
+  t0 = t_near > 0 ? t_near : t_far;
+  return true;
+}
+
+bool Enter(const Bvh::Node& node, const Pixel& pixel, float& t) {
+  float t_near = 0.0f;
+  float t_far = pixel.t_max;
+  for (int k = 0; k < 3; ++k) {
+    float ta = (node.min[k] - pixel.orig.data()[k]) * pixel.inv_dir.data()[k];
+    float tb = (node.max[k] - pixel.orig.data()[k]) * pixel.inv_dir.data()[k];
+    t_near = std::max(t_near, std::min(ta, tb));
+    t_far = std::min(t_far, std::max(ta, tb));
+  }
+  t = t_near;
+  return t_near <= t_far;
+}
+
+// Pushes a child and requests its line, which is read only after the other
+// pixels of the group had their turn. The entry is always written and the
+// top only moves when the ray enters the child: interleaved pixels do not
+// share a branch history, so branches here would mostly mispredict.
+void Push(Pixel& pixel, const Context& context, const Bvh::Node& node,
+          float t, bool enter) {
+  assert(pixel.stack_size < kStackSize);
+  pixel.stack[pixel.stack_size] = { node.first, node.count, t };
+  const char* line = node.count > 0 ?
+    reinterpret_cast<const char*>(context.bvh.spheres() + node.first) :
+    node.count < 0 ?
+    reinterpret_cast<const char*>(context.bvh.boxes() + node.first) :
+    reinterpret_cast<const char*>(context.bvh.nodes() + node.first);
+  line = enter ? line : reinterpret_cast<const char*>(&pixel);
+  // A sphere leaf may straddle two lines, a pair never does. Box leaves
+  // are larger, their first two lines are fetched.
+  _mm_prefetch(line, _MM_HINT_T0);
+  _mm_prefetch(line + 63, _MM_HINT_T0);
+  pixel.stack_size += enter ? 1 : 0;
+}
+
+void StartTraversal(Pixel& pixel, const Context& context, const Vector& orig,
+                    const Vector& dir, float t_max) {
+  pixel.orig = orig;
+  pixel.dir = dir;
+  pixel.inv_dir = Vector(1.0f / dir.x(), 1.0f / dir.y(), 1.0f / dir.z());
+  pixel.t_max = t_max;
+  pixel.nearest = -1;
+  pixel.nearest_box = -1;
+  pixel.occluded = false;
+  pixel.stack_size = 0;
+  // The root pair is the root and an empty node.
+  const Bvh::Node root = { { 0.0f }, 0, { 0.0f }, 0 };
+  Push(pixel, context, root, 0.0f, true);
+}
+
+// Visits one stack entry, returns false once the traversal is done. Any
+// hit ends a shadow traversal.
+bool Visit(Pixel& pixel, const Context& context, bool shadow) {
+  while (pixel.stack_size > 0) {
+    const Item item = pixel.stack[--pixel.stack_size];
+    if (!(item.t < pixel.t_max)) {
+      continue;
+    }
+
+    if (item.count > 0) {
+      const Vector* spheres = context.bvh.spheres();
+      for (int k = item.first; k < item.first + item.count; ++k) {
+        float dist = 0.0f;
+        if (RayIntersect(spheres[k], pixel.orig, pixel.dir, dist) &&
+            dist < pixel.t_max) {
+          if (shadow) {
+            pixel.occluded = true;
+            pixel.stack_size = 0;
+            return false;
+          }
+          pixel.t_max = dist;
+          pixel.nearest = k;
+          pixel.nearest_box = -1;
+        }
+      }
+    } else if (item.count < 0) {
+      const Box* boxes = context.bvh.boxes();
+      for (int k = item.first; k < item.first - item.count; ++k) {
+        float dist = 0.0f;
+        if (RayIntersect(boxes[k], pixel.orig, pixel.dir, dist) &&
+            dist < pixel.t_max) {
+          if (shadow) {
+            pixel.occluded = true;
+            pixel.stack_size = 0;
+            return false;
+          }
+          pixel.t_max = dist;
+          pixel.nearest = -1;
+          pixel.nearest_box = k;
+        }
+      }
+    } else {
+      const Bvh::Node* pair = context.bvh.nodes() + item.first;
+      float t0 = 0.0f, t1 = 0.0f;
+      bool hit0 = Enter(pair[0], pixel, t0);
+      bool hit1 = Enter(pair[1], pixel, t1);
+      // The nearer child goes on top.
+      const bool swap = hit0 && hit1 && t0 < t1;
+      Push(pixel, context, pair[swap ? 1 : 0], swap ? t1 : t0,
+           swap ? hit1 : hit0);
+      Push(pixel, context, pair[swap ? 0 : 1], swap ? t0 : t1,
+           swap ? hit0 : hit1);
+    }
+    return pixel.stack_size > 0;
+  }
+  return false;
+}
+
+// Runs a pixel until it has to wait for memory. Returns false when the
+// pixel color is complete.
+bool Resume(Pixel& pixel, const Context& context) {
+  for (;;) {
+    switch (pixel.phase) {
+      case Phase::kNextRay: {
+        if (pixel.ray_count == 0) {
+          return false;
+        }
+        pixel.ray = pixel.rays[--pixel.ray_count];
+        if (pixel.ray.depth > kMaxDepth) {
+          pixel.color = pixel.color + pixel.background * pixel.ray.weight;
+          break;
+        }
+        StartTraversal(pixel, context, pixel.ray.orig, pixel.ray.dir, kFar);
+        pixel.phase = Phase::kClosest;
+        return true;
+      }
+
+      case Phase::kClosest: {
+        if (Visit(pixel, context, false)) {
+          return true;
+        }
+        const Ray& ray = pixel.ray;
+        if (pixel.nearest_box >= 0) {
+          const Box& box = context.bvh.boxes()[pixel.nearest_box];
+          pixel.point = ray.orig + ray.dir * pixel.t_max;
+          pixel.norm = box.Normal(pixel.point);
+          pixel.material = box.MaterialAt(pixel.point);
+        } else if (pixel.nearest >= 0) {
+          const Vector& sphere = context.bvh.spheres()[pixel.nearest];
+          pixel.point = ray.orig + ray.dir * pixel.t_max;
+          pixel.norm = (pixel.point -
+                        Vector(sphere.x(), sphere.y(), sphere.z())).Normalize();
+          pixel.material = context.spheres[
+            context.bvh.indices()[pixel.nearest]].material();
+        } else {
+          pixel.color = pixel.color + pixel.background * ray.weight;
+          pixel.phase = Phase::kNextRay;
+          break;
+        }
+
+        const Vector& point = pixel.point;
+        const Vector& norm = pixel.norm;
+        const Vector albedo = pixel.material.albedo();
+        if (albedo.z() != 0.0f) {
+          Vector reflect_dir = Reflect(ray.dir, norm).Normalize();
+          Vector reflect_orig = reflect_dir * norm < 0 ?
+            point - norm * 1e-3f : point + norm * 1e-3f;
+          assert(pixel.ray_count < kMaxDepth + 2);
+          pixel.rays[pixel.ray_count++] = {
+            reflect_orig, reflect_dir, ray.weight * albedo.z(), ray.depth + 1
+          };
+        }
+        if (albedo.w() != 0.0f) {
+          Vector refract_dir = Refract(
+            ray.dir, norm, pixel.material.refractive_index()).Normalize();
+          Vector refract_orig = refract_dir * norm < 0 ?
+            point - norm * 1e-3f : point + norm * 1e-3f;
+          assert(pixel.ray_count < kMaxDepth + 2);
+          pixel.rays[pixel.ray_count++] = {
+            refract_orig, refract_dir, ray.weight * albedo.w(), ray.depth + 1
+          };
+        }
+        pixel.light = 0;
+        pixel.diffuse = 0.0f;
+        pixel.specular = 0.0f;
+        pixel.phase = Phase::kLight;
+        break;
+      }
+
+      case Phase::kLight: {
+        const Vector& point = pixel.point;
+        const Vector& norm = pixel.norm;
+        if (pixel.light == context.lights.size()) {
+          const Material& material = pixel.material;
+          pixel.color = pixel.color +
+            (material.diffuse_color() * pixel.diffuse * material.albedo().x() +
+             Vector(1., 1., 1.) * pixel.specular * material.albedo().y()) *
+            pixel.ray.weight;
+          pixel.phase = Phase::kNextRay;
+          break;
+        }
+
+        const Light& light = context.lights[pixel.light];
+        pixel.light_dir = (light.position() - point).Normalize();
+        pixel.light_distance = (light.position() - point).norm();
+        Vector shadow_orig = pixel.light_dir * norm < 0 ?
+          point - norm * 1e-3f : point + norm * 1e-3f;
+        const float limit = std::min(pixel.light_distance, kFar);
+        StartTraversal(pixel, context, shadow_orig, pixel.light_dir, limit);
+        pixel.phase = Phase::kShadow;
+        return true;
+      }
+
+      case Phase::kShadow: {
+        if (Visit(pixel, context, true)) {
+          return true;
+        }
+        if (!pixel.occluded) {
+          const Light& light = context.lights[pixel.light];
+          pixel.diffuse += light.intensity() *
+            std::max(0.f, pixel.light_dir * pixel.norm);
+          pixel.specular += powf(
+            std::max(0.0f, -Reflect(-pixel.light_dir, pixel.norm) *
+                     pixel.ray.dir),
+            pixel.material.specular_exponent()) * light.intensity();
+        }
+        ++pixel.light;
+        pixel.phase = Phase::kLight;
+        break;
+      }
+    }
+  }
+}
+
+} // namespace
+
+void Bvh::Build(const std::vector<Sphere>& spheres,
+                const std::vector<Box>& boxes) {
+  const int count = static_cast<int>(spheres.size());
+  spheres_.resize(count);
+  std::vector<Primitive> primitives(count);
+  for (int i = 0; i < count; ++i) {
+    const Vector center = spheres[i].center();
+    const float radius = spheres[i].radius();
+    spheres_[i] = Vector(center.x(), center.y(), center.z(), radius);
+    for (int k = 0; k < 3; ++k) {
+      primitives[i].min[k] = center.data()[k] - radius;
+      primitives[i].max[k] = center.data()[k] + radius;
+      primitives[i].center[k] = center.data()[k];
+    }
+  }
+
+  // The root pair is the sphere tree and the box tree; a tree with nothing
+  // in it is a point at infinity that no ray enters.
+  const Node empty = {
+    { INFINITY, INFINITY, INFINITY }, 0, { INFINITY, INFINITY, INFINITY }, 0
+  };
+  nodes_.assign(2, empty);
+  // Median splits leave at least half full leaves.
+  nodes_.reserve(4 * ((count + boxes.size()) / kLeafSize + 2));
+  std::vector<uint32_t> order = BuildTree(primitives, 0, 1);
+
+  // Leaf spheres are stored in traversal order.
+  std::vector<Vector, numa::Allocator<Vector>> sorted(count);
+  for (int i = 0; i < count; ++i) {
+    sorted[i] = spheres_[order[i]];
+  }
+  spheres_.swap(sorted);
+  indices_.assign(order.begin(), order.end());
+
+  primitives.resize(boxes.size());
+  for (size_t i = 0; i < boxes.size(); ++i) {
+    for (int k = 0; k < 3; ++k) {
+      primitives[i].min[k] = boxes[i].min().data()[k];
+      primitives[i].max[k] = boxes[i].max().data()[k];
+      primitives[i].center[k] = 0.5f * (primitives[i].min[k] +
+                                        primitives[i].max[k]);
+    }
+  }
+  order = BuildTree(primitives, 1, -1);
+  boxes_.clear();
+  for (size_t i = 0; i < order.size(); ++i) {
+    boxes_.push_back(boxes[order[i]]);
+  }
+}
+
+std::vector<uint32_t> Bvh::BuildTree(const std::vector<Primitive>& primitives,
+                                     int root, int count_sign) {
+  const int count = static_cast<int>(primitives.size());
+  std::vector<uint32_t> order(count);
+  std::iota(order.begin(), order.end(), 0);
+  std::vector<std::pair<int, int>> ranges(1, std::make_pair(0, count));
+  std::vector<int> targets(1, root);
+  while (!ranges.empty()) {
+    const int begin = ranges.back().first;
+    const int end = ranges.back().second;
+    const int target = targets.back();
+    ranges.pop_back();
+    targets.pop_back();
+    if (begin == end) {
+      continue;
+    }
+
+    Node node = {
+      { INFINITY, INFINITY, INFINITY }, 0,
+      { -INFINITY, -INFINITY, -INFINITY }, 0
+    };
+    for (int i = begin; i < end; ++i) {
+      const Primitive& primitive = primitives[order[i]];
+      for (int k = 0; k < 3; ++k) {
+        node.min[k] = std::min(node.min[k], primitive.min[k]);
+        node.max[k] = std::max(node.max[k], primitive.max[k]);
+      }
+    }
+    if (end - begin <= kLeafSize) {
+      node.first = begin;
+      node.count = count_sign * (end - begin);
+    } else {
+      const int middle = Split(primitives, order, begin, end);
+      node.first = static_cast<int32_t>(nodes_.size());
+      nodes_.resize(nodes_.size() + 2);
+      ranges.push_back(std::make_pair(begin, middle));
+      targets.push_back(node.first);
+      ranges.push_back(std::make_pair(middle, end));
+      targets.push_back(node.first + 1);
+    }
+    nodes_[target] = node;
+  }
+  return order;
+}
+
+// Median of the centers along the axis where they spread the most.
+int Bvh::Split(const std::vector<Primitive>& primitives,
+               std::vector<uint32_t>& order, int begin, int end) {
+  float min[3] = { INFINITY, INFINITY, INFINITY };
+  float max[3] = { -INFINITY, -INFINITY, -INFINITY };
+  for (int i = begin; i < end; ++i) {
+    for (int k = 0; k < 3; ++k) {
+      min[k] = std::min(min[k], primitives[order[i]].center[k]);
+      max[k] = std::max(max[k], primitives[order[i]].center[k]);
+    }
+  }
+  int axis = 0;
+  for (int k = 1; k < 3; ++k) {
+    if (max[k] - min[k] > max[axis] - min[axis]) {
+      axis = k;
+    }
+  }
+
+  const int middle = begin + (end - begin) / 2;
+  std::nth_element(order.begin() + begin, order.begin() + middle,
+                   order.begin() + end,
+                   [&primitives, axis](uint32_t a, uint32_t b) {
+                     return primitives[a].center[axis] <
+                       primitives[b].center[axis];
+                   });
+  return middle;
+}
+
+void Render(const Bvh& bvh,
+            const std::vector<Sphere>& spheres,
+            const std::vector<Box>& boxes,
+            const std::vector<Light>& lights,
+            const Camera& camera,
+            Framebuffer& image,
+            int w, int h,
+            int group) {
+  assert(image.size() == w * h);
+  assert(group > 0 && group <= kMaxGroup);
+  const Context context = { bvh, spheres, lights };
+  const culling::Bounds bounds = culling::GetBounds(spheres, boxes);
+
+  #pragma omp parallel for schedule(dynamic)
+  for (int i = 0; i < h; ++i) {
+    Pixel pixels[kMaxGroup];
+    for (int s = 0; s < group; ++s) {
+      pixels[s].index = -1;
+    }
+
+    // Round robin over the group; a finished pixel hands its slot to the
+    // next pixel of the row.
+    int next = 0;
+    bool active = true;
+    while (active) {
+      active = false;
+      for (int s = 0; s < group; ++s) {
+        Pixel& pixel = pixels[s];
+        if (pixel.index < 0) {
+          Vector dir;
+          for (; next < w; ++next) {
+            dir = camera.Direction(i, next, w, h).Normalize();
+            // Pixels whose ray misses the scene keep the background.
+            if (culling::Hits(bounds, camera.position(), dir)) {
+              break;
+            }
+          }
+          if (next == w) {
+            continue;
+          }
+          pixel.index = next++;
+          pixel.phase = Phase::kNextRay;
+          pixel.background = image[i * w + pixel.index];
+          pixel.color = Vector();
+          pixel.rays[0] = { camera.position(), dir, 1.0f, 0 };
+          pixel.ray_count = 1;
+        }
+        active = true;
+        if (!Resume(pixel, context)) {
+          image[i * w + pixel.index] = pixel.color;
+          pixel.index = -1;
+        }
+      }
+    }
+  }
+}
+
+void Render(const std::vector<Sphere>& spheres,
+            const std::vector<Box>& boxes,
+            const std::vector<Light>& lights,
+            const Camera& camera,
+            Framebuffer& image,
+            int w, int h) {
+  Bvh bvh;
+  bvh.Build(spheres, boxes);
+  Render(bvh, spheres, boxes, lights, camera, image, w, h, kDefaultGroup);
+}
+
+} // namespace interleaved
@@ -0,0 +1,111 @@
+#ifndef RTBENCH_RENDER_INTERLEAVED_H_
+#define RTBENCH_RENDER_INTERLEAVED_H_
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "common/box.h"
+#include "common/camera.h"
+#include "common/framebuffer.h"
+#include "common/light.h"
+#include "common/numa.h"
+#include "common/sphere.h"
+
+namespace interleaved {
+
+const int kDefaultGroup = 16;
+const int kMaxGroup = 32;
+
+// Bounding volume hierarchy over the spheres and the boxes. Children are
+// stored as adjacent pairs, so one cache line holds both bounds tested at a
+// step. The root pair holds the sphere tree and the box tree.
+class Bvh {
+ public:
+  struct Node {
+    float min[3];
+    // First node of the child pair, or first sphere or box of a leaf.
+    int32_t first;
+    float max[3];
+    // Spheres of a leaf, minus the boxes of a box leaf, 0 for inner nodes.
+    int32_t count;
+  };
+
+  void Build(const std::vector<Sphere>& spheres,
+             const std::vector<Box>& boxes);
+
+  const Node* nodes() const {
+    return nodes_.data();
+  }
+
+  size_t node_count() const {
+    return nodes_.size();
+  }
+
+  // Center and radius in w, in leaf order.
+  const Vector* spheres() const {
+    return spheres_.data();
+  }
+
+  // Index into the scene spheres of every leaf sphere.
+  const uint32_t* indices() const {
+    return indices_.data();
+  }
+
+  // Copies of the scene boxes, in leaf order.
+  const Box* boxes() const {
+    return boxes_.data();
+  }
+
+  size_t size_in_bytes() const {
+    return nodes_.size() * sizeof(Node) +
+      spheres_.size() * (sizeof(Vector) + sizeof(uint32_t)) +
+      boxes_.size() * sizeof(Box);
+  }
+
+ private:
+  // Bounds and center of a sphere or box.
+  struct Primitive {
+    float min[3];
+    float max[3];
+    float center[3];
+  };
+
+  // Builds the tree of the primitives into node root, with leaves of
+  // boxes when count_sign is -1, and returns the primitives in leaf order.
+  std::vector<uint32_t> BuildTree(const std::vector<Primitive>& primitives,
+                                  int root, int count_sign);
+  static int Split(const std::vector<Primitive>& primitives,
+                   std::vector<uint32_t>& order, int begin, int end);
+
+  std::vector<Node, numa::Allocator<Node>> nodes_;
+  std::vector<Vector, numa::Allocator<Vector>> spheres_;
+  std::vector<uint32_t, numa::Allocator<uint32_t>> indices_;
+  std::vector<Box, numa::Allocator<Box>> boxes_;
+};
+
+// Every thread keeps a group of pixels in flight. A pixel is a resumable
+// function that walks its rays through the hierarchy one node pair or leaf
+// at a time, prefetches what it visits next and yields, so the other
+// pixels of the group run while the line is on its way. A group of 1 is
+// the plain one ray at a time traversal.
+void Render(const Bvh& bvh,
+            const std::vector<Sphere>& spheres,
+            const std::vector<Box>& boxes,
+            const std::vector<Light>& lights,
+            const Camera& camera,
+            Framebuffer& image,
+            int w, int h,
+            int group);
+
+// Builds the hierarchy for this frame and renders with the default group.
+void Render(const std::vector<Sphere>& spheres,
+            const std::vector<Box>& boxes,
+            const std::vector<Light>& lights,
+            const Camera& camera,
+            Framebuffer& image,
+            int w, int h);
+
+} // namespace interleaved
+
+#endif // RTBENCH_RENDER_INTERLEAVED_H_
@@ -0,0 +1,34 @@
+#include "render_scalar_avx2.h"
+
+#include <vector>
+
+#include "scalar.h"
+#include "scalar_avx2_kernels.h"
+
+namespace sequential_avx2 {
+
+void Render(const std::vector<Sphere>& spheres,
+            const std::vector<Box>& boxes,
+            const std::vector<Light>& lights,
+            const Camera& camera,
+            Framebuffer& image,
+            int w, int h) {
+  scalar::Render(spheres, boxes, lights, camera, image, w, h,
+                 RenderSequentialAvx2);
+}
+
+} // namespace sequential_avx2
+
+namespace baseline_avx2 {
+
+void Render(const std::vector<Sphere>& spheres,
+            const std::vector<Box>& boxes,
+            const std::vector<Light>& lights,
+            const Camera& camera,
+            Framebuffer& image,
+            int w, int h) {
+  scalar::Render(spheres, boxes, lights, camera, image, w, h,
+                 RenderBaselineAvx2);
+}
+
+} // namespace baseline_avx2
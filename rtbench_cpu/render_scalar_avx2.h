@@ -0,0 +1,40 @@
+#ifndef RTBENCH_RENDER_SCALAR_AVX2_H_
+#define RTBENCH_RENDER_SCALAR_AVX2_H_
+
+#include <vector>
+
+#include "common/box.h"
+#include "common/camera.h"
+#include "common/framebuffer.h"
+#include "common/light.h"
+#include "common/sphere.h"
+
+// The Sequential and Baseline versions with their kernels (scalar_kernels.h)
+// built again for /arch:AVX2 in scalar_avx2_kernels.cc, so the scalar math
+// gets VEX encoding on CPUs that have it while one binary still runs
+// everywhere. The kernels are built with /fp:strict: contracting multiplies
+// and adds into FMAs would change the pixels. Call only when
+// isa::UseAvx2() is true.
+namespace sequential_avx2 {
+
+void Render(const std::vector<Sphere>& spheres,
+            const std::vector<Box>& boxes,
+            const std::vector<Light>& lights,
+            const Camera& camera,
+            Framebuffer& image,
+            int w, int h);
+
+} // namespace sequential_avx2
+
+namespace baseline_avx2 {
+
+void Render(const std::vector<Sphere>& spheres,
+            const std::vector<Box>& boxes,
+            const std::vector<Light>& lights,
+            const Camera& camera,
+            Framebuffer& image,
+            int w, int h);
+
+} // namespace baseline_avx2
+
+#endif // RTBENCH_RENDER_SCALAR_AVX2_H_
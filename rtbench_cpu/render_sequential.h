@@ -3,14 +3,19 @@
 
 #include <vector>
 
+#include "common/box.h"
+#include "common/camera.h"
+#include "common/framebuffer.h"
 #include "common/light.h"
 #include "common/sphere.h"
 
 namespace sequential {
 
 void Render(const std::vector<Sphere>& spheres,
+            const std::vector<Box>& boxes,
             const std::vector<Light>& lights,
-            std::vector<Vector>& image,
+            const Camera& camera,
+            Framebuffer& image,
             int w, int h);
 
 } // namespace sequential
@@ -9,6 +9,9 @@
 #include <immintrin.h>
 #include <xmmintrin.h>
 
+#include "common/arena.h"
+#include "culling.h"
+
 namespace sse {
 
 inline __m128 Normalize(const __m128& v) {
@@ -72,58 +75,250 @@ inline bool RayIntersect(const Sphere& sphere, const __m128& vorig,
   return true;
 }
 
+// Slab test, all three axes at once, or for flat boxes the plane of the
+// flat axis and the hit point against the other two. The w lane is left
+// out of the reductions.
+inline bool RayIntersect(const Box& box, const __m128& vorig,
+                         const __m128& vdir, float& t0) {
+  const __m128 vmin = _mm_load_ps(box.min().data());
+  const __m128 vmax = _mm_load_ps(box.max().data());
+  __m128 vta = _mm_div_ps(_mm_sub_ps(vmin, vorig), vdir);
+  const int axis = box.flat_axis();
+  if (axis >= 0) {
+    alignas(16) float ta[4];
+    _mm_store_ps(ta, vta);
+    if (!(ta[axis] > 0)) {
+      return false;
+    }
+    __m128 vpt = _mm_add_ps(vorig, _mm_mul_ps(vdir, _mm_set_ps1(ta[axis])));
+    int inside = _mm_movemask_ps(_mm_and_ps(_mm_cmpge_ps(vpt, vmin),
+                                            _mm_cmple_ps(vpt, vmax)));
+    if ((inside | (1 << axis) | 8) != 15) {
+      return false;
+    }
+    t0 = ta[axis];
+    return true;
+  }
+
+  __m128 vtb = _mm_div_ps(_mm_sub_ps(vmax, vorig), vdir);
+  __m128 vnear = _mm_min_ps(vta, vtb);
+  __m128 vfar = _mm_max_ps(vta, vtb);
+  float t_near = std::max(std::max(vnear.m128_f32[0], vnear.m128_f32[1]),
+                          vnear.m128_f32[2]);
+  float t_far = std::min(std::min(vfar.m128_f32[0], vfar.m128_f32[1]),
+                         vfar.m128_f32[2]);
+  if (t_near > t_far || t_far <= 0) {
+    return false;
+  }
+  t0 = t_near > 0 ? t_near : t_far;
+  return true;
+}
+
+inline __m128 Select(const __m128& vmask, const __m128& va,
+                     const __m128& vb) {
+  return _mm_or_ps(_mm_and_ps(vmask, va), _mm_andnot_ps(vmask, vb));
+}
+
+// Primary rays share the camera origin, so L = center - orig and L * L are
+// computed once per frame for every sphere instead of once per ray.
+struct SharedOrigin {
+  __m128 vLx;
+  __m128 vLy;
+  __m128 vLz;
+  __m128 vLL;
+  __m128 vr2;
+};
+
+inline arena::Buffer<SharedOrigin> ShareOrigin(
+    const std::vector<Sphere>& spheres, const __m128& vorig) {
+  arena::Buffer<SharedOrigin> origins(spheres.size());
+  for (size_t i = 0; i < spheres.size(); i++) {
+    __m128 vL = _mm_sub_ps(_mm_load_ps(spheres[i].center().data()), vorig);
+    origins[i].vLx = _mm_set_ps1(vL.m128_f32[0]);
+    origins[i].vLy = _mm_set_ps1(vL.m128_f32[1]);
+    origins[i].vLz = _mm_set_ps1(vL.m128_f32[2]);
+    origins[i].vLL = _mm_dp_ps(vL, vL, 0xFF);
+    origins[i].vr2 = _mm_set_ps1(spheres[i].radius() * spheres[i].radius());
+  }
+  return origins;
+}
+
+// Box slabs relative to the shared origin, one axis per register.
+struct SharedBox {
+  __m128 vmin[3];
+  __m128 vmax[3];
+  int flat_axis;
+};
+
+inline arena::Buffer<SharedBox> ShareOrigin(const std::vector<Box>& boxes,
+                                            const __m128& vorig) {
+  arena::Buffer<SharedBox> origins(boxes.size());
+  for (size_t i = 0; i < boxes.size(); i++) {
+    __m128 vmin = _mm_sub_ps(_mm_load_ps(boxes[i].min().data()), vorig);
+    __m128 vmax = _mm_sub_ps(_mm_load_ps(boxes[i].max().data()), vorig);
+    origins[i].vmin[0] = _mm_shuffle_ps(vmin, vmin, _MM_SHUFFLE(0, 0, 0, 0));
+    origins[i].vmin[1] = _mm_shuffle_ps(vmin, vmin, _MM_SHUFFLE(1, 1, 1, 1));
+    origins[i].vmin[2] = _mm_shuffle_ps(vmin, vmin, _MM_SHUFFLE(2, 2, 2, 2));
+    origins[i].vmax[0] = _mm_shuffle_ps(vmax, vmax, _MM_SHUFFLE(0, 0, 0, 0));
+    origins[i].vmax[1] = _mm_shuffle_ps(vmax, vmax, _MM_SHUFFLE(1, 1, 1, 1));
+    origins[i].vmax[2] = _mm_shuffle_ps(vmax, vmax, _MM_SHUFFLE(2, 2, 2, 2));
+    origins[i].flat_axis = boxes[i].flat_axis();
+  }
+  return origins;
+}
+
+// Intersects four primary rays given in SoA layout with the candidate
+// spheres first to last of their tile and all boxes. Box i has index
+// spheres.size() + i, lanes without a hit keep max float distance and
+// index spheres.size() + boxes.size().
+inline void PrimaryIntersect(const arena::Buffer<SharedOrigin>& origins,
+                             const arena::Buffer<SharedBox>& boxes,
+                             const int* first, const int* last,
+                             const __m128& vdx, const __m128& vdy,
+                             const __m128& vdz,
+                             __m128& vdist, __m128& vnearest) {
+  vdist = _mm_set_ps1(std::numeric_limits<float>::max());
+  vnearest = _mm_set_ps1(static_cast<float>(origins.size() + boxes.size()));
+  for (const int* index = first; index != last; ++index) {
+    const int i = *index;
+    const SharedOrigin& origin = origins[i];
+    __m128 vtca = _mm_add_ps(_mm_add_ps(_mm_mul_ps(origin.vLx, vdx),
+                                        _mm_mul_ps(origin.vLy, vdy)),
+                             _mm_mul_ps(origin.vLz, vdz));
+    __m128 vd2 = _mm_sub_ps(origin.vLL, _mm_mul_ps(vtca, vtca));
+    __m128 vmask = _mm_cmple_ps(vd2, origin.vr2);
+    __m128 vthc = _mm_sqrt_ps(_mm_max_ps(_mm_sub_ps(origin.vr2, vd2),
+                                         _mm_set_ps1(0.0f)));
+    __m128 vt0 = _mm_sub_ps(vtca, vthc);
+    vt0 = Select(_mm_cmplt_ps(vt0, _mm_set_ps1(0.0f)),
+                 _mm_add_ps(vtca, vthc), vt0);
+    vmask = _mm_and_ps(vmask, _mm_cmpge_ps(vt0, _mm_set_ps1(0.0f)));
+    vmask = _mm_and_ps(vmask, _mm_cmplt_ps(vt0, vdist));
+    vdist = Select(vmask, vt0, vdist);
+    vnearest = Select(vmask, _mm_set_ps1(static_cast<float>(i)), vnearest);
+  }
+
+  const __m128 vdirs[3] = { vdx, vdy, vdz };
+  for (size_t i = 0; i < boxes.size(); i++) {
+    const SharedBox& box = boxes[i];
+    __m128 vt, vmask;
+    if (box.flat_axis >= 0) {
+      // Relative to the origin the hit point is just dir * t.
+      vt = _mm_div_ps(box.vmin[box.flat_axis], vdirs[box.flat_axis]);
+      vmask = _mm_cmpgt_ps(vt, _mm_set_ps1(0.0f));
+      for (int k = 0; k < 3; ++k) {
+        if (k != box.flat_axis) {
+          __m128 vp = _mm_mul_ps(vdirs[k], vt);
+          vmask = _mm_and_ps(vmask, _mm_and_ps(_mm_cmpge_ps(vp, box.vmin[k]),
+                                               _mm_cmple_ps(vp, box.vmax[k])));
+        }
+      }
+    } else {
+      __m128 vnear = _mm_set_ps1(-std::numeric_limits<float>::max());
+      __m128 vfar = _mm_set_ps1(std::numeric_limits<float>::max());
+      for (int k = 0; k < 3; ++k) {
+        __m128 vta = _mm_div_ps(box.vmin[k], vdirs[k]);
+        __m128 vtb = _mm_div_ps(box.vmax[k], vdirs[k]);
+        vnear = _mm_max_ps(vnear, _mm_min_ps(vta, vtb));
+        vfar = _mm_min_ps(vfar, _mm_max_ps(vta, vtb));
+      }
+      vt = Select(_mm_cmpgt_ps(vnear, _mm_set_ps1(0.0f)), vnear, vfar);
+      vmask = _mm_and_ps(_mm_cmple_ps(vnear, vfar),
+                         _mm_cmpgt_ps(vfar, _mm_set_ps1(0.0f)));
+    }
+    vmask = _mm_and_ps(vmask, _mm_cmplt_ps(vt, vdist));
+    vdist = Select(vmask, vt, vdist);
+    vnearest = Select(vmask,
+      _mm_set_ps1(static_cast<float>(origins.size() + i)), vnearest);
+  }
+}
+
+// Completes an intersection once the nearest object is known, indices past
+// the spheres are boxes: computes the hit point and normal, and evaluates
+// the box texture for this one hit.
+inline bool ResolveHit(const __m128& vorig, const __m128& vdir,
+                       const std::vector<Sphere>& spheres,
+                       const std::vector<Box>& boxes,
+                       size_t nearest, float dist,
+                       __m128& vhit, __m128& vnorm,
+                       Material& material) {
+  if (nearest < spheres.size()) {
+    vhit = _mm_add_ps(vorig, _mm_mul_ps(vdir, _mm_set_ps1(dist)));
+    vnorm = Normalize(
+      _mm_sub_ps(vhit, _mm_load_ps(spheres[nearest].center().data())));
+    material = spheres[nearest].material();
+  } else if (nearest - spheres.size() < boxes.size()) {
+    const Box& box = boxes[nearest - spheres.size()];
+    vhit = _mm_add_ps(vorig, _mm_mul_ps(vdir, _mm_set_ps1(dist)));
+    Vector hit;
+    _mm_store_ps(hit.data(), vhit);
+    vnorm = _mm_load_ps(box.Normal(hit).data());
+    material = box.MaterialAt(hit);
+  }
+
+  return dist < 1000.0f;
+}
+
 inline bool SceneIntersect(const __m128& vorig, const __m128& vdir,
                            const std::vector<Sphere>& spheres,
+                           const std::vector<Box>& boxes,
                            __m128& vhit, __m128& vnorm,
                            Material& material) {
-  float spheres_dist = std::numeric_limits<float>::max();
+  float dist = std::numeric_limits<float>::max();
+  size_t nearest = spheres.size() + boxes.size();
   for (size_t i = 0; i < spheres.size(); i++) {
     float dist_i = 0.0f;
-    if (RayIntersect(spheres[i], vorig, vdir, dist_i) &&
-        dist_i < spheres_dist) {
-      spheres_dist = dist_i;
-      vhit = _mm_add_ps(vorig, _mm_mul_ps(vdir, _mm_set_ps1(dist_i)));
-      vnorm = Normalize(
-        _mm_sub_ps(vhit, _mm_load_ps(spheres[i].center().data())));
-      material = spheres[i].material();
+    if (RayIntersect(spheres[i], vorig, vdir, dist_i) && dist_i < dist) {
+      dist = dist_i;
+      nearest = i;
     }
   }
-
-  float checkerboard_dist = std::numeric_limits<float>::max();
-  if (fabsf(vdir.m128_f32[1]) > 1e-3f) {
-    float d = -(vorig.m128_f32[1] + 4.0f) / vdir.m128_f32[1];
-    __m128 vpt = _mm_add_ps(vorig, _mm_mul_ps(vdir, _mm_set_ps1(d)));
-    
-    if (d > 0 && fabs(vpt.m128_f32[0]) < 10.0f &&
-        vpt.m128_f32[2] < -10.0f && vpt.m128_f32[2] > -30.0f &&
-        d < spheres_dist) {
-      checkerboard_dist = d;
-      vhit = vpt;
-      vnorm = _mm_set_ps(0.0f, 0.0f, 1.0f, 0.0f);
-      material.SetDiffuseColor(
-        (static_cast<int>(0.5f * vhit.m128_f32[0] + 1000.0f) +
-        (static_cast<int>(0.5f * vhit.m128_f32[2])) & 1) ?
-        Vector(0.3f, 0.3f, 0.3f) : Vector(0.3f, 0.2f, 0.1f));
+  for (size_t i = 0; i < boxes.size(); i++) {
+    float dist_i = 0.0f;
+    if (RayIntersect(boxes[i], vorig, vdir, dist_i) && dist_i < dist) {
+      dist = dist_i;
+      nearest = spheres.size() + i;
     }
   }
 
-  return std::min(spheres_dist, checkerboard_dist) < 1000.0f;
+  return ResolveHit(vorig, vdir, spheres, boxes, nearest, dist,
+                    vhit, vnorm, material);
 }
 
+__m128 Shade(const __m128& vbackground, const __m128& vdir,
+             const __m128& vpoint, const __m128& vnorm,
+             const Material& material,
+             const std::vector<Sphere>& spheres,
+             const std::vector<Box>& boxes,
+             const std::vector<Light>& lights,
+             size_t depth);
+
 __m128 CastRay(const __m128& vbackground,
                const __m128& vorig, const __m128& vdir,
                const std::vector<Sphere>& spheres,
+               const std::vector<Box>& boxes,
                const std::vector<Light>& lights,
                size_t depth = 0) {
   Material material;
   __m128 vpoint = _mm_set_ps1(0.0f);
   __m128 vnorm = _mm_set_ps1(0.0f);
 
-  if (depth > 4 || !SceneIntersect(vorig, vdir, spheres,
+  if (depth > 4 || !SceneIntersect(vorig, vdir, spheres, boxes,
                                    vpoint, vnorm, material)) {
     return vbackground;
   }
 
+  return Shade(vbackground, vdir, vpoint, vnorm, material,
+               spheres, boxes, lights, depth);
+}
+
+__m128 Shade(const __m128& vbackground, const __m128& vdir,
+             const __m128& vpoint, const __m128& vnorm,
+             const Material& material,
+             const std::vector<Sphere>& spheres,
+             const std::vector<Box>& boxes,
+             const std::vector<Light>& lights,
+             size_t depth) {
   __m128 vreflect_dir = Normalize(Reflect(vdir, vnorm));
   __m128 vrefract_dir = Normalize(Refract(vdir, vnorm,
                                           material.refractive_index()));
@@ -143,16 +338,16 @@ __m128 CastRay(const __m128& vbackground,
   }
 
   __m128 vreflect_color = CastRay(vbackground, vreflect_orig, vreflect_dir,
-                                 spheres, lights, depth + 1);
+                                 spheres, boxes, lights, depth + 1);
   __m128 vrefract_color = CastRay(vbackground, vrefract_orig, vrefract_dir,
-                                 spheres, lights, depth + 1);
+                                 spheres, boxes, lights, depth + 1);
 
   float diffuse_light_intensity = 0, specular_light_intensity = 0;
   for (size_t i = 0; i < lights.size(); i++) {
     __m128 vpos = _mm_load_ps(lights[i].position().data());
-    __m128 vlight_dir = Normalize(_mm_sub_ps(vpos, vpoint));
-    __m128 vlight_distance = _mm_sub_ps(vpos, vpoint);
-    vlight_distance = _mm_dp_ps(vlight_distance, vlight_distance, 0xFF);
+    __m128 vto_light = _mm_sub_ps(vpos, vpoint);
+    __m128 vlight_dir = Normalize(vto_light);
+    __m128 vlight_distance = _mm_dp_ps(vto_light, vto_light, 0xFF);
     vlight_distance = _mm_sqrt_ps(vlight_distance);
 
     __m128 vshadow_orig = _mm_dp_ps(vlight_dir, vnorm, 0xFF);
@@ -165,8 +360,9 @@ __m128 CastRay(const __m128& vbackground,
     Material tmpmaterial;
     __m128 vshadow_pt = _mm_set_ps1(0.0f);
     __m128 vshadow_n = _mm_set_ps1(0.0f);
-    bool intersected = SceneIntersect(vshadow_orig, vlight_dir, spheres,
-                                      vshadow_pt, vshadow_n, tmpmaterial);
+    bool intersected = SceneIntersect(vshadow_orig, vlight_dir,
+                                      spheres, boxes, vshadow_pt,
+                                      vshadow_n, tmpmaterial);
 
     __m128 vval = _mm_sub_ps(vshadow_pt, vshadow_orig);
     vval = _mm_dp_ps(vval, vval, 0xFF);
@@ -200,24 +396,56 @@ __m128 CastRay(const __m128& vbackground,
 
 
 void Render(const std::vector<Sphere>& spheres,
+            const std::vector<Box>& boxes,
             const std::vector<Light>& lights,
-            std::vector<Vector>& image,
+            const Camera& camera,
+            Framebuffer& image,
             int w, int h) {
   assert(image.size() == w * h);
-  const float kFov = static_cast<float>(M_PI / 3.0);
+  const PrimaryRays& rays = camera.GetPrimaryRays(w, h);
+  const __m128 vorig = _mm_load_ps(camera.position().data());
+  const Vector origin = camera.position();
+  arena::Scope scope;
+  const arena::Buffer<SharedOrigin> origins = ShareOrigin(spheres, vorig);
+  const arena::Buffer<SharedBox> box_origins = ShareOrigin(boxes, vorig);
+  const culling::Precomputed scene = culling::Precompute(spheres, boxes,
+                                                         camera, w, h);
 
   #pragma omp parallel for
   for (int i = 0; i < h; ++i) {
-    for (int j = 0; j < w; ++j) {
-      __m128 vdir = _mm_set_ps(0.0f, -h / (2.0f * tanf(kFov / 2.0f)),
-                               -(i + 0.5f) + h / 2.0f, (j + 0.5f) - w / 2.0f);
-      __m128 vpixel = _mm_load_ps(image[i * w + j].data());
-      vpixel = CastRay(vpixel,
-                       _mm_set_ps1(0.0f),
-                       Normalize(vdir),
-                       spheres,
-                       lights);
-      _mm_store_ps(image[i * w + j].data(), vpixel);
+    for (int j = 0; j < w; j += 4) {
+      size_t offset = static_cast<size_t>(i) * rays.stride + j;
+      __m128 vdirs[4] = { _mm_loadu_ps(rays.x.data() + offset),
+                          _mm_loadu_ps(rays.y.data() + offset),
+                          _mm_loadu_ps(rays.z.data() + offset),
+                          _mm_set_ps1(0.0f) };
+
+      // Pixels whose rays all miss the scene keep the background.
+      if (_mm_movemask_ps(culling::Hits(scene.bounds, origin, vdirs[0],
+                                        vdirs[1], vdirs[2])) == 0) {
+        continue;
+      }
+
+      const int tile = scene.GetTile(i, j);
+      __m128 vdist, vnearest;
+      PrimaryIntersect(origins, box_origins, scene.begin(tile),
+                       scene.end(tile), vdirs[0], vdirs[1], vdirs[2],
+                       vdist, vnearest);
+      _MM_TRANSPOSE4_PS(vdirs[0], vdirs[1], vdirs[2], vdirs[3]);
+
+      for (int k = 0; k < 4 && j + k < w; ++k) {
+        Material material;
+        __m128 vpoint = _mm_set_ps1(0.0f);
+        __m128 vnorm = _mm_set_ps1(0.0f);
+        __m128 vpixel = _mm_load_ps(image[i * w + j + k].data());
+        if (ResolveHit(vorig, vdirs[k], spheres, boxes,
+                       static_cast<size_t>(vnearest.m128_f32[k]),
+                       vdist.m128_f32[k], vpoint, vnorm, material)) {
+          vpixel = Shade(vpixel, vdirs[k], vpoint, vnorm, material,
+                         spheres, boxes, lights, 0);
+        }
+        _mm_store_ps(image[i * w + j + k].data(), vpixel);
+      }
     }
   }
 }
@@ -0,0 +1,459 @@
+#include "render_sse_fast.h"
+
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+#include <assert.h>
+#define _USE_MATH_DEFINES
+#include <math.h>
+#include <immintrin.h>
+#include <xmmintrin.h>
+
+#include "common/arena.h"
+#include "common/light_batch.h"
+#include "culling.h"
+
+namespace sse_fast {
+
+using fast_math::Accuracy;
+
+template <int kLane>
+inline float Lane(const __m128& v) {
+  return _mm_cvtss_f32(
+    _mm_shuffle_ps(v, v, _MM_SHUFFLE(kLane, kLane, kLane, kLane)));
+}
+
+// Ray directions and normals stay exact: any change in their last bit
+// flips silhouette pixels of the reflected and refracted images.
+inline __m128 Normalize(const __m128& v) {
+  return _mm_mul_ps(v, fast_math::Rsqrt<Accuracy::kExact>(
+    _mm_dp_ps(v, v, 0xFF)));
+}
+
+inline __m128 Reflect(const __m128& vi, const __m128& vn) {
+  __m128 vval = _mm_dp_ps(vi, vn, 0xFF);
+  vval = _mm_mul_ps(vval, _mm_set_ps1(2.0f));
+  vval = _mm_mul_ps(vval, vn);
+  vval = _mm_sub_ps(vi, vval);
+  return vval;
+}
+
+inline __m128 Refract(const __m128& vi, const __m128& vn,
+                      const float eta_t, const float eta_i = 1.f) {
+  float cosi = -std::max(-1.0f, std::min(1.0f,
+                                         _mm_cvtss_f32(_mm_dp_ps(vi, vn, 0xFF))));
+  if (cosi < 0) {
+    return Refract(vi, _mm_sub_ps(_mm_set_ps1(0.0f), vn), eta_i, eta_t);
+  }
+
+  float eta = eta_i / eta_t;
+  float k = 1 - eta * eta * (1 - cosi * cosi);
+  if (k < 0) {
+    return _mm_set_ps(0.0f, 0.0f, 0.0f, 1.0f);
+  } else {
+    __m128 vres = _mm_mul_ps(vi, _mm_set_ps1(eta));
+    float val = eta * cosi - sqrtf(k);
+    __m128 vval = _mm_mul_ps(vn, _mm_set_ps1(val));
+    vres = _mm_add_ps(vres, vval);
+    return vres;
+  }
+}
+
+inline __m128 Offset(const __m128& vpoint, const __m128& vnorm,
+                     const __m128& vdir) {
+  __m128 voffset = _mm_mul_ps(vnorm, _mm_set_ps1(1e-3f));
+  if (_mm_cvtss_f32(_mm_dp_ps(vdir, vnorm, 0xFF)) < 0) {
+    return _mm_sub_ps(vpoint, voffset);
+  }
+  return _mm_add_ps(vpoint, voffset);
+}
+
+inline bool RayIntersect(const Sphere& sphere, const __m128& vorig,
+                         const __m128& vdir, float& t0) {
+  __m128 vc = _mm_load_ps(sphere.center().data());
+  __m128 vL = _mm_sub_ps(vc, vorig);
+  float tca = _mm_cvtss_f32(_mm_dp_ps(vL, vdir, 0xFF));
+  float d2 = _mm_cvtss_f32(_mm_dp_ps(vL, vL, 0xFF)) - tca * tca;
+  float r2 = sphere.radius() * sphere.radius();
+  if (d2 > r2) {
+    return false;
+  }
+
+  float thc = sqrtf(r2 - d2);
+  t0 = tca - thc;
+  if (t0 < 0) {
+    t0 = tca + thc;
+  }
+  return t0 >= 0;
+}
+
+// Slab test, all three axes at once, or for flat boxes the plane of the
+// flat axis and the hit point against the other two. The w lane is left
+// out of the reductions.
+inline bool RayIntersect(const Box& box, const __m128& vorig,
+                         const __m128& vdir, float& t0) {
+  const __m128 vmin = _mm_load_ps(box.min().data());
+  const __m128 vmax = _mm_load_ps(box.max().data());
+  __m128 vta = _mm_div_ps(_mm_sub_ps(vmin, vorig), vdir);
+  const int axis = box.flat_axis();
+  if (axis >= 0) {
+    alignas(16) float ta[4];
+    _mm_store_ps(ta, vta);
+    if (!(ta[axis] > 0)) {
+      return false;
+    }
+    __m128 vpt = _mm_add_ps(vorig, _mm_mul_ps(vdir, _mm_set_ps1(ta[axis])));
+    int inside = _mm_movemask_ps(_mm_and_ps(_mm_cmpge_ps(vpt, vmin),
+                                            _mm_cmple_ps(vpt, vmax)));
+    if ((inside | (1 << axis) | 8) != 15) {
+      return false;
+    }
+    t0 = ta[axis];
+    return true;
+  }
+
+  __m128 vtb = _mm_div_ps(_mm_sub_ps(vmax, vorig), vdir);
+  __m128 vnear = _mm_min_ps(vta, vtb);
+  __m128 vfar = _mm_max_ps(vta, vtb);
+  float t_near = _mm_cvtss_f32(_mm_max_ss(
+    _mm_max_ss(vnear, _mm_movehdup_ps(vnear)), _mm_movehl_ps(vnear, vnear)));
+  float t_far = _mm_cvtss_f32(_mm_min_ss(
+    _mm_min_ss(vfar, _mm_movehdup_ps(vfar)), _mm_movehl_ps(vfar, vfar)));
+  if (t_near > t_far || t_far <= 0) {
+    return false;
+  }
+  t0 = t_near > 0 ? t_near : t_far;
+  return true;
+}
+
+// Primary rays share the camera origin, so L = center - orig and L * L are
+// computed once per frame for every sphere instead of once per ray.
+struct SharedOrigin {
+  __m128 vLx;
+  __m128 vLy;
+  __m128 vLz;
+  __m128 vLL;
+  __m128 vr2;
+};
+
+inline arena::Buffer<SharedOrigin> ShareOrigin(
+    const std::vector<Sphere>& spheres, const __m128& vorig) {
+  arena::Buffer<SharedOrigin> origins(spheres.size());
+  for (size_t i = 0; i < spheres.size(); i++) {
+    __m128 vL = _mm_sub_ps(_mm_load_ps(spheres[i].center().data()), vorig);
+    origins[i].vLx = _mm_shuffle_ps(vL, vL, _MM_SHUFFLE(0, 0, 0, 0));
+    origins[i].vLy = _mm_shuffle_ps(vL, vL, _MM_SHUFFLE(1, 1, 1, 1));
+    origins[i].vLz = _mm_shuffle_ps(vL, vL, _MM_SHUFFLE(2, 2, 2, 2));
+    origins[i].vLL = _mm_dp_ps(vL, vL, 0xFF);
+    origins[i].vr2 = _mm_set_ps1(spheres[i].radius() * spheres[i].radius());
+  }
+  return origins;
+}
+
+// Box slabs relative to the shared origin, one axis per register.
+struct SharedBox {
+  __m128 vmin[3];
+  __m128 vmax[3];
+  int flat_axis;
+};
+
+inline arena::Buffer<SharedBox> ShareOrigin(const std::vector<Box>& boxes,
+                                            const __m128& vorig) {
+  arena::Buffer<SharedBox> origins(boxes.size());
+  for (size_t i = 0; i < boxes.size(); i++) {
+    __m128 vmin = _mm_sub_ps(_mm_load_ps(boxes[i].min().data()), vorig);
+    __m128 vmax = _mm_sub_ps(_mm_load_ps(boxes[i].max().data()), vorig);
+    origins[i].vmin[0] = _mm_shuffle_ps(vmin, vmin, _MM_SHUFFLE(0, 0, 0, 0));
+    origins[i].vmin[1] = _mm_shuffle_ps(vmin, vmin, _MM_SHUFFLE(1, 1, 1, 1));
+    origins[i].vmin[2] = _mm_shuffle_ps(vmin, vmin, _MM_SHUFFLE(2, 2, 2, 2));
+    origins[i].vmax[0] = _mm_shuffle_ps(vmax, vmax, _MM_SHUFFLE(0, 0, 0, 0));
+    origins[i].vmax[1] = _mm_shuffle_ps(vmax, vmax, _MM_SHUFFLE(1, 1, 1, 1));
+    origins[i].vmax[2] = _mm_shuffle_ps(vmax, vmax, _MM_SHUFFLE(2, 2, 2, 2));
+    origins[i].flat_axis = boxes[i].flat_axis();
+  }
+  return origins;
+}
+
+// Intersects four primary rays given in SoA layout with the candidate
+// spheres first to last of their tile and all boxes. Box i has index
+// spheres.size() + i, lanes without a hit keep max float distance and
+// index spheres.size() + boxes.size().
+inline void PrimaryIntersect(const arena::Buffer<SharedOrigin>& origins,
+                             const arena::Buffer<SharedBox>& boxes,
+                             const int* first, const int* last,
+                             const __m128& vdx, const __m128& vdy,
+                             const __m128& vdz,
+                             __m128& vdist, __m128& vnearest) {
+  vdist = _mm_set_ps1(std::numeric_limits<float>::max());
+  vnearest = _mm_set_ps1(static_cast<float>(origins.size() + boxes.size()));
+  for (const int* index = first; index != last; ++index) {
+    const int i = *index;
+    const SharedOrigin& origin = origins[i];
+    __m128 vtca = _mm_add_ps(_mm_add_ps(_mm_mul_ps(origin.vLx, vdx),
+                                        _mm_mul_ps(origin.vLy, vdy)),
+                             _mm_mul_ps(origin.vLz, vdz));
+    __m128 vd2 = _mm_sub_ps(origin.vLL, _mm_mul_ps(vtca, vtca));
+    __m128 vmask = _mm_cmple_ps(vd2, origin.vr2);
+    __m128 vthc = _mm_sqrt_ps(_mm_max_ps(_mm_sub_ps(origin.vr2, vd2),
+                                         _mm_setzero_ps()));
+    __m128 vt0 = _mm_sub_ps(vtca, vthc);
+    vt0 = fast_math::Select(_mm_cmplt_ps(vt0, _mm_setzero_ps()),
+                            _mm_add_ps(vtca, vthc), vt0);
+    vmask = _mm_and_ps(vmask, _mm_cmpge_ps(vt0, _mm_setzero_ps()));
+    vmask = _mm_and_ps(vmask, _mm_cmplt_ps(vt0, vdist));
+    vdist = fast_math::Select(vmask, vt0, vdist);
+    vnearest = fast_math::Select(vmask, _mm_set_ps1(static_cast<float>(i)),
+                                 vnearest);
+  }
+
+  const __m128 vdirs[3] = { vdx, vdy, vdz };
+  for (size_t i = 0; i < boxes.size(); i++) {
+    const SharedBox& box = boxes[i];
+    __m128 vt, vmask;
+    if (box.flat_axis >= 0) {
+      // Relative to the origin the hit point is just dir * t.
+      vt = _mm_div_ps(box.vmin[box.flat_axis], vdirs[box.flat_axis]);
+      vmask = _mm_cmpgt_ps(vt, _mm_setzero_ps());
+      for (int k = 0; k < 3; ++k) {
+        if (k != box.flat_axis) {
+          __m128 vp = _mm_mul_ps(vdirs[k], vt);
+          vmask = _mm_and_ps(vmask, _mm_and_ps(_mm_cmpge_ps(vp, box.vmin[k]),
+                                               _mm_cmple_ps(vp, box.vmax[k])));
+        }
+      }
+    } else {
+      __m128 vnear = _mm_set_ps1(-std::numeric_limits<float>::max());
+      __m128 vfar = _mm_set_ps1(std::numeric_limits<float>::max());
+      for (int k = 0; k < 3; ++k) {
+        __m128 vta = _mm_div_ps(box.vmin[k], vdirs[k]);
+        __m128 vtb = _mm_div_ps(box.vmax[k], vdirs[k]);
+        vnear = _mm_max_ps(vnear, _mm_min_ps(vta, vtb));
+        vfar = _mm_min_ps(vfar, _mm_max_ps(vta, vtb));
+      }
+      vt = fast_math::Select(_mm_cmpgt_ps(vnear, _mm_setzero_ps()), vnear,
+                             vfar);
+      vmask = _mm_and_ps(_mm_cmple_ps(vnear, vfar),
+                         _mm_cmpgt_ps(vfar, _mm_setzero_ps()));
+    }
+    vmask = _mm_and_ps(vmask, _mm_cmplt_ps(vt, vdist));
+    vdist = fast_math::Select(vmask, vt, vdist);
+    vnearest = fast_math::Select(vmask,
+      _mm_set_ps1(static_cast<float>(origins.size() + i)), vnearest);
+  }
+}
+
+// Completes an intersection once the nearest object is known, indices past
+// the spheres are boxes: computes the hit point and normal, and evaluates
+// the box texture for this one hit.
+inline bool ResolveHit(const __m128& vorig, const __m128& vdir,
+                       const std::vector<Sphere>& spheres,
+                       const std::vector<Box>& boxes,
+                       size_t nearest, float dist,
+                       __m128& vhit, __m128& vnorm,
+                       Material& material) {
+  if (nearest < spheres.size()) {
+    vhit = _mm_add_ps(vorig, _mm_mul_ps(vdir, _mm_set_ps1(dist)));
+    vnorm = Normalize(
+      _mm_sub_ps(vhit, _mm_load_ps(spheres[nearest].center().data())));
+    material = spheres[nearest].material();
+  } else if (nearest - spheres.size() < boxes.size()) {
+    const Box& box = boxes[nearest - spheres.size()];
+    vhit = _mm_add_ps(vorig, _mm_mul_ps(vdir, _mm_set_ps1(dist)));
+    Vector hit;
+    _mm_store_ps(hit.data(), vhit);
+    vnorm = _mm_load_ps(box.Normal(hit).data());
+    material = box.MaterialAt(hit);
+  }
+
+  return dist < 1000.0f;
+}
+
+inline bool SceneIntersect(const __m128& vorig, const __m128& vdir,
+                           const std::vector<Sphere>& spheres,
+                           const std::vector<Box>& boxes,
+                           __m128& vhit, __m128& vnorm,
+                           Material& material) {
+  float dist = std::numeric_limits<float>::max();
+  size_t nearest = spheres.size() + boxes.size();
+  for (size_t i = 0; i < spheres.size(); i++) {
+    float dist_i = 0.0f;
+    if (RayIntersect(spheres[i], vorig, vdir, dist_i) && dist_i < dist) {
+      dist = dist_i;
+      nearest = i;
+    }
+  }
+  for (size_t i = 0; i < boxes.size(); i++) {
+    float dist_i = 0.0f;
+    if (RayIntersect(boxes[i], vorig, vdir, dist_i) && dist_i < dist) {
+      dist = dist_i;
+      nearest = spheres.size() + i;
+    }
+  }
+
+  return ResolveHit(vorig, vdir, spheres, boxes, nearest, dist,
+                    vhit, vnorm, material);
+}
+
+template <Accuracy A>
+__m128 Shade(const __m128& vbackground, const __m128& vdir,
+             const __m128& vpoint, const __m128& vnorm,
+             const Material& material,
+             const std::vector<Sphere>& spheres,
+             const std::vector<Box>& boxes,
+             const light_batch::Lights& lights,
+             size_t depth);
+
+template <Accuracy A>
+__m128 CastRay(const __m128& vbackground,
+               const __m128& vorig, const __m128& vdir,
+               const std::vector<Sphere>& spheres,
+               const std::vector<Box>& boxes,
+               const light_batch::Lights& lights,
+               size_t depth = 0) {
+  Material material;
+  __m128 vpoint = _mm_set_ps1(0.0f);
+  __m128 vnorm = _mm_set_ps1(0.0f);
+
+  if (depth > 4 || !SceneIntersect(vorig, vdir, spheres, boxes,
+                                   vpoint, vnorm, material)) {
+    return vbackground;
+  }
+
+  return Shade<A>(vbackground, vdir, vpoint, vnorm, material,
+                  spheres, boxes, lights, depth);
+}
+
+template <Accuracy A>
+__m128 Shade(const __m128& vbackground, const __m128& vdir,
+             const __m128& vpoint, const __m128& vnorm,
+             const Material& material,
+             const std::vector<Sphere>& spheres,
+             const std::vector<Box>& boxes,
+             const light_batch::Lights& lights,
+             size_t depth) {
+  __m128 vreflect_dir = Normalize(Reflect(vdir, vnorm));
+  __m128 vrefract_dir = Normalize(Refract(vdir, vnorm,
+                                             material.refractive_index()));
+  __m128 vreflect_color = CastRay<A>(vbackground,
+                                     Offset(vpoint, vnorm, vreflect_dir),
+                                     vreflect_dir, spheres, boxes, lights,
+                                     depth + 1);
+  __m128 vrefract_color = CastRay<A>(vbackground,
+                                     Offset(vpoint, vnorm, vrefract_dir),
+                                     vrefract_dir, spheres, boxes, lights,
+                                     depth + 1);
+
+  float diffuse_light_intensity = 0, specular_light_intensity = 0;
+  light_batch::Shade<A>(lights, vpoint, vnorm, vdir, material,
+                        diffuse_light_intensity, specular_light_intensity);
+
+  Vector albedo = material.albedo();
+  __m128 vdiffuse_color = _mm_load_ps(material.diffuse_color().data());
+  __m128 vres = _mm_mul_ps(vdiffuse_color,
+    _mm_set_ps1(diffuse_light_intensity * albedo.x()));
+  vres = _mm_add_ps(vres, _mm_mul_ps(_mm_set_ps(0.0f, 1.0f, 1.0f, 1.0f),
+    _mm_set_ps1(specular_light_intensity * albedo.y())));
+  vres = _mm_add_ps(vres, _mm_mul_ps(vreflect_color,
+                                     _mm_set_ps1(albedo.z())));
+  vres = _mm_add_ps(vres, _mm_mul_ps(vrefract_color,
+                                     _mm_set_ps1(albedo.w())));
+  return vres;
+}
+
+template <Accuracy A>
+void Render(const std::vector<Sphere>& spheres,
+            const std::vector<Box>& boxes,
+            const std::vector<Light>& lights,
+            const PrimaryRays& rays,
+            const culling::Precomputed& scene,
+            const Vector& origin,
+            Framebuffer& image,
+            int w, int h,
+            const light_batch::Settings& light_settings) {
+  const __m128 vorig = _mm_load_ps(origin.data());
+  arena::Scope scope;
+  const arena::Buffer<SharedOrigin> origins = ShareOrigin(spheres, vorig);
+  const arena::Buffer<SharedBox> box_origins = ShareOrigin(boxes, vorig);
+  const light_batch::Lights packed = light_batch::Pack(lights, spheres,
+                                                       boxes, light_settings);
+
+  #pragma omp parallel for
+  for (int i = 0; i < h; ++i) {
+    for (int j = 0; j < w; j += 4) {
+      size_t offset = static_cast<size_t>(i) * rays.stride + j;
+      __m128 vdirs[4] = { _mm_loadu_ps(rays.x.data() + offset),
+                          _mm_loadu_ps(rays.y.data() + offset),
+                          _mm_loadu_ps(rays.z.data() + offset),
+                          _mm_setzero_ps() };
+
+      // Pixels whose rays all miss the scene keep the background.
+      if (_mm_movemask_ps(culling::Hits(scene.bounds, origin, vdirs[0],
+                                        vdirs[1], vdirs[2])) == 0) {
+        continue;
+      }
+
+      const int tile = scene.GetTile(i, j);
+      __m128 vdist, vnearest;
+      PrimaryIntersect(origins, box_origins, scene.begin(tile),
+                       scene.end(tile), vdirs[0], vdirs[1], vdirs[2],
+                       vdist, vnearest);
+      _MM_TRANSPOSE4_PS(vdirs[0], vdirs[1], vdirs[2], vdirs[3]);
+
+      alignas(16) float dists[4], nearest[4];
+      _mm_store_ps(dists, vdist);
+      _mm_store_ps(nearest, vnearest);
+      for (int k = 0; k < 4 && j + k < w; ++k) {
+        Material material;
+        __m128 vpoint = _mm_setzero_ps();
+        __m128 vnorm = _mm_setzero_ps();
+        __m128 vpixel = _mm_load_ps(image[i * w + j + k].data());
+        if (ResolveHit(vorig, vdirs[k], spheres, boxes,
+                       static_cast<size_t>(nearest[k]), dists[k],
+                       vpoint, vnorm, material)) {
+          vpixel = Shade<A>(vpixel, vdirs[k], vpoint, vnorm, material,
+                            spheres, boxes, packed, 0);
+        }
+        _mm_store_ps(image[i * w + j + k].data(), vpixel);
+      }
+    }
+  }
+}
+
+bool Render(const std::vector<Sphere>& spheres,
+            const std::vector<Box>& boxes,
+            const std::vector<Light>& lights,
+            const Camera& camera,
+            Framebuffer& image,
+            int w, int h,
+            Accuracy accuracy,
+            const light_batch::Settings& light_settings) {
+  assert(image.size() == w * h);
+  const PrimaryRays& rays = camera.GetPrimaryRays(w, h);
+  arena::Scope scope;
+  const culling::Precomputed scene = culling::Precompute(spheres, boxes,
+                                                         camera, w, h);
+
+  switch (accuracy) {
+    case Accuracy::kExact:
+      Render<Accuracy::kExact>(spheres, boxes, lights, rays, scene,
+                               camera.position(), image, w, h,
+                               light_settings);
+      break;
+    case Accuracy::kFast:
+      Render<Accuracy::kFast>(spheres, boxes, lights, rays, scene,
+                              camera.position(), image, w, h,
+                              light_settings);
+      break;
+    case Accuracy::kFastest:
+      Render<Accuracy::kFastest>(spheres, boxes, lights, rays, scene,
+                                 camera.position(), image, w, h,
+                                 light_settings);
+      break;
+    default:
+      return false;
+  }
+  return true;
+}
+
+} // namespace sse_fast
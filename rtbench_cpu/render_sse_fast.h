@@ -0,0 +1,28 @@
+#ifndef RTBENCH_RENDER_SSE_FAST_H_
+#define RTBENCH_RENDER_SSE_FAST_H_
+
+#include <vector>
+
+#include "common/fast_math.h"
+#include "common/box.h"
+#include "common/camera.h"
+#include "common/framebuffer.h"
+#include "common/light.h"
+#include "common/light_batch.h"
+#include "common/sphere.h"
+
+namespace sse_fast {
+
+// Returns false and draws nothing for an unknown accuracy.
+bool Render(const std::vector<Sphere>& spheres,
+            const std::vector<Box>& boxes,
+            const std::vector<Light>& lights,
+            const Camera& camera,
+            Framebuffer& image,
+            int w, int h,
+            fast_math::Accuracy accuracy,
+            const light_batch::Settings& light_settings);
+
+} // namespace sse_fast
+
+#endif // RTBENCH_RENDER_SSE_FAST_H_
@@ -0,0 +1,609 @@
+#include "render_wavefront.h"
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <chrono>
+#include <limits>
+#include <vector>
+
+#include <assert.h>
+#define _USE_MATH_DEFINES
+#include <math.h>
+#include <immintrin.h>
+
+#include "common/arena.h"
+#include "common/ray_binning.h"
+#include "culling.h"
+
+namespace wavefront {
+
+const size_t kMaxDepth = 4;
+// Pixels of one band of the frame, and shadow slots of one chunk of a
+// bounce.
+const size_t kBandPixels = 1 << 18;
+const size_t kChunkSlots = 1 << 18;
+const int kLaneCount[16] = { 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4 };
+
+// SoA ray batch. Secondary rays carry their weight in r, shadow rays carry
+// the color they add to the pixel when unoccluded and the light distance.
+struct RayQueue {
+  size_t count = 0;
+  arena::Buffer<float> ox, oy, oz;
+  arena::Buffer<float> dx, dy, dz;
+  arena::Buffer<float> tmax;
+  arena::Buffer<float> r, g, b;
+  arena::Buffer<uint32_t> pixel;
+
+  // Storage is rounded up to whole packets, tail lanes are masked out.
+  void Resize(size_t n) {
+    count = n;
+    size_t padded = (n + 3) & ~static_cast<size_t>(3);
+    ox.resize(padded); oy.resize(padded); oz.resize(padded);
+    dx.resize(padded); dy.resize(padded); dz.resize(padded);
+    tmax.resize(padded);
+    r.resize(padded); g.resize(padded); b.resize(padded);
+    pixel.resize(padded);
+  }
+
+  void Set(size_t i, const Vector& orig, const Vector& dir, float t,
+           const Vector& color, uint32_t pixel_index) {
+    ox[i] = orig.x(); oy[i] = orig.y(); oz[i] = orig.z();
+    dx[i] = dir.x(); dy[i] = dir.y(); dz[i] = dir.z();
+    tmax[i] = t;
+    r[i] = color.x(); g[i] = color.y(); b[i] = color.z();
+    pixel[i] = pixel_index;
+  }
+
+  void Copy(size_t i, const RayQueue& from, size_t j) {
+    ox[i] = from.ox[j]; oy[i] = from.oy[j]; oz[i] = from.oz[j];
+    dx[i] = from.dx[j]; dy[i] = from.dy[j]; dz[i] = from.dz[j];
+    tmax[i] = from.tmax[j];
+    r[i] = from.r[j]; g[i] = from.g[j]; b[i] = from.b[j];
+    pixel[i] = from.pixel[j];
+  }
+
+  Vector Origin(size_t i) const {
+    return Vector(ox[i], oy[i], oz[i]);
+  }
+
+  Vector Direction(size_t i) const {
+    return Vector(dx[i], dy[i], dz[i]);
+  }
+
+  Vector Color(size_t i) const {
+    return Vector(r[i], g[i], b[i]);
+  }
+};
+
+struct Packet {
+  __m128 vox, voy, voz;
+  __m128 vdx, vdy, vdz;
+  __m128 vvalid;
+};
+
+static inline __m128 Select(const __m128& vmask, const __m128& va,
+                            const __m128& vb) {
+  return _mm_or_ps(_mm_and_ps(vmask, va), _mm_andnot_ps(vmask, vb));
+}
+
+static inline Packet LoadPacket(const RayQueue& queue, size_t first) {
+  Packet packet;
+  packet.vox = _mm_loadu_ps(queue.ox.data() + first);
+  packet.voy = _mm_loadu_ps(queue.oy.data() + first);
+  packet.voz = _mm_loadu_ps(queue.oz.data() + first);
+  packet.vdx = _mm_loadu_ps(queue.dx.data() + first);
+  packet.vdy = _mm_loadu_ps(queue.dy.data() + first);
+  packet.vdz = _mm_loadu_ps(queue.dz.data() + first);
+  float valid = static_cast<float>(queue.count - first);
+  packet.vvalid = _mm_cmplt_ps(_mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f),
+                               _mm_set_ps1(valid));
+  return packet;
+}
+
+// Returns per lane the distance to the sphere hit by the ray and computes
+// exactly the same L * dir and L * L as the scalar versions.
+static inline __m128 SphereDistance(const Sphere& sphere,
+                                    const Packet& packet,
+                                    __m128& vmask,
+                                    long long& packet_tests,
+                                    long long& rejected_tests,
+                                    long long& active_lanes) {
+  Vector center = sphere.center();
+  __m128 vLx = _mm_sub_ps(_mm_set_ps1(center.x()), packet.vox);
+  __m128 vLy = _mm_sub_ps(_mm_set_ps1(center.y()), packet.voy);
+  __m128 vLz = _mm_sub_ps(_mm_set_ps1(center.z()), packet.voz);
+  __m128 vtca = _mm_add_ps(_mm_add_ps(_mm_mul_ps(vLx, packet.vdx),
+                                      _mm_mul_ps(vLy, packet.vdy)),
+                           _mm_mul_ps(vLz, packet.vdz));
+  __m128 vLL = _mm_add_ps(_mm_add_ps(_mm_mul_ps(vLx, vLx),
+                                     _mm_mul_ps(vLy, vLy)),
+                          _mm_mul_ps(vLz, vLz));
+  __m128 vd2 = _mm_sub_ps(vLL, _mm_mul_ps(vtca, vtca));
+  __m128 vr2 = _mm_set_ps1(sphere.radius() * sphere.radius());
+  vmask = _mm_and_ps(vmask, _mm_cmple_ps(vd2, vr2));
+
+  int bits = _mm_movemask_ps(vmask);
+  ++packet_tests;
+  if (bits == 0) {
+    ++rejected_tests;
+    return _mm_set_ps1(0.0f);
+  }
+  active_lanes += kLaneCount[bits];
+
+  __m128 vthc = _mm_sqrt_ps(_mm_max_ps(_mm_sub_ps(vr2, vd2),
+                                       _mm_set_ps1(0.0f)));
+  __m128 vt0 = _mm_sub_ps(vtca, vthc);
+  vt0 = Select(_mm_cmplt_ps(vt0, _mm_set_ps1(0.0f)),
+               _mm_add_ps(vtca, vthc), vt0);
+  vmask = _mm_and_ps(vmask, _mm_cmpge_ps(vt0, _mm_set_ps1(0.0f)));
+  return vt0;
+}
+
+// Per lane the distance to where the ray enters a box or, for rays
+// starting inside, leaves it. Flat boxes take a plane test instead of the
+// slab test.
+static inline __m128 BoxDistance(const Box& box, const Packet& packet,
+                                 __m128& vmask) {
+  const __m128 vorig[3] = { packet.vox, packet.voy, packet.voz };
+  const __m128 vdir[3] = { packet.vdx, packet.vdy, packet.vdz };
+  const Vector min = box.min();
+  const Vector max = box.max();
+  __m128 vmin[3], vmax[3];
+  for (int k = 0; k < 3; ++k) {
+    vmin[k] = _mm_set_ps1(min.data()[k]);
+    vmax[k] = _mm_set_ps1(max.data()[k]);
+  }
+  const int axis = box.flat_axis();
+  if (axis >= 0) {
+    __m128 vt = _mm_div_ps(_mm_sub_ps(vmin[axis], vorig[axis]), vdir[axis]);
+    vmask = _mm_and_ps(vmask, _mm_cmpgt_ps(vt, _mm_set_ps1(0.0f)));
+    for (int k = 0; k < 3; ++k) {
+      if (k != axis) {
+        __m128 vp = _mm_add_ps(vorig[k], _mm_mul_ps(vdir[k], vt));
+        vmask = _mm_and_ps(vmask, _mm_cmpge_ps(vp, vmin[k]));
+        vmask = _mm_and_ps(vmask, _mm_cmple_ps(vp, vmax[k]));
+      }
+    }
+    return vt;
+  }
+
+  __m128 vnear = _mm_set_ps1(-std::numeric_limits<float>::max());
+  __m128 vfar = _mm_set_ps1(std::numeric_limits<float>::max());
+  for (int k = 0; k < 3; ++k) {
+    __m128 vta = _mm_div_ps(_mm_sub_ps(vmin[k], vorig[k]), vdir[k]);
+    __m128 vtb = _mm_div_ps(_mm_sub_ps(vmax[k], vorig[k]), vdir[k]);
+    vnear = _mm_max_ps(vnear, _mm_min_ps(vta, vtb));
+    vfar = _mm_min_ps(vfar, _mm_max_ps(vta, vtb));
+  }
+  vmask = _mm_and_ps(vmask, _mm_cmple_ps(vnear, vfar));
+  vmask = _mm_and_ps(vmask, _mm_cmpgt_ps(vfar, _mm_set_ps1(0.0f)));
+  return Select(_mm_cmpgt_ps(vnear, _mm_set_ps1(0.0f)), vnear, vfar);
+}
+
+// Nearest hit of every ray: distance and object index, box i has index
+// spheres.size() + i and -1 is a miss. For primary rays queued tile by
+// tile, scene gives the candidate spheres of packets within one tile of a
+// w wide image; packets across two tiles test all spheres.
+static void TraceClosest(const std::vector<Sphere>& spheres,
+                         const std::vector<Box>& boxes,
+                         const RayQueue& queue,
+                         const culling::Precomputed* scene, int w,
+                         arena::Buffer<float>& dist,
+                         arena::Buffer<int>& object,
+                         QueueStats& stats) {
+  auto start = std::chrono::steady_clock::now();
+  dist.resize(queue.ox.size());
+  object.resize(queue.ox.size());
+
+  long long packet_tests = 0, rejected_tests = 0, active_lanes = 0;
+  const int packets = static_cast<int>((queue.count + 3) / 4);
+  #pragma omp parallel for \
+    reduction(+: packet_tests, rejected_tests, active_lanes)
+  for (int p = 0; p < packets; ++p) {
+    Packet packet = LoadPacket(queue, 4 * p);
+    __m128 vdist = _mm_set_ps1(std::numeric_limits<float>::max());
+    __m128 vobject = _mm_set_ps1(-1.0f);
+    const int* first = nullptr;
+    const int* last = nullptr;
+    if (scene) {
+      const uint32_t front = queue.pixel[4 * p];
+      const uint32_t back = queue.pixel[std::min(4 * p + 3,
+        static_cast<int>(queue.count) - 1)];
+      const int tile = scene->GetTile(front / w, front % w);
+      if (tile == scene->GetTile(back / w, back % w)) {
+        first = scene->begin(tile);
+        last = scene->end(tile);
+      }
+    }
+    const size_t count = first ? last - first : spheres.size();
+    for (size_t k = 0; k < count; ++k) {
+      const size_t i = first ? first[k] : k;
+      __m128 vmask = packet.vvalid;
+      __m128 vt = SphereDistance(spheres[i], packet, vmask,
+                                 packet_tests, rejected_tests,
+                                 active_lanes);
+      vmask = _mm_and_ps(vmask, _mm_cmplt_ps(vt, vdist));
+      vdist = Select(vmask, vt, vdist);
+      vobject = Select(vmask, _mm_set_ps1(static_cast<float>(i)), vobject);
+    }
+
+    for (size_t i = 0; i < boxes.size(); ++i) {
+      __m128 vmask = packet.vvalid;
+      __m128 vt = BoxDistance(boxes[i], packet, vmask);
+      vmask = _mm_and_ps(vmask, _mm_cmplt_ps(vt, vdist));
+      vdist = Select(vmask, vt, vdist);
+      vobject = Select(vmask,
+        _mm_set_ps1(static_cast<float>(spheres.size() + i)), vobject);
+    }
+    vobject = Select(_mm_cmplt_ps(vdist, _mm_set_ps1(1000.0f)), vobject,
+                     _mm_set_ps1(-1.0f));
+
+    _mm_storeu_ps(dist.data() + 4 * p, vdist);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(object.data() + 4 * p),
+                     _mm_cvtps_epi32(vobject));
+  }
+
+  stats.rays += queue.count;
+  stats.packet_tests += packet_tests;
+  stats.rejected_tests += rejected_tests;
+  stats.active_lanes += active_lanes;
+  stats.trace_ms += std::chrono::duration<double, std::milli>(
+    std::chrono::steady_clock::now() - start).count();
+}
+
+// Any hit closer than tmax. Stops testing once all lanes are occluded.
+static void TraceShadow(const std::vector<Sphere>& spheres,
+                        const std::vector<Box>& boxes,
+                        const RayQueue& queue,
+                        arena::Buffer<int>& occluded,
+                        QueueStats& stats) {
+  auto start = std::chrono::steady_clock::now();
+  occluded.resize(queue.ox.size());
+
+  long long packet_tests = 0, rejected_tests = 0, active_lanes = 0;
+  const int packets = static_cast<int>((queue.count + 3) / 4);
+  #pragma omp parallel for \
+    reduction(+: packet_tests, rejected_tests, active_lanes)
+  for (int p = 0; p < packets; ++p) {
+    Packet packet = LoadPacket(queue, 4 * p);
+    __m128 vtmax = _mm_min_ps(_mm_loadu_ps(queue.tmax.data() + 4 * p),
+                              _mm_set_ps1(1000.0f));
+    __m128 voccluded = _mm_set_ps1(0.0f);
+    for (size_t i = 0; i < spheres.size(); ++i) {
+      __m128 vmask = _mm_andnot_ps(voccluded, packet.vvalid);
+      __m128 vt = SphereDistance(spheres[i], packet, vmask,
+                                 packet_tests, rejected_tests,
+                                 active_lanes);
+      voccluded = _mm_or_ps(voccluded,
+                            _mm_and_ps(vmask, _mm_cmplt_ps(vt, vtmax)));
+      if (_mm_movemask_ps(_mm_andnot_ps(voccluded, packet.vvalid)) == 0) {
+        break;
+      }
+    }
+
+    for (size_t i = 0; i < boxes.size(); ++i) {
+      __m128 vmask = _mm_andnot_ps(voccluded, packet.vvalid);
+      if (_mm_movemask_ps(vmask) == 0) {
+        break;
+      }
+      __m128 vt = BoxDistance(boxes[i], packet, vmask);
+      voccluded = _mm_or_ps(voccluded,
+                            _mm_and_ps(vmask, _mm_cmplt_ps(vt, vtmax)));
+    }
+
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(occluded.data() + 4 * p),
+                     _mm_castps_si128(voccluded));
+  }
+
+  stats.rays += queue.count;
+  stats.packet_tests += packet_tests;
+  stats.rejected_tests += rejected_tests;
+  stats.active_lanes += active_lanes;
+  stats.trace_ms += std::chrono::duration<double, std::milli>(
+    std::chrono::steady_clock::now() - start).count();
+}
+
+static void Bin(const binning::Bounds& bounds, RayQueue& queue,
+                RayQueue& scratch, QueueStats& stats) {
+  auto start = std::chrono::steady_clock::now();
+
+  // Keys and order are given back before the next chunk bins its rays.
+  scratch.Resize(queue.count);
+  arena::Scope scope;
+  arena::Buffer<uint32_t> keys(queue.count);
+  const int count = static_cast<int>(queue.count);
+  #pragma omp parallel for
+  for (int i = 0; i < count; ++i) {
+    keys[i] = binning::Key(queue.ox[i], queue.oy[i], queue.oz[i],
+                           queue.dx[i], queue.dy[i], queue.dz[i], bounds);
+  }
+
+  arena::Buffer<uint32_t> order;
+  binning::Sort(keys, queue.count, order);
+
+  #pragma omp parallel for
+  for (int i = 0; i < count; ++i) {
+    scratch.Copy(i, queue, order[i]);
+  }
+  std::swap(queue, scratch);
+
+  stats.binning_ms += std::chrono::duration<double, std::milli>(
+    std::chrono::steady_clock::now() - start).count();
+}
+
+// Appends the active slots to the queue.
+static void Append(const RayQueue& slots, const arena::Buffer<char>& active,
+                   RayQueue& queue) {
+  size_t count = 0;
+  for (size_t i = 0; i < slots.count; ++i) {
+    count += active[i];
+  }
+  size_t j = queue.count;
+  queue.Resize(j + count);
+  for (size_t i = 0; i < slots.count; ++i) {
+    if (active[i]) {
+      queue.Copy(j++, slots, i);
+    }
+  }
+}
+
+static Vector Reflect(const Vector& i, const Vector& n) {
+  return i - n * 2.0f * (i * n);
+}
+
+static Vector Refract(const Vector& i, const Vector& n,
+                      const float eta_t, const float eta_i = 1.f) {
+  float cosi = -std::max(-1.0f, std::min(1.0f, i * n));
+  if (cosi < 0) return Refract(i, -n, eta_i, eta_t);
+  float eta = eta_i / eta_t;
+  float k = 1 - eta * eta * (1 - cosi * cosi);
+  return k < 0 ? Vector(1.0f, 0.0f, 0.0f) :
+    i * eta + n * (eta * cosi - sqrtf(k));
+}
+
+// Shades ray i of the current bounce, the ray at slot k of its chunk: the
+// background it sees goes to emitted, reflect/refract rays to slots 2k and
+// 2k + 1 of the next bounce and one shadow ray per light to the shadow
+// slots.
+static void Shade(const std::vector<Sphere>& spheres,
+                  const std::vector<Box>& boxes,
+                  const std::vector<Light>& lights,
+                  const Framebuffer& background,
+                  const RayQueue& queue, size_t i, size_t k,
+                  float dist, int object, size_t depth,
+                  Vector& emitted,
+                  RayQueue& next_slots, arena::Buffer<char>& next_active,
+                  RayQueue& shadow_slots, arena::Buffer<char>& shadow_active) {
+  const uint32_t pixel = queue.pixel[i];
+  const float weight = queue.r[i];
+  next_active[2 * k] = next_active[2 * k + 1] = 0;
+  for (size_t l = 0; l < lights.size(); ++l) {
+    shadow_active[k * lights.size() + l] = 0;
+  }
+
+  if (object < 0) {
+    emitted = background[pixel] * weight;
+    return;
+  }
+  emitted = Vector();
+
+  Vector orig = queue.Origin(i);
+  Vector dir = queue.Direction(i);
+  Vector point = orig + dir * dist;
+  Vector norm;
+  Material material;
+  if (object < static_cast<int>(spheres.size())) {
+    norm = (point - spheres[object].center()).Normalize();
+    material = spheres[object].material();
+  } else {
+    const Box& box = boxes[object - spheres.size()];
+    norm = box.Normal(point);
+    material = box.MaterialAt(point);
+  }
+  Vector albedo = material.albedo();
+
+  float reflect_weight = weight * albedo.z();
+  if (reflect_weight != 0.0f) {
+    if (depth == kMaxDepth) {
+      emitted = emitted + background[pixel] * reflect_weight;
+    } else {
+      Vector reflect_dir = Reflect(dir, norm).Normalize();
+      Vector reflect_orig = reflect_dir * norm < 0 ?
+        point - norm * 1e-3f : point + norm * 1e-3f;
+      next_slots.Set(2 * k, reflect_orig, reflect_dir, 0.0f,
+                     Vector(reflect_weight), pixel);
+      next_active[2 * k] = 1;
+    }
+  }
+
+  float refract_weight = weight * albedo.w();
+  if (refract_weight != 0.0f) {
+    if (depth == kMaxDepth) {
+      emitted = emitted + background[pixel] * refract_weight;
+    } else {
+      Vector refract_dir = Refract(dir, norm,
+                                   material.refractive_index()).Normalize();
+      Vector refract_orig = refract_dir * norm < 0 ?
+        point - norm * 1e-3f : point + norm * 1e-3f;
+      next_slots.Set(2 * k + 1, refract_orig, refract_dir, 0.0f,
+                     Vector(refract_weight), pixel);
+      next_active[2 * k + 1] = 1;
+    }
+  }
+
+  for (size_t l = 0; l < lights.size(); ++l) {
+    Vector light_dir = (lights[l].position() - point).Normalize();
+    float light_distance = (lights[l].position() - point).norm();
+
+    float diffuse = lights[l].intensity() *
+      std::max(0.f, light_dir * norm);
+    float specular = albedo.y() == 0.0f ? 0.0f :
+      powf(std::max(0.0f, -Reflect(-light_dir, norm) * dir),
+           material.specular_exponent()) * lights[l].intensity();
+    Vector color = (material.diffuse_color() * (diffuse * albedo.x()) +
+                    Vector(1.0f, 1.0f, 1.0f) * (specular * albedo.y())) *
+                   weight;
+    if (color.x() == 0.0f && color.y() == 0.0f && color.z() == 0.0f) {
+      continue;
+    }
+
+    Vector shadow_orig = light_dir * norm < 0 ?
+      point - norm * 1e-3f : point + norm * 1e-3f;
+    shadow_slots.Set(k * lights.size() + l, shadow_orig, light_dir,
+                     light_distance, color, pixel);
+    shadow_active[k * lights.size() + l] = 1;
+  }
+}
+
+void Render(const std::vector<Sphere>& spheres,
+            const std::vector<Box>& boxes,
+            const std::vector<Light>& lights,
+            const Camera& camera,
+            Framebuffer& image,
+            int w, int h,
+            bool binning,
+            Stats& stats) {
+  assert(image.size() == w * h);
+  const PrimaryRays& rays = camera.GetPrimaryRays(w, h);
+
+  // Queues only live for this frame, so they all come from the scratch
+  // arena and are given back together when the scope ends.
+  arena::Scope scope;
+  const culling::Precomputed scene = culling::Precompute(spheres, boxes,
+                                                         camera, w, h);
+  const binning::Bounds bounds = { scene.bounds.min, scene.bounds.max };
+  RayQueue queue, next, next_slots, shadow_slots, shadows, scratch;
+  arena::Buffer<char> hits, next_active, shadow_active;
+  arena::Buffer<size_t> tile_first;
+  arena::Buffer<float> dist;
+  arena::Buffer<int> object, occluded;
+  arena::Buffer<Vector> result, emitted;
+
+  // The frame is traced band by band, whole rows of tiles at a time, and
+  // every bounce of a band is shaded a chunk of rays at a time, so the
+  // queues take the same memory at any image size and light count.
+  const Vector origin = camera.position();
+  const int band_rows = std::max<int>(
+    1, static_cast<int>(kBandPixels / (w * culling::kTileSize)));
+  const size_t chunk = std::max<size_t>(
+    1, kChunkSlots / std::max<size_t>(1, lights.size()));
+  for (int band = 0; band < scene.tiles_y; band += band_rows) {
+    const int tile_begin = band * scene.tiles_x;
+    const int tile_end = std::min(band + band_rows, scene.tiles_y) *
+                         scene.tiles_x;
+    const int tile_count = tile_end - tile_begin;
+    const int row_begin = band * culling::kTileSize;
+    const int row_end = std::min(row_begin + band_rows * culling::kTileSize,
+                                 h);
+    const size_t pixel_begin = static_cast<size_t>(row_begin) * w;
+    result.assign(static_cast<size_t>(row_end - row_begin) * w, Vector());
+    hits.resize(result.size());
+    tile_first.assign(tile_count + 1, 0);
+
+    // Primary rays are queued tile by tile, so that the packets of a tile
+    // share its candidate spheres: every tile counts the rays that hit the
+    // scene bounds, and writes them after the rays of the tiles before it.
+    // Rays missing the scene never enter the queue, their pixels keep the
+    // background.
+    #pragma omp parallel for
+    for (int t = 0; t < tile_count; ++t) {
+      const int x0 = (tile_begin + t) % scene.tiles_x * culling::kTileSize;
+      const int y0 = (tile_begin + t) / scene.tiles_x * culling::kTileSize;
+      const int x1 = std::min(x0 + culling::kTileSize, w);
+      const int y1 = std::min(y0 + culling::kTileSize, h);
+      size_t count = 0;
+      for (int i = y0; i < y1; ++i) {
+        for (int j = x0; j < x1; ++j) {
+          size_t offset = static_cast<size_t>(i) * rays.stride + j;
+          const Vector dir(rays.x[offset], rays.y[offset], rays.z[offset]);
+          const size_t local = (i - row_begin) * w + j;
+          hits[local] = culling::Hits(scene.bounds, origin, dir);
+          count += hits[local];
+          if (!hits[local]) {
+            result[local] = image[i * w + j];
+          }
+        }
+      }
+      tile_first[t + 1] = count;
+    }
+    for (int t = 0; t < tile_count; ++t) {
+      tile_first[t + 1] += tile_first[t];
+    }
+
+    queue.Resize(tile_first[tile_count]);
+    #pragma omp parallel for
+    for (int t = 0; t < tile_count; ++t) {
+      const int x0 = (tile_begin + t) % scene.tiles_x * culling::kTileSize;
+      const int y0 = (tile_begin + t) / scene.tiles_x * culling::kTileSize;
+      const int x1 = std::min(x0 + culling::kTileSize, w);
+      const int y1 = std::min(y0 + culling::kTileSize, h);
+      size_t slot = tile_first[t];
+      for (int i = y0; i < y1; ++i) {
+        for (int j = x0; j < x1; ++j) {
+          if (hits[(i - row_begin) * w + j]) {
+            size_t offset = static_cast<size_t>(i) * rays.stride + j;
+            const Vector dir(rays.x[offset], rays.y[offset], rays.z[offset]);
+            queue.Set(slot++, origin, dir, 0.0f, Vector(1.0f), i * w + j);
+          }
+        }
+      }
+    }
+
+    for (size_t depth = 0; depth <= kMaxDepth && queue.count > 0; ++depth) {
+      QueueStats& queue_stats = depth == 0 ? stats.primary : stats.secondary;
+      if (binning && depth > 0) {
+        Bin(bounds, queue, scratch, queue_stats);
+      }
+      TraceClosest(spheres, boxes, queue, depth == 0 ? &scene : nullptr, w,
+                   dist, object, queue_stats);
+
+      next.Resize(0);
+      for (size_t first = 0; first < queue.count; first += chunk) {
+        const size_t size = std::min(chunk, queue.count - first);
+        next_slots.Resize(2 * size);
+        next_active.resize(2 * size);
+        shadow_slots.Resize(lights.size() * size);
+        shadow_active.resize(lights.size() * size);
+        emitted.resize(size);
+
+        const int count = static_cast<int>(size);
+        #pragma omp parallel for
+        for (int k = 0; k < count; ++k) {
+          const size_t i = first + k;
+          Shade(spheres, boxes, lights, image, queue, i, k, dist[i],
+                object[i], depth, emitted[k], next_slots, next_active,
+                shadow_slots, shadow_active);
+        }
+        for (size_t k = 0; k < size; ++k) {
+          const size_t local = queue.pixel[first + k] - pixel_begin;
+          result[local] = result[local] + emitted[k];
+        }
+
+        shadows.Resize(0);
+        Append(shadow_slots, shadow_active, shadows);
+        if (binning) {
+          Bin(bounds, shadows, scratch, stats.shadow);
+        }
+        TraceShadow(spheres, boxes, shadows, occluded, stats.shadow);
+        for (size_t i = 0; i < shadows.count; ++i) {
+          if (!occluded[i]) {
+            const size_t local = shadows.pixel[i] - pixel_begin;
+            result[local] = result[local] + shadows.Color(i);
+          }
+        }
+
+        Append(next_slots, next_active, next);
+      }
+      std::swap(queue, next);
+    }
+
+    const int count = static_cast<int>(result.size());
+    #pragma omp parallel for
+    for (int i = 0; i < count; ++i) {
+      image[pixel_begin + i] = result[i];
+    }
+  }
+}
+
+} // namespace wavefront
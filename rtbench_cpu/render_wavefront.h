@@ -0,0 +1,49 @@
+#ifndef RTBENCH_RENDER_WAVEFRONT_H_
+#define RTBENCH_RENDER_WAVEFRONT_H_
+
+#include <vector>
+
+#include "common/box.h"
+#include "common/camera.h"
+#include "common/framebuffer.h"
+#include "common/light.h"
+#include "common/sphere.h"
+
+namespace wavefront {
+
+// Counters of one ray kind, accumulated over all rendered frames.
+// A packet test is rejected when no lane passes the bounding test, the
+// others go on to the square root. A lane is active when its ray passes,
+// so active_lanes / (4 * (packet_tests - rejected_tests)) is the SIMD lane
+// utilization. Coherent packets tend to be rejected or pass as a whole.
+struct QueueStats {
+  long long rays = 0;
+  long long packet_tests = 0;
+  long long rejected_tests = 0;
+  long long active_lanes = 0;
+  double trace_ms = 0.0;
+  double binning_ms = 0.0;
+};
+
+struct Stats {
+  QueueStats primary;
+  QueueStats secondary;
+  QueueStats shadow;
+};
+
+// Traces the image breadth-first: each bounce is a queue of rays that is
+// intersected in SSE packets, shadow rays form a queue of their own. With
+// binning enabled secondary and shadow queues are sorted by direction
+// octant and origin cell before intersection.
+void Render(const std::vector<Sphere>& spheres,
+            const std::vector<Box>& boxes,
+            const std::vector<Light>& lights,
+            const Camera& camera,
+            Framebuffer& image,
+            int w, int h,
+            bool binning,
+            Stats& stats);
+
+} // namespace wavefront
+
+#endif // RTBENCH_RENDER_WAVEFRONT_H_
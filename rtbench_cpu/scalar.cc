@@ -0,0 +1,91 @@
+#include "scalar.h"
+
+#include <vector>
+
+#include <assert.h>
+
+#include "common/arena.h"
+#include "culling.h"
+
+namespace scalar {
+
+static void StoreVector(const Vector& v, float* out) {
+  for (int k = 0; k < 4; ++k) {
+    out[k] = v.data()[k];
+  }
+}
+
+static ScalarMaterial Flatten(const Material& material) {
+  ScalarMaterial flat;
+  StoreVector(material.albedo(), flat.albedo);
+  StoreVector(material.diffuse_color(), flat.diffuse_color);
+  flat.refractive_index = material.refractive_index();
+  flat.specular_exponent = material.specular_exponent();
+  return flat;
+}
+
+void Render(const std::vector<Sphere>& spheres,
+            const std::vector<Box>& boxes,
+            const std::vector<Light>& lights,
+            const Camera& camera,
+            Framebuffer& image,
+            int w, int h,
+            Kernel kernel) {
+  assert(image.size() == w * h);
+  arena::Scope scope;
+  const culling::Precomputed culled = culling::Precompute(spheres, boxes,
+                                                          camera, w, h);
+
+  arena::Buffer<ScalarSphere> flat_spheres(spheres.size());
+  for (size_t i = 0; i < spheres.size(); ++i) {
+    flat_spheres[i].material = Flatten(spheres[i].material());
+    StoreVector(spheres[i].center(), flat_spheres[i].center);
+    flat_spheres[i].radius = spheres[i].radius();
+  }
+  arena::Buffer<ScalarBox> flat_boxes(boxes.size());
+  for (size_t i = 0; i < boxes.size(); ++i) {
+    flat_boxes[i].material = Flatten(boxes[i].material());
+    StoreVector(boxes[i].checker_color(), flat_boxes[i].checker_color);
+    StoreVector(boxes[i].min(), flat_boxes[i].min);
+    StoreVector(boxes[i].max(), flat_boxes[i].max);
+    flat_boxes[i].checkerboard =
+      boxes[i].texture() == Texture::kCheckerboard;
+    flat_boxes[i].flat_axis = boxes[i].flat_axis();
+  }
+  arena::Buffer<ScalarLight> flat_lights(lights.size());
+  for (size_t i = 0; i < lights.size(); ++i) {
+    StoreVector(lights[i].position(), flat_lights[i].position);
+    flat_lights[i].intensity = lights[i].intensity();
+  }
+
+  ScalarScene scene;
+  scene.spheres = flat_spheres.data();
+  scene.sphere_count = static_cast<int>(spheres.size());
+  scene.boxes = flat_boxes.data();
+  scene.box_count = static_cast<int>(boxes.size());
+  scene.lights = flat_lights.data();
+  scene.light_count = static_cast<int>(lights.size());
+  StoreVector(camera.position(), scene.camera.position);
+  StoreVector(camera.forward(), scene.camera.forward);
+  StoreVector(camera.right(), scene.camera.right);
+  StoreVector(camera.up(), scene.camera.up);
+  scene.camera.tan_half_fov = camera.tan_half_fov();
+  scene.camera.crop_x0 = camera.crop_x0();
+  scene.camera.crop_y0 = camera.crop_y0();
+  scene.camera.crop_w = camera.crop_w();
+  scene.camera.crop_h = camera.crop_h();
+  StoreVector(culled.bounds.min, scene.bounds_min);
+  StoreVector(culled.bounds.max, scene.bounds_max);
+  scene.tile_size = culling::kTileSize;
+  scene.tile_x0 = culled.tile_x0;
+  scene.tile_y0 = culled.tile_y0;
+  scene.tiles_x = culled.lists->tiles_x;
+  scene.first = culled.lists->first.data();
+  scene.candidates = culled.lists->candidates.data();
+
+  // Vector is four floats with no padding, so the image is a float array.
+  static_assert(sizeof(Vector) == 4 * sizeof(float), "Vector layout");
+  kernel(&scene, image.data()->data(), w, h);
+}
+
+} // namespace scalar
@@ -0,0 +1,31 @@
+#ifndef RTBENCH_SCALAR_H_
+#define RTBENCH_SCALAR_H_
+
+#include <vector>
+
+#include "common/box.h"
+#include "common/camera.h"
+#include "common/framebuffer.h"
+#include "common/light.h"
+#include "common/sphere.h"
+#include "scalar_scene.h"
+
+// Runs the kernels of scalar_kernels.h, generic or AVX2, on the scene.
+namespace scalar {
+
+// Image holds w * h pixels of four floats, the backgrounds on entry.
+typedef void (*Kernel)(const ScalarScene* scene, float* image, int w, int h);
+
+// Flattens the scene into the frame arena and runs the kernel over the
+// image. Runs outside of parallel regions.
+void Render(const std::vector<Sphere>& spheres,
+            const std::vector<Box>& boxes,
+            const std::vector<Light>& lights,
+            const Camera& camera,
+            Framebuffer& image,
+            int w, int h,
+            Kernel kernel);
+
+} // namespace scalar
+
+#endif // RTBENCH_SCALAR_H_
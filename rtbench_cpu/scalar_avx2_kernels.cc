@@ -0,0 +1,20 @@
+#include "scalar_avx2_kernels.h"
+
+// Built with /arch:AVX2 and /fp:strict: the kernels are the generic ones
+// compiled again, and give the same pixels.
+#include "scalar_kernels.h"
+
+extern "C" void RenderSequentialAvx2(const ScalarScene* scene, float* image,
+                                     int w, int h) {
+  for (int i = 0; i < h; ++i) {
+    RenderRow(*scene, image, w, h, i);
+  }
+}
+
+extern "C" void RenderBaselineAvx2(const ScalarScene* scene, float* image,
+                                   int w, int h) {
+  #pragma omp parallel for
+  for (int i = 0; i < h; ++i) {
+    RenderRow(*scene, image, w, h, i);
+  }
+}
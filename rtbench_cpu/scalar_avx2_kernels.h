@@ -0,0 +1,14 @@
+#ifndef RTBENCH_SCALAR_AVX2_KERNELS_H_
+#define RTBENCH_SCALAR_AVX2_KERNELS_H_
+
+#include "scalar_scene.h"
+
+// Entry points of the Sequential and Baseline kernels built with
+// /arch:AVX2 and /fp:strict from scalar_kernels.h. Image holds w * h pixels
+// of four floats, the backgrounds on entry.
+extern "C" void RenderSequentialAvx2(const ScalarScene* scene, float* image,
+                                     int w, int h);
+extern "C" void RenderBaselineAvx2(const ScalarScene* scene, float* image,
+                                   int w, int h);
+
+#endif // RTBENCH_SCALAR_AVX2_KERNELS_H_
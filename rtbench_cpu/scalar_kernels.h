@@ -0,0 +1,331 @@
+#ifndef RTBENCH_SCALAR_KERNELS_H_
+#define RTBENCH_SCALAR_KERNELS_H_
+
+#include <float.h>
+#include <math.h>
+
+#include "scalar_scene.h"
+
+// Tracing of the Sequential and Baseline versions. render_sequential.cc
+// and render_baseline.cc include it, and so does scalar_avx2_kernels.cc,
+// built with /arch:AVX2: of the project it only includes scalar_scene.h,
+// it includes no C++ library header and everything in it has internal
+// linkage, so no AVX2 copy of an inline function can be linked into the
+// generic code.
+namespace {
+
+struct Vec {
+  float v[4];
+};
+
+inline Vec MakeVec(float x, float y, float z) {
+  Vec r = { { x, y, z, 0.0f } };
+  return r;
+}
+
+inline Vec Load(const float* v) {
+  Vec r = { { v[0], v[1], v[2], v[3] } };
+  return r;
+}
+
+inline void Store(const Vec& a, float* v) {
+  for (int k = 0; k < 4; ++k) {
+    v[k] = a.v[k];
+  }
+}
+
+inline Vec Neg(const Vec& a) {
+  Vec r = { { -a.v[0], -a.v[1], -a.v[2], -a.v[3] } };
+  return r;
+}
+
+inline Vec Add(const Vec& a, const Vec& b) {
+  Vec r = { { a.v[0] + b.v[0], a.v[1] + b.v[1],
+              a.v[2] + b.v[2], a.v[3] + b.v[3] } };
+  return r;
+}
+
+inline Vec Sub(const Vec& a, const Vec& b) {
+  Vec r = { { a.v[0] - b.v[0], a.v[1] - b.v[1],
+              a.v[2] - b.v[2], a.v[3] - b.v[3] } };
+  return r;
+}
+
+inline Vec Scale(const Vec& a, float s) {
+  Vec r = { { a.v[0] * s, a.v[1] * s, a.v[2] * s, a.v[3] * s } };
+  return r;
+}
+
+inline float Dot(const Vec& a, const Vec& b) {
+  return a.v[0] * b.v[0] + a.v[1] * b.v[1] + a.v[2] * b.v[2] +
+    a.v[3] * b.v[3];
+}
+
+inline float Norm(const Vec& a) {
+  return sqrtf(a.v[0] * a.v[0] + a.v[1] * a.v[1] + a.v[2] * a.v[2] +
+               a.v[3] * a.v[3]);
+}
+
+inline Vec Normalize(const Vec& a) {
+  return Scale(a, 1.0f / Norm(a));
+}
+
+// Same results as std::min and std::max, NaNs included.
+inline float Min(float a, float b) {
+  return b < a ? b : a;
+}
+
+inline float Max(float a, float b) {
+  return a < b ? b : a;
+}
+
+inline Vec Reflect(const Vec& i, const Vec& n) {
+  return Sub(i, Scale(Scale(n, 2.0f), Dot(i, n)));
+}
+
+Vec Refract(const Vec& i, const Vec& n,
+            const float eta_t, const float eta_i = 1.f) {
+  float cosi = -Max(-1.0f, Min(1.0f, Dot(i, n)));
+  if (cosi < 0) return Refract(i, Neg(n), eta_i, eta_t);
+  float eta = eta_i / eta_t;
+  float k = 1 - eta * eta * (1 - cosi * cosi);
+  return k < 0 ? MakeVec(1.0f, 0.0f, 0.0f) :
+    Add(Scale(i, eta), Scale(n, eta * cosi - sqrtf(k)));
+}
+
+bool RayIntersect(const ScalarSphere& sphere, const Vec& orig,
+                  const Vec& dir, float& t0) {
+  Vec L = Sub(Load(sphere.center), orig);
+  float tca = Dot(L, dir);
+  float d2 = Dot(L, L) - tca * tca;
+  if (d2 > sphere.radius * sphere.radius) {
+    return false;
+  }
+  float thc = sqrtf(sphere.radius * sphere.radius - d2);
+  t0 = tca - thc;
+  float t1 = tca + thc;
+  if (t0 < 0) {
+    t0 = t1;
+  }
+  if (t0 < 0) {
+    return false;
+  }
+  return true;
+}
+
+bool RayIntersect(const ScalarBox& box, const Vec& orig,
+                  const Vec& dir, float& t0) {
+  const int axis = box.flat_axis;
+  if (axis >= 0) {
+    float t = (box.min[axis] - orig.v[axis]) / dir.v[axis];
+    if (!(t > 0)) {
+      return false;
+    }
+    Vec pt = Add(orig, Scale(dir, t));
+    for (int k = 0; k < 3; ++k) {
+      if (k != axis && !(pt.v[k] >= box.min[k] && pt.v[k] <= box.max[k])) {
+        return false;
+      }
+    }
+    t0 = t;
+    return true;
+  }
+
+  float t_near = -FLT_MAX;
+  float t_far = FLT_MAX;
+  for (int k = 0; k < 3; ++k) {
+    float ta = (box.min[k] - orig.v[k]) / dir.v[k];
+    float tb = (box.max[k] - orig.v[k]) / dir.v[k];
+    t_near = Max(t_near, Min(ta, tb));
+    t_far = Min(t_far, Max(ta, tb));
+  }
+  if (t_near > t_far || t_far <= 0) {
+    return false;
+  }
+  t0 = t_near > 0 ? t_near : t_far;
+  return true;
+}
+
+// Box::Normal.
+Vec Normal(const ScalarBox& box, const Vec& point) {
+  Vec norm = MakeVec(0.0f, 0.0f, 0.0f);
+  if (box.flat_axis >= 0) {
+    norm.v[box.flat_axis] = 1.0f;
+    return norm;
+  }
+
+  int axis = 0;
+  float sign = 1.0f;
+  float nearest = INFINITY;
+  for (int k = 0; k < 3; ++k) {
+    float to_min = fabsf(point.v[k] - box.min[k]);
+    float to_max = fabsf(point.v[k] - box.max[k]);
+    if (to_min < nearest) {
+      nearest = to_min;
+      axis = k;
+      sign = -1.0f;
+    }
+    if (to_max < nearest) {
+      nearest = to_max;
+      axis = k;
+      sign = 1.0f;
+    }
+  }
+  norm.v[axis] = sign;
+  return norm;
+}
+
+// Box::MaterialAt.
+ScalarMaterial MaterialAt(const ScalarBox& box, const Vec& point) {
+  ScalarMaterial material = box.material;
+  if (box.checkerboard &&
+      ((static_cast<int>(0.5f * point.v[0] + 1000.0f) +
+        static_cast<int>(0.5f * point.v[2])) & 1)) {
+    for (int k = 0; k < 4; ++k) {
+      material.diffuse_color[k] = box.checker_color[k];
+    }
+  }
+  return material;
+}
+
+// Tests the candidate spheres first to last, or all of them when first
+// is null.
+bool SceneIntersect(const Vec& orig, const Vec& dir,
+                    const ScalarScene& scene,
+                    Vec& hit, Vec& norm, ScalarMaterial& material,
+                    const int* first = nullptr,
+                    const int* last = nullptr) {
+  float spheres_dist = FLT_MAX;
+  const int count = first ? static_cast<int>(last - first) :
+    scene.sphere_count;
+  for (int k = 0; k < count; k++) {
+    const ScalarSphere& sphere = scene.spheres[first ? first[k] : k];
+    float dist_i = 0.0f;
+    if (RayIntersect(sphere, orig, dir, dist_i) && dist_i < spheres_dist) {
+      spheres_dist = dist_i;
+      hit = Add(orig, Scale(dir, dist_i));
+      norm = Normalize(Sub(hit, Load(sphere.center)));
+      material = sphere.material;
+    }
+  }
+
+  float boxes_dist = FLT_MAX;
+  int nearest_box = scene.box_count;
+  for (int i = 0; i < scene.box_count; i++) {
+    float dist_i = 0.0f;
+    if (RayIntersect(scene.boxes[i], orig, dir, dist_i) &&
+        dist_i < spheres_dist && dist_i < boxes_dist) {
+      boxes_dist = dist_i;
+      nearest_box = i;
+    }
+  }
+  if (nearest_box < scene.box_count) {
+    hit = Add(orig, Scale(dir, boxes_dist));
+    norm = Normal(scene.boxes[nearest_box], hit);
+    material = MaterialAt(scene.boxes[nearest_box], hit);
+  }
+  return Min(spheres_dist, boxes_dist) < 1000.0f;
+}
+
+Vec CastRay(const Vec& background, const Vec& orig, const Vec& dir,
+            const ScalarScene& scene, int depth = 0,
+            const int* first = nullptr, const int* last = nullptr) {
+  Vec point, norm;
+  ScalarMaterial material;
+
+  if (depth > 4 || !SceneIntersect(orig, dir, scene, point, norm, material,
+                                   first, last)) {
+    return background;
+  }
+
+  Vec reflect_dir = Normalize(Reflect(dir, norm));
+  Vec refract_dir = Normalize(Refract(dir, norm,
+                                      material.refractive_index));
+  Vec reflect_orig = Dot(reflect_dir, norm) < 0 ?
+    Sub(point, Scale(norm, 1e-3f)) : Add(point, Scale(norm, 1e-3f));
+  Vec refract_orig = Dot(refract_dir, norm) < 0 ?
+    Sub(point, Scale(norm, 1e-3f)) : Add(point, Scale(norm, 1e-3f));
+  Vec reflect_color = CastRay(background, reflect_orig, reflect_dir,
+                              scene, depth + 1);
+  Vec refract_color = CastRay(background, refract_orig, refract_dir,
+                              scene, depth + 1);
+
+  float diffuse_light_intensity = 0, specular_light_intensity = 0;
+  for (int i = 0; i < scene.light_count; i++) {
+    const Vec light_position = Load(scene.lights[i].position);
+    Vec light_dir = Normalize(Sub(light_position, point));
+    float light_distance = Norm(Sub(light_position, point));
+
+    Vec shadow_orig = Dot(light_dir, norm) < 0 ?
+      Sub(point, Scale(norm, 1e-3f)) : Add(point, Scale(norm, 1e-3f));
+    Vec shadow_pt, shadow_n;
+    ScalarMaterial tmpmaterial;
+    if (SceneIntersect(shadow_orig, light_dir, scene,
+                       shadow_pt, shadow_n, tmpmaterial) &&
+        Norm(Sub(shadow_pt, shadow_orig)) < light_distance) {
+      continue;
+    }
+
+    diffuse_light_intensity += scene.lights[i].intensity *
+      Max(0.f, Dot(light_dir, norm));
+    specular_light_intensity +=
+      powf(Max(0.0f, Dot(Neg(Reflect(Neg(light_dir), norm)), dir)),
+           material.specular_exponent) * scene.lights[i].intensity;
+  }
+
+  const Vec diffuse_color = Load(material.diffuse_color);
+  return Add(Add(Add(
+    Scale(Scale(diffuse_color, diffuse_light_intensity), material.albedo[0]),
+    Scale(Scale(MakeVec(1.0f, 1.0f, 1.0f), specular_light_intensity),
+          material.albedo[1])),
+    Scale(reflect_color, material.albedo[2])),
+    Scale(refract_color, material.albedo[3]));
+}
+
+// Camera::Direction.
+Vec Direction(const ScalarCamera& camera, int i, int j, int w, int h) {
+  if (camera.crop_w > 0) {
+    i += camera.crop_y0;
+    j += camera.crop_x0;
+    w = camera.crop_w;
+    h = camera.crop_h;
+  }
+  return Add(Add(Scale(Load(camera.right), (j + 0.5f) - w / 2.0f),
+                 Scale(Load(camera.up), -(i + 0.5f) + h / 2.0f)),
+             Scale(Load(camera.forward), h / (2.0f * camera.tan_half_fov)));
+}
+
+// culling::Hits.
+bool HitsBounds(const ScalarScene& scene, const Vec& orig, const Vec& dir) {
+  float t_near = -FLT_MAX;
+  float t_far = FLT_MAX;
+  for (int k = 0; k < 3; ++k) {
+    float ta = (scene.bounds_min[k] - orig.v[k]) / dir.v[k];
+    float tb = (scene.bounds_max[k] - orig.v[k]) / dir.v[k];
+    t_near = Max(t_near, Min(ta, tb));
+    t_far = Min(t_far, Max(ta, tb));
+  }
+  return t_near <= t_far && t_far >= 0.0f;
+}
+
+void RenderRow(const ScalarScene& scene, float* image, int w, int h, int i) {
+  const Vec position = Load(scene.camera.position);
+  for (int j = 0; j < w; ++j) {
+    // A ray missing the scene keeps the background.
+    const Vec dir = Normalize(Direction(scene.camera, i, j, w, h));
+    if (!HitsBounds(scene, position, dir)) {
+      continue;
+    }
+    const int tile = (i / scene.tile_size + scene.tile_y0) * scene.tiles_x +
+      j / scene.tile_size + scene.tile_x0;
+    float* pixel = image + 4 * (static_cast<long long>(i) * w + j);
+    Store(CastRay(Load(pixel), position, dir, scene, 0,
+                  scene.candidates + scene.first[tile],
+                  scene.candidates + scene.first[tile + 1]),
+          pixel);
+  }
+}
+
+} // namespace
+
+#endif // RTBENCH_SCALAR_KERNELS_H_
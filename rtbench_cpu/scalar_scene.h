@@ -0,0 +1,69 @@
+#ifndef RTBENCH_SCALAR_SCENE_H_
+#define RTBENCH_SCALAR_SCENE_H_
+
+// The scene as the kernels of scalar_kernels.h take it: plain structs,
+// vectors as four floats in the layout of Vector. scalar::Render fills
+// them in.
+
+struct ScalarMaterial {
+  float albedo[4];
+  float diffuse_color[4];
+  float refractive_index;
+  float specular_exponent;
+};
+
+struct ScalarSphere {
+  ScalarMaterial material;
+  float center[4];
+  float radius;
+};
+
+struct ScalarBox {
+  ScalarMaterial material;
+  float checker_color[4];
+  float min[4];
+  float max[4];
+  int checkerboard;
+  int flat_axis;
+};
+
+struct ScalarLight {
+  float position[4];
+  float intensity;
+};
+
+struct ScalarCamera {
+  float position[4];
+  float forward[4];
+  float right[4];
+  float up[4];
+  float tan_half_fov;
+  // Crop window as set by Camera::SetCrop, crop_w is 0 without one.
+  int crop_x0;
+  int crop_y0;
+  int crop_w;
+  int crop_h;
+};
+
+struct ScalarScene {
+  const ScalarSphere* spheres;
+  int sphere_count;
+  const ScalarBox* boxes;
+  int box_count;
+  const ScalarLight* lights;
+  int light_count;
+  ScalarCamera camera;
+  // Culling data of culling::Precompute: the padded scene bounds and the
+  // candidate spheres of every kTileSize tile of the lists, which the render
+  // is a window of at tile (tile_x0, tile_y0).
+  float bounds_min[4];
+  float bounds_max[4];
+  int tile_size;
+  int tile_x0;
+  int tile_y0;
+  int tiles_x;
+  const int* first;
+  const int* candidates;
+};
+
+#endif // RTBENCH_SCALAR_SCENE_H_
@@ -0,0 +1,361 @@
+#include "server.h"
+
+#include <assert.h>
+#include <math.h>
+
+#include <algorithm>
+#include <future>
+#include <thread>
+
+#include "common/arena.h"
+#include "common/tiles.h"
+
+namespace server {
+
+namespace {
+
+const int kPollMs = 100;
+const int kWarmUpSize = 256;
+const int kMaxSize = 8192;
+const auto kBatchWindow = std::chrono::milliseconds(1);
+
+enum RequestType : uint32_t {
+  kRender = 0x52544253,
+  kStop
+};
+
+enum Status : int32_t {
+  kOk,
+  kInvalidRequest,
+  kRenderFailed,
+  kStopping
+};
+
+struct RequestHeader {
+  uint32_t type;
+  RenderRequest request;
+};
+
+struct ResponseHeader {
+  int32_t status;
+  int32_t w;
+  int32_t h;
+  Latency latency;
+};
+
+double Milliseconds(std::chrono::steady_clock::duration duration) {
+  return std::chrono::duration<double, std::milli>(duration).count();
+}
+
+} // namespace
+
+struct Server::Job {
+  RenderRequest request;
+  Camera camera;
+  light_batch::Settings light_settings;
+  int w = 0;
+  int h = 0;
+  Framebuffer image;
+  std::atomic<int> remaining;
+  std::atomic<bool> failed;
+  std::promise<void> done;
+  std::chrono::steady_clock::time_point arrival;
+  std::chrono::steady_clock::time_point start;
+  std::chrono::steady_clock::time_point end;
+};
+
+Percentiles GetPercentiles(std::vector<double> samples) {
+  Percentiles percentiles;
+  if (samples.empty()) {
+    return percentiles;
+  }
+
+  // Nearest rank: the smallest sample not below p percent of all samples.
+  std::sort(samples.begin(), samples.end());
+  auto rank = [&samples](double p) {
+    size_t index = static_cast<size_t>(ceil(p * samples.size()));
+    return samples[std::max<size_t>(index, 1) - 1];
+  };
+  percentiles.p50 = rank(0.50);
+  percentiles.p90 = rank(0.90);
+  percentiles.p99 = rank(0.99);
+  percentiles.max = samples.back();
+  return percentiles;
+}
+
+Server::Server(distributed::RenderFunction render,
+               const std::vector<Vector>& background, int w, int h)
+    : render_(render), w_(w), h_(h), version_count_(0), stop_(false),
+      batches_(0) {
+  assert(background.size() == w * h);
+  scenes_.push_back(Scene(background));
+  backgrounds_[std::make_pair(w, h)] = background;
+}
+
+void Server::WarmUp(int version_count) {
+  version_count_ = version_count;
+
+  std::vector<std::shared_ptr<Job>> warm_up;
+  for (int version = 0; version < version_count; ++version) {
+    RenderRequest request;
+    request.w = request.h = kWarmUpSize;
+    request.version = version;
+    warm_up.push_back(CreateJob(request));
+  }
+  RenderBatch(warm_up);
+  queue_ms_.clear();
+  render_ms_.clear();
+  total_ms_.clear();
+  batches_ = 0;
+}
+
+bool Server::Run(int port) {
+  net::Socket listener;
+  if (!net::Initialize() || !listener.Listen(port, SOMAXCONN)) {
+    return false;
+  }
+
+  stop_ = false;
+  std::thread dispatcher(&Server::Dispatch, this);
+  std::vector<std::thread> connections;
+  while (!stop_) {
+    if (!net::WaitReadable({ &listener }, kPollMs).empty()) {
+      net::Socket socket = listener.Accept();
+      if (socket.valid()) {
+        connections.emplace_back(&Server::Serve, this, std::move(socket));
+      }
+    }
+  }
+
+  for (std::thread& connection : connections) {
+    connection.join();
+  }
+  pending_ready_.notify_all();
+  dispatcher.join();
+  return true;
+}
+
+std::shared_ptr<Server::Job> Server::CreateJob(const RenderRequest& request) {
+  std::shared_ptr<Job> job = std::make_shared<Job>();
+  job->request = request;
+  job->w = request.w == 0 ? w_ : request.w;
+  job->h = request.h == 0 ? h_ : request.h;
+  if (request.scene_id < 0 ||
+      request.scene_id >= static_cast<int>(scenes_.size()) ||
+      job->w <= 0 || job->w > kMaxSize || job->h <= 0 || job->h > kMaxSize ||
+      request.version < 0 || request.version >= version_count_ ||
+      request.accuracy < static_cast<int>(fast_math::Accuracy::kExact) ||
+      request.accuracy > static_cast<int>(fast_math::Accuracy::kFastest) ||
+      request.light_mode < static_cast<int>(light_batch::Mode::kAll) ||
+      request.light_mode > static_cast<int>(light_batch::Mode::kSampled) ||
+      request.shadow_rays < 1 ||
+      request.shadow_rays > light_batch::kMaxShadowRays ||
+      !(request.fov > 0.0f && request.fov < M_PI)) {
+    return nullptr;
+  }
+
+  job->camera = Camera(Vector(request.position[0], request.position[1],
+                              request.position[2]),
+                       Vector(request.target[0], request.target[1],
+                              request.target[2]),
+                       Vector(0.0f, 1.0f, 0.0f), request.fov);
+  if (!job->camera.IsValid()) {
+    return nullptr;
+  }
+  job->light_settings.mode = static_cast<light_batch::Mode>(request.light_mode);
+  job->light_settings.shadow_rays = request.shadow_rays;
+  job->remaining = 0;
+  job->failed = false;
+  job->arrival = std::chrono::steady_clock::now();
+  return job;
+}
+
+void Server::Serve(net::Socket socket) {
+  while (!stop_) {
+    if (net::WaitReadable({ &socket }, kPollMs).empty()) {
+      continue;
+    }
+
+    RequestHeader header;
+    if (!socket.RecvAll(&header, sizeof(header))) {
+      return;
+    }
+    if (header.type == kStop) {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+      }
+      pending_ready_.notify_all();
+      return;
+    } else if (header.type != kRender) {
+      return;
+    }
+
+    ResponseHeader response = {};
+    std::shared_ptr<Job> job = CreateJob(header.request);
+    if (job == nullptr) {
+      response.status = kInvalidRequest;
+    } else {
+      // The dispatcher exits once stop_ is set and the queue is empty, so
+      // a job is only queued before that; later ones are turned away.
+      std::future<void> done = job->done.get_future();
+      bool queued = false;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!stop_) {
+          pending_.push_back(job);
+          queued = true;
+        }
+      }
+      if (!queued) {
+        response.status = kStopping;
+        socket.SendAll(&response, sizeof(response));
+        return;
+      }
+      pending_ready_.notify_one();
+      done.wait();
+
+      response.status = job->failed ? kRenderFailed : kOk;
+      response.w = job->w;
+      response.h = job->h;
+      response.latency.queue_ms =
+        static_cast<float>(Milliseconds(job->start - job->arrival));
+      response.latency.render_ms =
+        static_cast<float>(Milliseconds(job->end - job->start));
+    }
+
+    if (!socket.SendAll(&response, sizeof(response)) ||
+        (response.status == kOk &&
+         !socket.SendAll(job->image.data(),
+                         job->image.size() * sizeof(Vector)))) {
+      return;
+    }
+  }
+}
+
+void Server::Dispatch() {
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      pending_ready_.wait(lock, [this] { return stop_ || !pending_.empty(); });
+      if (pending_.empty()) {
+        return;
+      }
+    }
+
+    // Gives requests sent at the same time a moment to join the batch.
+    std::this_thread::sleep_for(kBatchWindow);
+    std::vector<std::shared_ptr<Job>> batch;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      batch.swap(pending_);
+    }
+    RenderBatch(batch);
+  }
+}
+
+void Server::RenderBatch(std::vector<std::shared_ptr<Job>>& batch) {
+  // Small requests go first, so they are answered while large ones still
+  // render instead of waiting for the whole batch.
+  std::stable_sort(batch.begin(), batch.end(),
+                   [](const std::shared_ptr<Job>& a,
+                      const std::shared_ptr<Job>& b) {
+                     return a->w * a->h < b->w * b->h;
+                   });
+
+  const auto start = std::chrono::steady_clock::now();
+  std::vector<std::pair<Job*, tiles::Tile>> queue;
+  for (const std::shared_ptr<Job>& job : batch) {
+    const std::vector<Vector>& background = GetBackground(job->w, job->h);
+    job->image.assign(background.begin(), background.end());
+    job->start = start;
+    job->remaining = tiles::GetTileCount(job->w, job->h);
+    for (int id = 0; id < job->remaining; ++id) {
+      queue.push_back(std::make_pair(job.get(),
+                                     tiles::GetTile(id, job->w, job->h)));
+    }
+  }
+
+  // Every thread takes whole tiles from the shared queue, see
+  // numa::Configure.
+  #pragma omp parallel for schedule(dynamic)
+  for (int t = 0; t < static_cast<int>(queue.size()); ++t) {
+    Job& job = *queue[t].first;
+    const tiles::Tile& tile = queue[t].second;
+    const Scene& scene = scenes_[job.request.scene_id];
+
+    Camera camera = job.camera;
+    camera.SetCrop(tile.x0, tile.y0, job.w, job.h);
+    Framebuffer pixels;
+    tiles::Extract(job.image, job.w, tile, pixels);
+    if (!render_(scene.GetSpheres(), scene.GetBoxes(), scene.GetLights(),
+                 camera, pixels, tile.w, tile.h, job.request.version,
+                 static_cast<fast_math::Accuracy>(job.request.accuracy),
+                 job.light_settings)) {
+      job.failed = true;
+    }
+    tiles::Store(pixels.data(), tile, job.image, job.w);
+
+    if (--job.remaining == 0) {
+      job.end = std::chrono::steady_clock::now();
+      job.done.set_value();
+    }
+  }
+
+  // Every thread is idle again, which makes this a frame boundary.
+  arena::ResetAll();
+  ++batches_;
+  for (const std::shared_ptr<Job>& job : batch) {
+    queue_ms_.push_back(Milliseconds(job->start - job->arrival));
+    render_ms_.push_back(Milliseconds(job->end - job->start));
+    total_ms_.push_back(Milliseconds(job->end - job->arrival));
+  }
+}
+
+// Other resolutions are resampled from the loaded background once.
+const std::vector<Vector>& Server::GetBackground(int w, int h) {
+  std::vector<Vector>& background = backgrounds_[std::make_pair(w, h)];
+  if (background.empty()) {
+    const std::vector<Vector>& source = backgrounds_[std::make_pair(w_, h_)];
+    background.resize(static_cast<size_t>(w) * h);
+    for (int i = 0; i < h; ++i) {
+      for (int j = 0; j < w; ++j) {
+        size_t y = static_cast<size_t>(i) * h_ / h;
+        size_t x = static_cast<size_t>(j) * w_ / w;
+        background[static_cast<size_t>(i) * w + j] = source[y * w_ + x];
+      }
+    }
+  }
+  return background;
+}
+
+bool Request(net::Socket& socket, const RenderRequest& request,
+             std::vector<Vector>& image, int& w, int& h, Latency& latency) {
+  RequestHeader header;
+  header.type = kRender;
+  header.request = request;
+  ResponseHeader response;
+  if (!socket.SendAll(&header, sizeof(header)) ||
+      !socket.RecvAll(&response, sizeof(response)) ||
+      response.status != kOk) {
+    return false;
+  }
+
+  w = response.w;
+  h = response.h;
+  latency = response.latency;
+  image.resize(static_cast<size_t>(w) * h);
+  return socket.RecvAll(image.data(), image.size() * sizeof(Vector));
+}
+
+bool RequestStop(const char* host, int port) {
+  net::Socket socket;
+  if (!net::Initialize() || !socket.Connect(host, port)) {
+    return false;
+  }
+  RequestHeader header = {};
+  header.type = kStop;
+  return socket.SendAll(&header, sizeof(header));
+}
+
+} // namespace server
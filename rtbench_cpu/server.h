@@ -0,0 +1,121 @@
+#ifndef RTBENCH_SERVER_H_
+#define RTBENCH_SERVER_H_
+
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "common/scene.h"
+#include "common/socket.h"
+#include "distributed.h"
+
+// Render daemon: keeps backgrounds, scenes and the OpenMP thread pool
+// resident and answers render requests from local clients over TCP.
+// Requests that arrive together are split into tiles of one shared queue,
+// so small jobs keep all threads busy instead of running one by one.
+namespace server {
+
+const int kDefaultPort = 5556;
+
+struct RenderRequest {
+  int32_t scene_id = 0;
+  // Zero selects the resolution of the loaded background.
+  int32_t w = 0;
+  int32_t h = 0;
+  int32_t version = 0;
+  int32_t accuracy = 0;
+  // light_batch::Settings of SSE Fast Math.
+  int32_t light_mode = 0;
+  int32_t shadow_rays = 4;
+  float position[3] = { 0.0f, 0.0f, 0.0f };
+  float target[3] = { 0.0f, 0.0f, -1.0f };
+  float fov = static_cast<float>(M_PI / 3.0);
+};
+
+// Server-side time from arrival to the start of the batch and from there
+// to the last tile of the request.
+struct Latency {
+  float queue_ms = 0.0f;
+  float render_ms = 0.0f;
+};
+
+struct Percentiles {
+  double p50 = 0.0;
+  double p90 = 0.0;
+  double p99 = 0.0;
+  double max = 0.0;
+};
+
+Percentiles GetPercentiles(std::vector<double> samples);
+
+class Server {
+ public:
+  Server(distributed::RenderFunction render,
+         const std::vector<Vector>& background, int w, int h);
+
+  // Renders every version once on a small image, which also starts the
+  // thread pool. Requests for other versions are rejected.
+  void WarmUp(int version_count);
+
+  // Serves until a client asks to stop.
+  bool Run(int port);
+
+  // Per request latencies in milliseconds, in completion order.
+  const std::vector<double>& queue_ms() const {
+    return queue_ms_;
+  }
+
+  const std::vector<double>& render_ms() const {
+    return render_ms_;
+  }
+
+  const std::vector<double>& total_ms() const {
+    return total_ms_;
+  }
+
+  int batches() const {
+    return batches_;
+  }
+
+ private:
+  struct Job;
+
+  std::shared_ptr<Job> CreateJob(const RenderRequest& request);
+  void Serve(net::Socket socket);
+  void Dispatch();
+  void RenderBatch(std::vector<std::shared_ptr<Job>>& batch);
+  const std::vector<Vector>& GetBackground(int w, int h);
+
+  distributed::RenderFunction render_;
+  std::vector<Scene> scenes_;
+  std::map<std::pair<int, int>, std::vector<Vector>> backgrounds_;
+  int w_;
+  int h_;
+  int version_count_;
+
+  std::atomic<bool> stop_;
+  std::mutex mutex_;
+  std::condition_variable pending_ready_;
+  std::vector<std::shared_ptr<Job>> pending_;
+  std::vector<double> queue_ms_;
+  std::vector<double> render_ms_;
+  std::vector<double> total_ms_;
+  int batches_;
+};
+
+// Sends one request on an open connection and waits for the image.
+bool Request(net::Socket& socket, const RenderRequest& request,
+             std::vector<Vector>& image, int& w, int& h, Latency& latency);
+
+bool RequestStop(const char* host, int port);
+
+} // namespace server
+
+#endif // RTBENCH_SERVER_H_